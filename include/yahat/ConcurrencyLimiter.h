@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "yahat/config.h"
+#include "yahat/Metrics.h"
+
+namespace yahat {
+
+/*! Adaptive limit for concurrent requests
+ *
+ *  The limit is adjusted from the observed latency, using the gradient
+ *  algorithm from Netflix' concurrency-limits library (Gradient2).
+ *
+ *  A long-term (exponentially smoothed) latency is compared with the latency of
+ *  each sample. When the latency increases, the limit is reduced proportionally.
+ *  When the latency is stable, the limit grows with a queue allowance
+ *  of sqrt(limit), so the limit can probe for more capacity.
+ */
+class ConcurrencyLimiter {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    struct Config {
+        /*! Name of the limiter. Used in logs and metrics.
+         *  Instances with the same name share their metrics.
+         */
+        std::string name = "default";
+
+        unsigned initial_limit = 20;
+        unsigned min_limit = 4;
+        unsigned max_limit = 1000;
+
+        /*! How fast the limit moves toward a new value. (0.0 - 1.0] */
+        double smoothing = 0.2;
+
+        /*! How much the latency may increase before the limit is reduced.
+         *  1.5 allows the latency to rise with 50% */
+        double rtt_tolerance = 1.5;
+
+        /*! Number of samples in the long-term latency average */
+        unsigned long_window = 600;
+    };
+
+    /*! A permit to process one request.
+     *
+     *  The latency sample is recorded when the permit is destroyed.
+     */
+    class Permit {
+    public:
+        Permit(ConcurrencyLimiter& limiter, unsigned inflight)
+            : limiter_{&limiter}, inflight_{inflight} {}
+
+        Permit(const Permit&) = delete;
+        Permit(Permit&& v) noexcept
+            : limiter_{v.limiter_}, start_{v.start_}, inflight_{v.inflight_} {
+            v.limiter_ = {};
+        }
+
+        Permit& operator = (const Permit&) = delete;
+        Permit& operator = (Permit&& v) noexcept {
+            if (this != &v) {
+                if (limiter_) {
+                    limiter_->release(start_, inflight_);
+                }
+                limiter_ = v.limiter_;
+                start_ = v.start_;
+                inflight_ = v.inflight_;
+                v.limiter_ = {};
+            }
+            return *this;
+        }
+
+        ~Permit() {
+            if (limiter_) {
+                limiter_->release(start_, inflight_);
+            }
+        }
+
+        /*! Give the permit back without a latency sample.
+         *
+         *  Used when the time spent is not the latency of a request,
+         *  for example if it was rejected or is an event-stream.
+         */
+        void cancel() noexcept {
+            if (limiter_) {
+                limiter_->release();
+                limiter_ = {};
+            }
+        }
+
+    private:
+        ConcurrencyLimiter *limiter_{};
+        clock_t::time_point start_ = clock_t::now();
+        unsigned inflight_ = 0;
+    };
+
+#ifdef YAHAT_ENABLE_METRICS
+    /*! Constructor
+     *
+     *  @param config Configuration
+     *  @param metrics Optional metrics instance, for example from `HttpServer::metrics()`.
+     */
+    ConcurrencyLimiter(Config config, Metrics *metrics = {});
+#else
+    ConcurrencyLimiter(Config config);
+#endif
+
+    /*! Get a permit to process a request.
+     *
+     *  @return The permit, or nullopt if the limit is reached.
+     */
+    std::optional<Permit> tryAcquire();
+
+    unsigned limit() const noexcept {
+        return limit_.load(std::memory_order_relaxed);
+    }
+
+    unsigned inflight() const noexcept {
+        return inflight_.load(std::memory_order_relaxed);
+    }
+
+    const Config& config() const noexcept {
+        return config_;
+    }
+
+    /*! Add a latency sample. Normally called by `Permit`. */
+    void addSample(std::chrono::nanoseconds rtt, unsigned inflight);
+
+private:
+    void release() noexcept;
+    void release(clock_t::time_point start, unsigned inflight);
+
+    const Config config_;
+    std::atomic<unsigned> limit_;
+    std::atomic<unsigned> inflight_{0};
+
+    std::mutex mutex_;
+    double estimated_limit_;
+    double long_rtt_ = 0.0;
+    uint64_t samples_ = 0;
+
+#ifdef YAHAT_ENABLE_METRICS
+    Metrics::Gauge<uint64_t> *limit_gauge_{};
+    Metrics::Gauge<uint64_t> *inflight_gauge_{};
+    Metrics::Counter<uint64_t> *rejected_{};
+#endif
+};
+
+} // ns
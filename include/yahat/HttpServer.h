@@ -1,14 +1,20 @@
 #pragma once
 
+#include <chrono>
 #include <map>
 #include <functional>
 #include <filesystem>
 #include <string_view>
 #include <future>
+#include <memory_resource>
+#include <optional>
 #include <span>
+#include <variant>
 
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/fields.hpp>
 #include <boost/uuid/uuid.hpp>
 #include <boost/version.hpp>
 
@@ -23,11 +29,19 @@
 #endif
 
 #include "yahat/config.h"
+#include "yahat/QueryArgs.h"
+#include "yahat/RequestId.h"
+#include "yahat/SseEvent.h"
 
 namespace yahat {
 
 class YahatInstanceMetrics;
 class Metrics;
+class RateLimiter;
+class ConcurrencyLimiter;
+class RequestQueue;
+class ResponseCache;
+class SseHub;
 
 struct HttpConfig {
     /*! Number of threads for the API and UI.
@@ -63,9 +77,25 @@ struct HttpConfig {
 
     std::string http_basic_auth_realm;
 
+    /*! Use the id from the clients `X-Request-ID` or `traceparent` header
+     *  as the id for the request, if it's valid.
+     */
+    bool adopt_request_id = true;
+
     /*! IO timeout in seconds for requests in/out */
     unsigned http_io_timeout = 120;
 
+    /*! Max number of events queued for a `SseStream`. When it's full, the oldest event is dropped. */
+    size_t sse_max_queue = 1024;
+
+    /*! Seconds between heartbeats on idle `SseStream` streams.
+     *
+     *  A stream where nothing could be written for 3 intervals is closed. 0 disables the heartbeats.
+     *  Streams written directly by the handler, with `Request::sse_send` or
+     *  `Request::sse_send_event`, don't get heartbeats. The handler owns those writes.
+     */
+    unsigned sse_heartbeat_interval = 15;
+
     /*! Maximum size for a compressed request */
     uint max_decompressed_size = 10 * 1024 * 1024; // 10 MB
 
@@ -81,6 +111,54 @@ struct HttpConfig {
      */
     bool auto_handle_cors = true;
 
+    /*! Adaptive limit for the number of requests processed concurrently.
+     *
+     *  When enabled, the limit is computed from the observed latency of the
+     *  request handlers. Requests above the limit get a fast `503 Service Unavailable`.
+     *  Individual routes can have their own limiter in `RouteOptions`.
+     */
+    bool adaptive_concurrency_limit = false;
+
+    /*! Number of threads for the handlers of routes with `Priority::NORMAL`.
+     *
+     *  When > 0, normal priority handlers run on their own thread-pool, and the
+     *  HTTP worker threads are reserved for network IO and for routes with
+     *  `Priority::HIGH`, like metrics and health checks. That way, high priority
+     *  requests are not queued behind slow user requests when the server is busy.
+     *
+     *  If 0, all the handlers run on the HTTP worker threads. There is then no
+     *  request queue, so the `handler_queue_*` settings are not used, and
+     *  requests are not shed when the server falls behind. Use
+     *  `adaptive_concurrency_limit` or rate limiters to protect such servers.
+     *
+     *  Async operations with `Request::yield` complete on the HTTP worker threads,
+     *  so handlers on the handler threads must not use it for their own IO.
+     *  `Request::sse_send` and `Request::sse_send_event` are safe to use.
+     */
+    size_t num_handler_threads = 0;
+
+    /*! Max number of requests waiting for a handler thread.
+     *
+     *  Requests above this limit get a fast `503 Service Unavailable`
+     *  with a `Retry-After` header. 0 is unlimited.
+     *
+     *  Only used if `num_handler_threads` > 0.
+     */
+    size_t handler_queue_max_depth = 1000;
+
+    /*! Max time in milliseconds a request may wait for a handler thread
+     *  when the queue has not been empty for `handler_queue_interval_ms`.
+     *
+     *  See `RequestQueue`. Only used if `num_handler_threads` > 0.
+     */
+    unsigned handler_queue_target_ms = 5;
+
+    /*! Max time in milliseconds a request may wait for a handler thread.
+     *
+     *  Only used if `num_handler_threads` > 0.
+     */
+    unsigned handler_queue_interval_ms = 100;
+
 #ifdef YAHAT_ENABLE_METRICS
     /*! Enable metrics for this server
      *
@@ -89,6 +167,9 @@ struct HttpConfig {
     bool enable_metrics = true;
 
     std::string metrics_target = "/metrics";
+
+    /*! If true, the metrics endpoint is served without calling the authenticator */
+    bool public_metrics = false;
 #endif
 };
 
@@ -103,7 +184,90 @@ struct Auth {
     std::any extra;
 };
 
+/*! Allocator that uses a `std::pmr::memory_resource`
+ *
+ *  Like `std::pmr::polymorphic_allocator`, but assignable, as required by beast.
+ */
+template <typename T>
+struct ResourceAllocator {
+    using value_type = T;
+
+    ResourceAllocator() noexcept = default;
+    ResourceAllocator(std::pmr::memory_resource *resource) noexcept
+        : resource{resource} {}
+
+    template <typename U>
+    ResourceAllocator(const ResourceAllocator<U>& other) noexcept
+        : resource{other.resource} {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(resource->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, size_t n) noexcept {
+        resource->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    template <typename U>
+    bool operator == (const ResourceAllocator<U>& other) const noexcept {
+        return resource == other.resource;
+    }
+
+    std::pmr::memory_resource *resource = std::pmr::get_default_resource();
+};
+
+/*! Handle for sending Server Sent Events to a client
+ *
+ *  Returned by `Request::sse_stream`. The handle can be copied, and `send()`
+ *  can be called from any thread. The events are queued, and written by the
+ *  clients session.
+ *
+ *  The handler can return as soon as it has the handle. The stream stays
+ *  open until all the copies of the handle are destroyed, `close()` is
+ *  called, or the client disconnects.
+ */
+class SseStream {
+public:
+    struct Impl;
+
+    SseStream() = default;
+    explicit SseStream(std::shared_ptr<Impl> impl)
+        : impl_{std::move(impl)} {}
+
+    /*! Queue one SSE event for the client.
+     *
+     *  @param sseEvent Complete and correctly formatted SSE event.
+     *  @return false if the stream is closed.
+     */
+    bool send(std::string_view sseEvent) const;
+
+    /*! Queue an event built with `SseEvent`, and clear it.
+     *
+     *  The events buffer is moved to the queue, so the event
+     *  starts over with a new buffer.
+     *
+     *  @return false if the stream is closed.
+     */
+    bool send(SseEvent& event) const;
+
+    /*! End the stream after the queued events are sent */
+    void close() const;
+
+    /*! True until the stream is closed by either side */
+    bool isOpen() const;
+
+    explicit operator bool() const noexcept {
+        return impl_ != nullptr;
+    }
+
+private:
+    std::shared_ptr<Impl> impl_;
+};
+
 struct Request {
+    /*! The type for the request headers. The memory is from the requests arena. */
+    using fields_t = boost::beast::http::basic_fields<ResourceAllocator<char>>;
+
     enum class Type {
         GET,
         PUT,
@@ -130,13 +294,122 @@ struct Request {
     std::string_view route; // The part of the target that was matched by the chosen route.
     std::string body;
     Type type = Type::GET;
-    boost::uuids::uuid uuid = generateUuid();
+    /*! Id for the request. Generated when it's first used, unless it's adopted from the client. */
+    RequestId uuid;
     Auth auth;
+    boost::asio::ip::tcp::endpoint remote; // The clients endpoint
+    /*! The sessions coroutine.
+     *
+     *  Async operations with it complete on the HTTP worker threads. Don't use it
+     *  from handlers that run on the handler threads (see `HttpConfig::num_handler_threads`).
+     */
     boost::asio::yield_context *yield = {};
-    std::string all_arguments;
-    std::map<std::string_view, std::string_view> arguments;
+    /*! The headers from the HTTP request
+     *
+     *  Owned by the session. Only valid until the handler returns.
+     *  Nothing is copied from the headers.
+     */
+    const fields_t *headers = {};
+
+    /*! Memory for temporary data used by the handler.
+     *
+     *  A monotonic arena that is released in bulk when the request is done,
+     *  so memory from it must not be used after the handler returns.
+     *
+     *  The server uses it for the request and response headers, the query
+     *  arguments, the json body and the access log. Members with standard
+     *  types, like `target`, `body` and the `Response` strings, use the heap.
+     */
+    std::pmr::memory_resource *arena = std::pmr::get_default_resource();
+
+    /*! Set by the server when the handler starts an event-stream (SSE).
+     *
+     *  The time spent in such handlers is not used as a latency sample
+     *  by the concurrency limiters.
+     */
+    bool event_stream = false;
+
+    /*! Get the value of a request header, or an empty view if it's not present.
+     *
+     *  The view is only valid until the handler returns.
+     */
+    std::string_view header(boost::beast::http::field field) const {
+        if (headers) {
+            if (auto it = headers->find(field); it != headers->end()) {
+                const auto value = it->value();
+                return {value.data(), value.size()};
+            }
+        }
+        return {};
+    }
+
+    /*! Get the value of a request header by its name (case insensitive) */
+    std::string_view header(std::string_view name) const {
+        if (headers) {
+            if (auto it = headers->find({name.data(), name.size()}); it != headers->end()) {
+                const auto value = it->value();
+                return {value.data(), value.size()};
+            }
+        }
+        return {};
+    }
+
+#ifdef USING_BOOST_JSON
+    /*! The json body, for routes with `RouteOptions::parse_json`
+     *
+     *  The body is parsed while it's received, and `body` is empty.
+     *  The memory for the value is from the requests arena, and is
+     *  released when the request is done. Copies use the same memory, so
+     *  copy it to a value with other storage if it must outlive the request.
+     *  Not set if the request has no body.
+     */
+    std::optional<boost::json::value> json;
+#endif
+
+    std::string query; // The query string, as it was received (percent-encoded)
+
+    /*! The query arguments
+     *
+     *  The query is scanned the first time this is called, and the
+     *  values are decoded when they are used.
+     */
+    const QueryArgs& args() const {
+        if (!arguments_) {
+            arguments_.emplace(query, arena);
+        }
+        return *arguments_;
+    }
+
+    /*! The query arguments, decoded, in a map
+     *
+     *  Replaces the old `arguments` member. If a key is repeated, the
+     *  last value is used. The views are valid until the request is done.
+     */
+    [[deprecated("Use args()")]]
+    std::map<std::string_view, std::string_view> arguments() const {
+        std::map<std::string_view, std::string_view> map;
+        args().forEach([&](std::string_view key, std::string_view value) {
+            map[key] = value;
+        });
+        return map;
+    }
+
+    /*! The query string, decoded
+     *
+     *  Replaces the old `all_arguments` member.
+     */
+    [[deprecated("Use query or args()")]]
+    std::string all_arguments() const {
+        std::string decoded{query};
+        decoded.resize(QueryArgs::decode(decoded.data(), decoded.size(), false));
+        return decoded;
+    }
 
     /*! Send one SSE event to the client.
+     *
+     *  The stream gets no heartbeats from the server. A handler that keeps
+     *  the stream open must send its own, and a dead peer is detected by
+     *  `HttpConfig::http_io_timeout`. Use `sse_stream` to get heartbeats.
      *
      *  @param sseEvent Complete and correctly formatted SSE event.
      *
@@ -144,6 +417,23 @@ struct Request {
      */
     std::function<void(std::string_view sseEvent)> sse_send;
 
+    /*! Send one SSE event to the client.
+     *
+     *  The event is written as it is, without being copied, and is cleared
+     *  after it's sent, so the same instance can be re-used for the next event.
+     *
+     *  @return false if the operation fails.
+     */
+    std::function<bool(SseEvent& event)> sse_send_event;
+
+    /*! Get a handle for sending SSE events to the client.
+     *
+     *  Unlike `sse_send`, the handle can be used from any thread, also
+     *  after the handler has returned. The event-stream is started when the
+     *  handler returns an ok response. All the calls return the same stream.
+     */
+    std::function<SseStream()> sse_stream;
+
     /*! Check if the connection is still open to the client.
      */
     std::function<bool()> probe_connection_ok;
@@ -158,6 +448,9 @@ struct Request {
     bool expectBody() const noexcept {
         return type == Type::POST || type == Type::PUT || type == Type::PATCH;
     }
+
+private:
+    mutable std::optional<QueryArgs> arguments_;
 };
 
 struct Response {
@@ -177,21 +470,149 @@ struct Response {
     mutable bool cors = false;
     mutable Compression compression = Compression::NONE;
 
-    bool ok() const noexcept {
-        return code / 100 == 2;
+    /*! If set, a `Retry-After` header is added to the reply */
+    std::chrono::seconds retry_after{};
+
+    /*! If set, an `ETag` header is added to the reply, and the server replies
+     *  with `304 Not Modified` if it matches the requests `If-None-Match` header. */
+    std::string etag;
+
+    /*! Body that is shared, for example with a cache. It's sent without being copied.
+     *  Used instead of `body` if set. */
+    std::shared_ptr<const std::string> shared_body;
+
+    /*! Body in memory that outlives the request, like static data. It's sent
+     *  without being copied. Used instead of `body` if set. */
+    std::span<const char> static_body;
+
+    /*! A part of a body that is composed of fragments
+     *
+     *  The data is owned by the fragment, shared, or a span of memory that
+     *  outlives the request, like static data.
+     */
+    class Fragment {
+    public:
+        Fragment(std::string data)
+            : data_{std::move(data)} {}
+
+        Fragment(std::shared_ptr<const std::string> data)
+            : data_{std::move(data)} {}
+
+        Fragment(std::span<const char> data)
+            : data_{data} {}
+
+        std::string_view view() const noexcept {
+            if (const auto *owned = std::get_if<std::string>(&data_)) {
+                return *owned;
+            }
+            if (const auto *shared = std::get_if<std::shared_ptr<const std::string>>(&data_)) {
+                return **shared;
+            }
+            const auto& span = std::get<std::span<const char>>(data_);
+            return {span.data(), span.size()};
+        }
+
+    private:
+        std::variant<std::string, std::shared_ptr<const std::string>, std::span<const char>> data_;
+    };
+
+    /*! Body composed of fragments, like a cached header, a dynamic part and a cached footer.
+     *
+     *  The fragments are sent in one vectored write, without being concatenated.
+     *  Used instead of `body`, `shared_body` and `static_body` if set.
+     */
+    std::vector<Fragment> fragments;
+
+#ifdef USING_BOOST_JSON
+    /*! Body as a json value.
+     *
+     *  It's serialized in chunks directly into the buffers that are written to the
+     *  socket (and compressed on the fly if the client accepts gzip), without first
+     *  being serialized to a string. The reply use chunked transfer-encoding.
+     *  Used instead of the other bodies if set.
+     */
+    std::optional<boost::json::value> json;
+#endif
+
+    /*! Concatenate the fragments, or serialize the json value, into `body`
+     *
+     *  Used when the body must be in one buffer, like when it's cached.
+     */
+    void flatten() {
+#ifdef USING_BOOST_JSON
+        if (json) {
+            body = boost::json::serialize(*json);
+            json.reset();
+            fragments.clear();
+            shared_body.reset();
+            static_body = {};
+            return;
+        }
+#endif
+        if (fragments.empty()) {
+            return;
+        }
+
+        std::string data;
+        data.reserve(bodySize());
+        for(const auto& fragment : fragments) {
+            data += fragment.view();
+        }
+        fragments.clear();
+        shared_body.reset();
+        static_body = {};
+        body = std::move(data);
+    }
+
+    /*! Size of the body, including the fragments. Does not include `json`. */
+    size_t bodySize() const noexcept {
+        if (fragments.empty()) {
+            return bodyView().size();
+        }
+
+        size_t size = 0;
+        for(const auto& fragment : fragments) {
+            size += fragment.view().size();
+        }
+        return size;
     }
 
-    std::string responseStatusAsJson() const {
+    bool hasBody() const noexcept {
 #ifdef USING_BOOST_JSON
-        boost::json::object o;
-        o["error"] = code / 100 > 2;
-        o["status"] = code;
-        o["reason"] = reason;
-        return boost::json::serialize(o);
-#else
-        return {};
+        if (json) {
+            return true;
+        }
 #endif
+        return bodySize() > 0;
     }
+
+    /*! The body, from `shared_body`, `static_body` or `body`
+     *
+     *  Does not include the fragments. Call `flatten()` first if they may be used.
+     */
+    std::string_view bodyView() const noexcept {
+        if (shared_body) {
+            return *shared_body;
+        }
+        if (!static_body.empty()) {
+            return {static_body.data(), static_body.size()};
+        }
+        return body;
+    }
+
+    bool ok() const noexcept {
+        return code / 100 == 2;
+    }
+
+    /*! Json body with the status code and reason */
+    std::string responseStatusAsJson() const;
+
+    /*! Precomputed json body with the status code and reason
+     *
+     *  Available for the common combinations of code and reason.
+     *  Returns an empty view for the others.
+     */
+    std::string_view staticStatusJson() const noexcept;
 };
 
 struct AuthReq {
@@ -211,6 +632,94 @@ struct AuthReq {
  */
 using authenticator_t = std::function<Auth(const AuthReq&)>;
 
+/*! Asynchronous authenticator
+ *
+ *  Alternative to `authenticator_t` for authenticators that must call
+ *  other services, like a token introspection endpoint. The awaitable is
+ *  run on the servers io-context, and the session waits for it without
+ *  blocking a worker-thread.
+ *
+ *  The awaitable must not use `AuthReq::yield`.
+ */
+using async_authenticator_t = std::function<boost::asio::awaitable<Auth>(const AuthReq&)>;
+
+
+/*! How a route use the authenticator */
+enum class AuthPolicy {
+    /// The authenticator is not called. `Request::auth` is empty.
+    PUBLIC,
+    /// The authenticator is called, but the request is passed to the handler even if access is denied.
+    OPTIONAL,
+    /// The authenticator is called, and the request is rejected with 401 if access is denied.
+    REQUIRED
+};
+
+/*! Priority class for a route */
+enum class Priority {
+    /// User requests. Run on the handler threads, if `HttpConfig::num_handler_threads` is set.
+    NORMAL,
+    /// Health checks, metrics, admin. Run on the HTTP worker threads and are not limited by the servers concurrency limiter.
+    HIGH
+};
+
+/*! Options for a route */
+struct RouteOptions {
+    AuthPolicy auth = AuthPolicy::REQUIRED;
+
+    Priority priority = Priority::NORMAL;
+
+    /*! Optional rate limiter for the route.
+     *
+     *  Requests that exceed the limit get a `429 Too Many Requests` reply.
+     *  The same limiter can be shared by several routes.
+     */
+    std::shared_ptr<RateLimiter> rate_limiter;
+
+    /*! Optional adaptive concurrency limiter for the route.
+     *
+     *  Applied in addition to the servers limiter, if that is enabled.
+     */
+    std::shared_ptr<ConcurrencyLimiter> concurrency_limiter;
+
+    /*! Optional cache for the responses from GET requests.
+     *
+     *  Only use this for routes where GET is idempotent, and the
+     *  response only depends on the target, the query arguments and
+     *  (depending on the caches scope) the account.
+     */
+    std::shared_ptr<ResponseCache> cache;
+
+    /*! Coalesce identical concurrent GET requests.
+     *
+     *  When a GET request arrives while the handler is processing an identical
+     *  request (same target, query arguments and account, or the same cache key
+     *  if the route has a cache), it waits for that request and gets a copy
+     *  of its response, instead of calling the handler again.
+     *
+     *  Don't use this for routes that use SSE.
+     */
+    bool coalesce = false;
+
+    /*! Add an ETag to successful responses with a body.
+     *
+     *  The ETag is a hash of the body. If it matches the requests `If-None-Match`
+     *  header, the server replies with `304 Not Modified` without a body.
+     */
+    bool etag = false;
+
+#ifdef USING_BOOST_JSON
+    /*! Parse json request bodies while they are received.
+     *
+     *  The bytes are fed to a json parser as they arrive, instead of
+     *  first being buffered as a string. The value is in `Request::json`.
+     *  Requests with invalid json get a `400 Bad Request` reply.
+     */
+    bool parse_json = false;
+#endif
+
+    /*! SSE hub for the route. Set by `HttpServer::addSseRoute()`. */
+    std::shared_ptr<SseHub> sse_hub;
+};
 
 class RequestHandler {
 public:
@@ -276,6 +785,7 @@ public:
     using handler_t = std::shared_ptr<RequestHandler>;//std::function<Response (const Request& req)>;
 
     HttpServer(const HttpConfig& config, authenticator_t authHandler, const std::string& branding = {});
+    ~HttpServer();
 
 #ifdef YAHAT_ENABLE_METRICS
     /*! Constructor
@@ -315,17 +825,46 @@ public:
         addRoute_(target, handler, m);
     }
 
-    void addRoute_(std::string_view target, handler_t handler, const std::span<std::string_view> metricMethods = {});
+    template <typename... T>
+    void addRoute(std::string_view target, handler_t handler, RouteOptions options, T... methods)
+    {
+        std::array<std::string_view, sizeof...(T)> m = {methods...};
+        addRoute_(target, handler, m, std::move(options));
+    }
+
+    void addRoute_(std::string_view target, handler_t handler, const std::span<std::string_view> metricMethods = {},
+                   RouteOptions options = {});
 #else
-    void addRoute(std::string_view target, handler_t handler);
+    void addRoute(std::string_view target, handler_t handler, RouteOptions options = {});
 #endif
 
+    /*! Add a route where clients subscribe to events from a SSE hub.
+     *
+     *  The subscription requests are handled by the server. The connection is
+     *  streaming events from the hub until the client disconnects.
+     */
+    void addSseRoute(std::string_view target, std::shared_ptr<SseHub> hub, RouteOptions options = {});
+
+    struct Route {
+        handler_t handler;
+        RouteOptions options;
+    };
+
+    struct RouteMatch {
+        const Route *route = {};
+        std::string_view target; // The route that matched
+    };
+
+    /*! Find the route with the longest match for a target */
+    RouteMatch findRoute(std::string_view target) const noexcept;
+
     static std::string_view version() noexcept;
 
     std::pair<bool, std::string_view /* user name */> Authenticate(const std::string_view& authHeader);
 
     // Called by the HTTP server implementation template
     Response onRequest(Request& req) noexcept;
+    Response onRequest(Request& req, const RouteMatch& match) noexcept;
 
     // Serve a directory.
     // handles `index.html` by default. Lists the directory if there is no index.html.
@@ -353,6 +892,31 @@ public:
         return authenticator_;
     }
 
+    /*! Use an asynchronous authenticator.
+     *
+     *  Must be called before `start()`. If set, it is used instead of the
+     *  authenticator passed to the constructor.
+     *
+     *  @param authenticator The authenticator
+     *  @param singleflight If true, concurrent requests with the same `Authorization`
+     *         header, method and target share the result from one call to the authenticator.
+     */
+    void setAuthenticator(async_authenticator_t authenticator, bool singleflight = true);
+
+    const auto& asyncAuthenticator() const {
+        return async_authenticator_;
+    }
+
+    // Called by the HTTP server implementation template
+    Auth authenticateAsync(const AuthReq& ar);
+
+    // The reply to coalesced requests, shared by the callers
+    struct CoalescedReply;
+
+    // Called by the HTTP server implementation template
+    std::shared_ptr<const CoalescedReply> coalesce(const std::string& key, boost::asio::yield_context& yield,
+                                                   const std::function<std::shared_ptr<const CoalescedReply>()>& fn);
+
     std::string_view serverId() const noexcept {
         return server_;
     }
@@ -371,17 +935,55 @@ public:
     }
 #endif
 
+    /*! Context for the handler threads.
+     *
+     *  Only used if `HttpConfig::num_handler_threads` is set.
+     */
+    auto& getHandlerCtx() {
+        return handler_ctx_;
+    }
+
+    /*! The queue for the handler threads, or nullptr if they are not enabled */
+    RequestQueue *requestQueue() noexcept {
+        return request_queue_.get();
+    }
+
+    /*! The servers adaptive concurrency limiter, or nullptr if it is not enabled */
+    ConcurrencyLimiter *concurrencyLimiter() noexcept {
+        return concurrency_limiter_.get();
+    }
+
+    /*! The hub that keeps the streams from `Request::sse_stream` alive */
+    SseHub& sseStreams() noexcept {
+        return *sse_streams_;
+    }
+
 private:
     void startWorkers();
+    void init();
+#ifdef YAHAT_ENABLE_METRICS
+    void addMetricsRoute();
+#endif
 
     const HttpConfig& config_;
 #ifdef YAHAT_ENABLE_METRICS
     std::shared_ptr<YahatInstanceMetrics> metrics_{};
 #endif
+    std::shared_ptr<ConcurrencyLimiter> concurrency_limiter_;
+    std::shared_ptr<RequestQueue> request_queue_;
     const authenticator_t authenticator_;
-    std::map<std::string, handler_t> routes_;
+    async_authenticator_t async_authenticator_;
+    bool auth_singleflight_ = true;
+    struct Flights;
+    std::unique_ptr<Flights> flights_;
+    std::map<std::string, Route> routes_;
     boost::asio::io_context ctx_;
     std::vector<std::thread> workers_;
+    boost::asio::io_context handler_ctx_;
+    std::optional<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> handler_work_;
+    std::vector<std::thread> handler_workers_;
+    // Uses ctx_, so it must be destroyed first
+    std::shared_ptr<SseHub> sse_streams_;
     std::promise<void> promise_;
     const std::string server_;
 };
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "yahat/HttpServer.h"
+
+#ifdef USING_BOOST_JSON
+
+namespace yahat {
+
+/*! Built-in authenticator for JWT bearer tokens.
+ *
+ *  Supports HS256, RS256 and ES256 signatures. The keys are read from
+ *  a local JWKS file (RFC 7517), which is re-loaded when it changes on disk.
+ *
+ *  Tokens that are successfully verified are kept in a bounded LRU cache
+ *  until they expire, so the signature is only verified once per token,
+ *  and not once per request.
+ *
+ *  When a token is accepted, `Auth::account` is set from the configured
+ *  claim and `Auth::extra` holds a `std::shared_ptr<const boost::json::object>`
+ *  with all the claims in the token.
+ */
+class JwtAuthenticator {
+public:
+    struct Config {
+        /*! Path to a JWKS file with the keys used to verify the tokens */
+        std::filesystem::path jwks_path;
+
+        /*! How often we check if the JWKS file has changed */
+        std::chrono::seconds jwks_check_interval{5};
+
+        /*! Max number of verified tokens to keep in the cache. 0 disables the cache. */
+        size_t max_cached_tokens = 10000;
+
+        /*! Allowed clock skew when validating `exp` and `nbf` */
+        std::chrono::seconds leeway{30};
+
+        /*! If not empty, the `iss` claim must match this value */
+        std::string issuer;
+
+        /*! If not empty, the `aud` claim must be or contain this value */
+        std::string audience;
+
+        /*! The claim that is mapped to `Auth::account` */
+        std::string account_claim = "sub";
+    };
+
+    struct Key;
+    struct KeySet;
+
+    /*! Constructor
+     *
+     *  @param config Configuration.
+     *
+     *  @exception std::exception if the JWKS file cannot be loaded.
+     */
+    explicit JwtAuthenticator(Config config);
+    ~JwtAuthenticator();
+
+    JwtAuthenticator(const JwtAuthenticator&) = delete;
+    JwtAuthenticator(JwtAuthenticator&&) = delete;
+    JwtAuthenticator& operator = (const JwtAuthenticator&) = delete;
+    JwtAuthenticator& operator = (JwtAuthenticator&&) = delete;
+
+    /*! Authenticate a request from its `Authorization: Bearer` header */
+    Auth authenticate(const AuthReq& ar);
+
+    /*! Verify a token and map its claims into an `Auth` object.
+     *
+     *  @param token The encoded token, without the `Bearer ` prefix
+     *  @return Auth object. `access` is false if the token is not valid.
+     */
+    Auth verify(std::string_view token);
+
+    /*! Get an authenticator functor for `HttpServer`.
+     *
+     *  The JwtAuthenticator instance must remain valid for the lifetime of the HTTP server.
+     */
+    authenticator_t authenticator() {
+        return [this](const AuthReq& ar) {
+            return authenticate(ar);
+        };
+    }
+
+    /*! Number of tokens currently in the cache */
+    size_t cachedTokens() const;
+
+private:
+    struct CacheEntry {
+        std::string token;
+        Auth auth;
+        std::chrono::system_clock::time_point expires;
+        std::shared_ptr<const KeySet> keys; // The keys the token was verified with
+    };
+
+    using cache_list_t = std::list<CacheEntry>;
+
+    std::shared_ptr<const KeySet> keys();
+    void reloadKeysIfChanged();
+    std::optional<Auth> lookup(std::string_view token, const std::shared_ptr<const KeySet>& keys);
+    void addToCache(std::string_view token, const Auth& auth, std::chrono::system_clock::time_point expires,
+                    std::shared_ptr<const KeySet> keys);
+    void clearCache();
+
+    const Config config_;
+
+    std::mutex keys_mutex_; // Protects keys_
+    std::shared_ptr<const KeySet> keys_;
+    std::mutex reload_mutex_; // Held while the keys are checked and reloaded
+    std::filesystem::file_time_type keys_mtime_{};
+    std::atomic<std::chrono::steady_clock::time_point> next_keys_check_{};
+
+    mutable std::mutex cache_mutex_;
+    cache_list_t lru_;
+    std::unordered_map<std::string_view, cache_list_t::iterator> cache_;
+};
+
+} // ns
+
+#endif // USING_BOOST_JSON
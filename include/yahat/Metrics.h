@@ -241,13 +241,27 @@ public:
         return AddMetric<Info>(std::move(name), std::move(help), std::move(unit), std::move(labels));
     }
 
+    /*! Add a metric, or get the existing one with the same name and labels.
+     *
+     *  Instances that add the same metric, like two rate limiters with
+     *  the default name, share it.
+     *
+     *  @exception std::invalid_argument if the existing metric is of another type.
+     */
     template<typename T>
     T *AddMetric(std::string name, std::string help, std::string unit = {}, labels_t labels = {}) {
         auto c = std::make_unique<T>(std::move(name), std::move(help), std::move(unit), std::move(labels));
         auto * ptr = c.get();
         std::lock_guard lock(mutex_);
         auto key = DataType::makeKey(c->name(), c->labels(), c->type());
-        metrics_.emplace(key, std::move(c));
+        auto [it, added] = metrics_.emplace(key, std::move(c));
+        if (!added) {
+            auto * existing = dynamic_cast<T *>(it->second.get());
+            if (!existing) {
+                throw std::invalid_argument("Metric already exists with another type");
+            }
+            return existing;
+        }
         return ptr;
     }
 
@@ -318,7 +332,7 @@ private:
     static std::optional<std::chrono::system_clock::time_point> now_; // Fot unit tests
 
     alignas(cache_line_size_) std::mutex mutex_;
-    std::array<char, cache_line_size_ - sizeof(std::mutex)> mpadding_{};
+    char mpadding_[cache_line_size_ - sizeof(std::mutex)]{};
 };
 
 } // ns
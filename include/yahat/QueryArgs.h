@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <boost/container/small_vector.hpp>
+
+namespace yahat {
+
+/*! The query arguments from a request target
+ *
+ *  The query is only scanned when it's assigned, to find the keys and values.
+ *  The values are percent-decoded (and '+' is decoded to space) in place,
+ *  the first time they are accessed. The keys are decoded when the query
+ *  is scanned.
+ *
+ *  The arguments are kept in order, in a flat vector with inline storage
+ *  for the common case with few arguments.
+ *
+ *  The instance is not thread-safe, not even for const methods.
+ */
+class QueryArgs {
+public:
+    /*! Constructor
+     *
+     *  @param query Encoded query string, without the leading '?'
+     *  @param memory Memory resource for the copy of the query
+     */
+    explicit QueryArgs(std::string_view query = {},
+                       std::pmr::memory_resource *memory = std::pmr::get_default_resource())
+        : buffer_{memory} {
+        assign(query);
+    }
+
+    /*! Copy and scan an encoded query string, without the leading '?' */
+    void assign(std::string_view query);
+
+    /*! Get the decoded value for a key.
+     *
+     *  If the key is repeated, the last value is returned.
+     */
+    std::optional<std::string_view> get(std::string_view key) const;
+
+    /*! Get the decoded value for a key, or `defaultValue` */
+    std::string_view get(std::string_view key, std::string_view defaultValue) const {
+        return get(key).value_or(defaultValue);
+    }
+
+    bool contains(std::string_view key) const {
+        return find(key) != nullptr;
+    }
+
+    /*! Call `fn(key, value)` for each argument, in the order they appear in the query */
+    template <typename fnT>
+    void forEach(fnT&& fn) const {
+        for(auto& arg : args_) {
+            fn(key(arg), value(arg));
+        }
+    }
+
+    size_t size() const noexcept {
+        return args_.size();
+    }
+
+    bool empty() const noexcept {
+        return args_.empty();
+    }
+
+    /*! Decode a percent-encoded string in place.
+     *
+     *  Invalid escapes are kept as they are.
+     *
+     *  @return the length of the decoded string.
+     */
+    static size_t decode(char *data, size_t len, bool plusIsSpace = true) noexcept;
+
+private:
+    // Offsets into buffer_, so that a copy of the instance is valid
+    struct Arg {
+        uint32_t key = 0;
+        uint32_t key_len = 0;
+        uint32_t value = 0;
+        uint32_t value_len = 0;
+        bool encoded = false; // The value is not decoded yet
+    };
+
+    void add(size_t begin, size_t eq, size_t end, bool keyEncoded, bool valueEncoded);
+    const Arg *find(std::string_view key) const;
+
+    std::string_view key(const Arg& arg) const noexcept {
+        return {buffer_.data() + arg.key, arg.key_len};
+    }
+
+    std::string_view value(const Arg& arg) const;
+
+    // Mutable, because the values are decoded on demand
+    mutable std::pmr::string buffer_;
+    mutable boost::container::small_vector<Arg, 8> args_;
+};
+
+} // ns
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "yahat/config.h"
+#include "yahat/HttpServer.h"
+#include "yahat/Metrics.h"
+
+namespace yahat {
+
+/*! Token-bucket rate limiter
+ *
+ *  Each key (remote IP, account or a custom key) has its own bucket. The buckets
+ *  are kept in a sharded table. Looking up a bucket only takes a shared lock on
+ *  its shard, and the bucket itself is updated lock-free.
+ *
+ *  The buckets are implemented with GCRA (Generic Cell Rate Algorithm), which
+ *  is equivalent to a token bucket, but only needs one atomic integer per key.
+ *
+ *  When a shard is full, the buckets that are completely refilled are
+ *  removed. If that is not enough, the least recently used bucket is removed.
+ */
+class RateLimiter {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    enum class KeyType {
+        /// The remote IP address
+        REMOTE_IP,
+        /// `Auth::account`, or the remote IP if the request is not authenticated
+        ACCOUNT,
+        /// The key returned by `Config::custom_key`
+        CUSTOM
+    };
+
+    struct Config {
+        /*! Name of the limiter. Used in logs and metrics.
+         *  Instances with the same name share their metrics.
+         */
+        std::string name = "default";
+
+        /*! Sustained rate, in requests per second */
+        double rate = 10.0;
+
+        /*! Max burst size (the capacity of the bucket) */
+        unsigned burst = 20;
+
+        KeyType key = KeyType::REMOTE_IP;
+
+        /*! Key function for `KeyType::CUSTOM` */
+        std::function<std::string(const Request&)> custom_key;
+
+        /*! Number of shards. Rounded up to a power of 2. */
+        size_t shards = 16;
+
+        /*! Max number of keys in one shard */
+        size_t max_keys_per_shard = 4096;
+    };
+
+    struct Result {
+        bool allowed = true;
+
+        /*! When the client may try again, if the request was not allowed */
+        std::chrono::seconds retry_after{};
+    };
+
+#ifdef YAHAT_ENABLE_METRICS
+    /*! Constructor
+     *
+     *  @param config Configuration
+     *  @param metrics Optional metrics instance, for example from `HttpServer::metrics()`.
+     */
+    RateLimiter(Config config, Metrics *metrics = {});
+#else
+    RateLimiter(Config config);
+#endif
+
+    /*! Check (and consume) one request from the bucket for the requests key */
+    Result check(const Request& req, clock_t::time_point now = clock_t::now());
+
+    /*! Check (and consume) one request from the bucket for a key */
+    Result check(std::string_view key, clock_t::time_point now = clock_t::now());
+
+    const Config& config() const noexcept {
+        return config_;
+    }
+
+    /*! Number of keys currently tracked */
+    size_t size() const;
+
+private:
+    struct Bucket {
+        // Theoretical arrival time in ns since the limiters epoch
+        std::atomic<int64_t> tat;
+        std::atomic<int64_t> last_seen;
+    };
+
+    // A key, tagged with where it's from, so that for example an account
+    // never shares a bucket with an IP address. Stored as the tag followed by the value.
+    struct KeyRef {
+        char tag;
+        std::string_view value;
+    };
+
+    struct KeyHash {
+        using is_transparent = void;
+
+        size_t operator()(const KeyRef& key) const noexcept {
+            return std::hash<std::string_view>{}(key.value) ^ (static_cast<size_t>(key.tag) * 0x9e3779b97f4a7c15ULL);
+        }
+
+        size_t operator()(const std::string& key) const noexcept {
+            return (*this)(toRef(key));
+        }
+    };
+
+    struct KeyEqual {
+        using is_transparent = void;
+
+        bool operator()(const std::string& a, const std::string& b) const noexcept {
+            return a == b;
+        }
+
+        bool operator()(const KeyRef& a, const std::string& b) const noexcept {
+            const auto ref = toRef(b);
+            return a.tag == ref.tag && a.value == ref.value;
+        }
+
+        bool operator()(const std::string& a, const KeyRef& b) const noexcept {
+            return (*this)(b, a);
+        }
+    };
+
+    static KeyRef toRef(const std::string& key) noexcept {
+        return {key.front(), std::string_view{key}.substr(1)};
+    }
+
+    // Keep the shards on separate cache lines
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, Bucket, KeyHash, KeyEqual> buckets;
+    };
+
+    Result consume(KeyRef key, clock_t::time_point now);
+    Result consume(const boost::asio::ip::address& address, clock_t::time_point now);
+    Result take(Bucket& bucket, int64_t now);
+    void evict(Shard& shard, int64_t now);
+    int64_t toNs(clock_t::time_point when) const noexcept;
+
+    const Config config_;
+    const int64_t interval_ns_;    // Time between requests at the sustained rate
+    const int64_t tolerance_ns_;   // How far ahead of now the tat may be
+    const clock_t::time_point epoch_ = clock_t::now();
+    size_t shard_mask_ = 0;
+    std::unique_ptr<Shard[]> shards_;
+
+#ifdef YAHAT_ENABLE_METRICS
+    Metrics::Counter<uint64_t> *allowed_{};
+    Metrics::Counter<uint64_t> *limited_{};
+    Metrics::Gauge<uint64_t> *keys_{};
+#endif
+};
+
+} // ns
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+
+namespace yahat {
+
+/*! Monotonic arena for the memory used while processing one request
+ *
+ *  Each session owns one, and releases it in bulk when a request is done,
+ *  so the next request on the connection re-uses the same initial buffer.
+ *
+ *  The allocations from the arena, and the blocks it gets from the heap
+ *  when it's full, are counted separately, so that regressions show up
+ *  in the metrics.
+ *
+ *  The instance is not thread-safe.
+ */
+class RequestArena : public std::pmr::memory_resource {
+public:
+    static constexpr size_t initial_size = 16 * 1024;
+
+    RequestArena();
+
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator = (const RequestArena&) = delete;
+
+    /*! Release all the memory, and return the number of allocations since the last release */
+    uint64_t release();
+
+    /*! Number of blocks allocated from the heap since the last call */
+    uint64_t overflows();
+
+private:
+    // Counts the blocks the arena gets from the heap when the initial buffer is used up
+    struct Upstream : public std::pmr::memory_resource {
+        void *do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const memory_resource& other) const noexcept override;
+
+        uint64_t blocks = 0;
+    };
+
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const memory_resource& other) const noexcept override;
+
+    std::unique_ptr<std::byte[]> initial_;
+    Upstream upstream_;
+    std::pmr::monotonic_buffer_resource arena_;
+    uint64_t allocations_ = 0;
+};
+
+} // ns
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include <boost/uuid/uuid.hpp>
+
+namespace yahat {
+
+/*! Id for a request
+ *
+ *  The id is generated the first time it's used, so requests that are
+ *  never logged don't pay for it. Generated ids are UUIDv7 (time ordered),
+ *  made from a per-thread random generator, so no locks are needed.
+ *
+ *  An id from the client, in a `X-Request-ID` or `traceparent` header, can
+ *  be adopted instead, so that the request can be followed across services.
+ *
+ *  Copies have the same id. The instance is not thread-safe.
+ */
+class RequestId {
+public:
+    RequestId() = default;
+    RequestId(const RequestId& other);
+    RequestId& operator = (const RequestId& other);
+
+    /*! Use the id from a `X-Request-ID` header.
+     *
+     *  Ids longer than 128 characters, or with characters outside of
+     *  `[A-Za-z0-9._:/+=-]`, are rejected.
+     *
+     *  @return true if the id was adopted
+     */
+    bool adopt(std::string_view requestId);
+
+    /*! Use the trace-id from a W3C `traceparent` header as the id
+     *
+     *  @return true if the header was valid and the id was adopted
+     */
+    bool adoptTraceparent(std::string_view traceparent);
+
+    /*! The id as a UUID.
+     *
+     *  If an id that is not a UUID was adopted, this is the nil UUID.
+     */
+    const boost::uuids::uuid& uuid() const;
+
+    operator const boost::uuids::uuid& () const {
+        return uuid();
+    }
+
+    /*! The id as text */
+    std::string str() const;
+
+    /*! True if the id is from the client */
+    bool adopted() const noexcept {
+        return adopted_;
+    }
+
+    /*! True if the id is adopted or already generated
+     *
+     *  Use it to avoid generating an id that is not needed.
+     */
+    bool known() const noexcept {
+        return ready_;
+    }
+
+    /*! Make a new UUIDv7 */
+    static boost::uuids::uuid generate();
+
+    friend std::ostream& operator << (std::ostream& out, const RequestId& id);
+
+private:
+    void ensure() const;
+
+    mutable boost::uuids::uuid uuid_{};
+    mutable bool ready_ = false;
+    bool adopted_ = false;
+    std::string text_; // An adopted id that is not a UUID
+};
+
+} // ns
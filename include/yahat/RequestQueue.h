@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <string>
+
+#include "yahat/config.h"
+#include "yahat/Metrics.h"
+
+namespace yahat {
+
+/*! Bounded queue for requests waiting for a handler thread
+ *
+ *  The queue itself is the handler threads io-context. This class keeps
+ *  track of the depth of the queue and how long the requests wait, and
+ *  decides which requests to shed.
+ *
+ *  Requests are shed when the queue is full, or when they have waited too
+ *  long. The max wait time is adaptive, inspired by CoDel: As long as the
+ *  queue is empty now and then, a request may wait up to `Config::interval`.
+ *  When the queue has not been empty for `Config::interval`, we have a standing
+ *  queue, and the max wait time drops to `Config::target`. That keeps the
+ *  latency for the requests we process low, instead of letting every request
+ *  wait in a long queue.
+ *
+ *  The server only has a queue when `HttpConfig::num_handler_threads` is set.
+ *  Without handler threads, the handlers run directly on the HTTP worker
+ *  threads, and nothing is queued or shed.
+ */
+class RequestQueue {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    struct Config {
+        /*! Name of the queue. Used in logs and metrics.
+         *  Instances with the same name share their metrics.
+         */
+        std::string name = "default";
+
+        /*! Max number of requests in the queue. 0 is unlimited. */
+        size_t max_depth = 1000;
+
+        /*! Max wait time when there is a standing queue */
+        std::chrono::milliseconds target{5};
+
+        /*! How long the queue must be non-empty before it is considered a standing queue.
+         *  This is also the max wait time when there is no standing queue. */
+        std::chrono::milliseconds interval{100};
+    };
+
+    /*! A place in the queue
+     *
+     *  If the ticket is destroyed before it's dequeued, it's removed from the queue.
+     */
+    class Ticket {
+    public:
+        Ticket(RequestQueue& queue, clock_t::time_point enqueued)
+            : queue_{&queue}, enqueued_{enqueued} {}
+
+        Ticket(const Ticket&) = delete;
+        Ticket(Ticket&& v) noexcept
+            : queue_{v.queue_}, enqueued_{v.enqueued_} {
+            v.queue_ = {};
+        }
+
+        Ticket& operator = (const Ticket&) = delete;
+        Ticket& operator = (Ticket&& v) noexcept {
+            if (this != &v) {
+                if (queue_) {
+                    queue_->remove(clock_t::now());
+                }
+                queue_ = v.queue_;
+                enqueued_ = v.enqueued_;
+                v.queue_ = {};
+            }
+            return *this;
+        }
+
+        ~Ticket() {
+            if (queue_) {
+                queue_->remove(clock_t::now());
+            }
+        }
+
+        clock_t::time_point enqueued() const noexcept {
+            return enqueued_;
+        }
+
+    private:
+        friend class RequestQueue;
+
+        RequestQueue *queue_{};
+        clock_t::time_point enqueued_;
+    };
+
+#ifdef YAHAT_ENABLE_METRICS
+    /*! Constructor
+     *
+     *  @param config Configuration
+     *  @param metrics Optional metrics instance, for example from `HttpServer::metrics()`.
+     */
+    RequestQueue(Config config, Metrics *metrics = {});
+#else
+    RequestQueue(Config config);
+#endif
+
+    /*! Add a request to the queue
+     *
+     *  @return The ticket, or nullopt if the queue is full.
+     */
+    std::optional<Ticket> tryEnqueue(clock_t::time_point now = clock_t::now());
+
+    /*! Take a request out of the queue.
+     *
+     *  @return true if the request should be processed, false if it must be shed.
+     */
+    bool dequeue(Ticket& ticket, clock_t::time_point now = clock_t::now());
+
+    size_t depth() const noexcept {
+        return depth_.load(std::memory_order_relaxed);
+    }
+
+    const Config& config() const noexcept {
+        return config_;
+    }
+
+private:
+    void remove(clock_t::time_point now) noexcept;
+    int64_t toNs(clock_t::time_point when) const noexcept;
+
+    const Config config_;
+    const clock_t::time_point epoch_ = clock_t::now();
+    std::atomic<size_t> depth_{0};
+
+    // When the queue was last empty, in ns since epoch_
+    std::atomic<int64_t> last_empty_{0};
+
+#ifdef YAHAT_ENABLE_METRICS
+    Metrics::Gauge<uint64_t> *depth_gauge_{};
+    Metrics::Counter<uint64_t> *dequeued_{};
+    Metrics::Counter<double> *wait_time_{};
+    Metrics::Counter<uint64_t> *shed_full_{};
+    Metrics::Counter<uint64_t> *shed_wait_{};
+#endif
+};
+
+} // ns
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "yahat/config.h"
+#include "yahat/HttpServer.h"
+#include "yahat/Metrics.h"
+
+namespace yahat {
+
+/*! Cache for responses from idempotent GET routes
+ *
+ *  The responses are stored with a TTL, and with the gzip compressed
+ *  body, so a cache hit is sent to the client without calling the handler
+ *  or compressing the body again.
+ *
+ *  The cache has a memory budget. When it's exceeded, the least recently
+ *  used entries are removed. The same cache can be used by several routes.
+ */
+class ResponseCache {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    enum class Scope {
+        /// The response is the same for all clients
+        SHARED,
+        /// The response depends on `Auth::account`
+        ACCOUNT
+    };
+
+    struct Config {
+        /*! Name of the cache. Used in logs and metrics.
+         *  Instances with the same name share their metrics.
+         */
+        std::string name = "default";
+
+        /*! How long a response is valid */
+        std::chrono::milliseconds ttl{1000};
+
+        /*! Max memory used by the cache, in bytes */
+        size_t max_bytes = 64 * 1024 * 1024;
+
+        Scope scope = Scope::ACCOUNT;
+
+        /*! Store a gzip compressed variant of the body, if it's larger than this */
+        size_t min_compress_size = 256;
+    };
+
+    struct Entry {
+        int code = 200;
+        std::string reason;
+        std::string mime_type;
+        std::string body;
+        std::string gzip_body; // Empty if the body is not compressed
+        std::string etag;
+        clock_t::time_point expires;
+
+        /*! Approximate memory used by the entry */
+        size_t size() const noexcept {
+            return sizeof(Entry) + reason.size() + mime_type.size() + body.size()
+                   + gzip_body.size() + etag.size();
+        }
+    };
+
+    using entry_t = std::shared_ptr<const Entry>;
+
+#ifdef YAHAT_ENABLE_METRICS
+    /*! Constructor
+     *
+     *  @param config Configuration
+     *  @param metrics Optional metrics instance, for example from `HttpServer::metrics()`.
+     */
+    ResponseCache(Config config, Metrics *metrics = {});
+#else
+    ResponseCache(Config config);
+#endif
+
+    /*! Make the cache key for a request
+     *
+     *  The key is the target, the query arguments, and for `Scope::ACCOUNT`, the account.
+     */
+    std::string makeKey(const Request& req) const;
+
+    /*! Get a valid entry, or nullptr */
+    entry_t get(std::string_view key, clock_t::time_point now = clock_t::now());
+
+    /*! Add or replace an entry.
+     *
+     *  `Entry::expires` must be set by the caller, normally to `expires()`
+     */
+    void put(std::string key, entry_t entry);
+
+    clock_t::time_point expires(clock_t::time_point now = clock_t::now()) const noexcept {
+        return now + config_.ttl;
+    }
+
+    const Config& config() const noexcept {
+        return config_;
+    }
+
+    /*! Number of entries in the cache */
+    size_t size() const;
+
+    /*! Approximate memory used by the cache */
+    size_t bytes() const;
+
+    void clear();
+
+private:
+    struct Item {
+        std::string key;
+        entry_t entry;
+    };
+
+    using lru_t = std::list<Item>;
+
+    // Must be called with the lock held
+    void erase(lru_t::iterator it);
+    void updateMetrics();
+
+    const Config config_;
+    mutable std::mutex mutex_;
+    lru_t lru_; // Most recently used first
+    std::unordered_map<std::string_view, lru_t::iterator> index_;
+    size_t bytes_ = 0;
+
+#ifdef YAHAT_ENABLE_METRICS
+    Metrics::Counter<uint64_t> *hits_{};
+    Metrics::Counter<uint64_t> *misses_{};
+    Metrics::Gauge<uint64_t> *entries_{};
+    Metrics::Gauge<uint64_t> *bytes_gauge_{};
+#endif
+};
+
+} // ns
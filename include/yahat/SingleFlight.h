@@ -0,0 +1,150 @@
+#pragma once
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+
+namespace yahat {
+
+/*! Signal that coroutines can wait for.
+ *
+ *  `notify()` can be called from any thread. Waiters are resumed
+ *  on their own executor, so no worker-thread is blocked while waiting.
+ *
+ *  The signal remains set until `reset()` is called, so a waiter that
+ *  arrives after `notify()` returns immediately.
+ */
+class AsyncSignal {
+public:
+    AsyncSignal() = default;
+    AsyncSignal(const AsyncSignal&) = delete;
+    AsyncSignal& operator = (const AsyncSignal&) = delete;
+
+    template <typename CompletionToken>
+    auto async_wait(CompletionToken&& token) {
+        return boost::asio::async_initiate<CompletionToken, void()>(
+            [this](auto handler) {
+                std::unique_lock lock{mutex_};
+                if (signaled_) {
+                    lock.unlock();
+                    complete(std::move(handler));
+                    return;
+                }
+
+                // Handlers may be move-only
+                auto h = std::make_shared<decltype(handler)>(std::move(handler));
+                waiters_.emplace_back([h]() mutable {
+                    complete(std::move(*h));
+                });
+            }, token);
+    }
+
+    void notify() {
+        std::vector<std::function<void()>> waiters;
+        {
+            std::lock_guard lock{mutex_};
+            signaled_ = true;
+            waiters.swap(waiters_);
+        }
+
+        for(auto& w : waiters) {
+            w();
+        }
+    }
+
+    void reset() {
+        std::lock_guard lock{mutex_};
+        signaled_ = false;
+    }
+
+    bool signaled() const {
+        std::lock_guard lock{mutex_};
+        return signaled_;
+    }
+
+private:
+    template <typename Handler>
+    static void complete(Handler&& handler) {
+        auto ex = boost::asio::get_associated_executor(handler);
+        boost::asio::post(ex, [handler=std::move(handler)]() mutable {
+            std::move(handler)();
+        });
+    }
+
+    mutable std::mutex mutex_;
+    bool signaled_ = false;
+    std::vector<std::function<void()>> waiters_;
+};
+
+/*! Suppress duplicate work for concurrent calls with the same key.
+ *
+ *  The first caller for a key runs the function. Callers that arrive
+ *  while it is in flight suspend their coroutine and get a copy of the same
+ *  result (or exception) when it completes.
+ */
+template <typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>>
+class SingleFlight {
+public:
+    template <typename Fn>
+    ValueT run(const KeyT& key, boost::asio::yield_context& yield, Fn&& fn) {
+        std::shared_ptr<Flight> flight;
+        bool leader = false;
+        {
+            std::lock_guard lock{mutex_};
+            auto& f = flights_[key];
+            if (!f) {
+                f = std::make_shared<Flight>();
+                leader = true;
+            }
+            flight = f;
+        }
+
+        if (leader) {
+            try {
+                flight->result.emplace(fn());
+            } catch(...) {
+                flight->error = std::current_exception();
+            }
+
+            {
+                std::lock_guard lock{mutex_};
+                flights_.erase(key);
+            }
+
+            flight->done.notify();
+        } else {
+            flight->done.async_wait(yield);
+        }
+
+        if (flight->error) {
+            std::rethrow_exception(flight->error);
+        }
+
+        return *flight->result;
+    }
+
+    /*! Number of keys currently in flight */
+    size_t size() const {
+        std::lock_guard lock{mutex_};
+        return flights_.size();
+    }
+
+private:
+    struct Flight {
+        std::optional<ValueT> result;
+        std::exception_ptr error;
+        AsyncSignal done;
+    };
+
+    mutable std::mutex mutex_;
+    std::unordered_map<KeyT, std::shared_ptr<Flight>, HashT> flights_;
+};
+
+} // ns
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <string_view>
+
+namespace yahat {
+
+/*! Builder for Server Sent Events
+ *
+ *  The event is written directly into a buffer that starts with room for
+ *  the HTTP chunk header, so `chunk()` returns the complete chunk without
+ *  copying the event. `clear()` keeps the buffer, so an instance that is
+ *  reused for a stream does not allocate memory once the buffer is large
+ *  enough for the events.
+ */
+class SseEvent {
+public:
+    SseEvent() {
+        clear();
+    }
+
+    /*! Set the event type
+     *
+     *  @exception std::runtime_error if the name contains a line break.
+     */
+    SseEvent& event(std::string_view name);
+
+    /*! Set the event id */
+    SseEvent& id(uint64_t id);
+
+    /*! Set the event id
+     *
+     *  @exception std::runtime_error if the id contains a line break or a null character.
+     */
+    SseEvent& id(std::string_view id);
+
+    /*! Tell the client how long to wait before it reconnects */
+    SseEvent& retry(std::chrono::milliseconds delay);
+
+    /*! Add data. Each line in `data` becomes a `data` field.
+     *
+     *  Lines can be separated by "\n", "\r\n" or "\r". If `data` ends
+     *  with a line break, the last field is empty.
+     */
+    SseEvent& data(std::string_view data);
+
+    /*! Add a comment. Each line in `text` becomes a comment line. */
+    SseEvent& comment(std::string_view text);
+
+    /*! The complete event, framed as a HTTP chunk
+     *
+     *  The view is valid until the event is changed or cleared.
+     */
+    std::string_view chunk();
+
+    /*! The complete event, without the chunk framing */
+    std::string_view str();
+
+    /*! Move the complete event, framed as a HTTP chunk, out of the instance
+     *
+     *  The instance is cleared, and starts over with a new buffer.
+     */
+    std::string takeChunk();
+
+    bool empty() const noexcept {
+        return buffer_.size() == header_size;
+    }
+
+    /*! Remove the fields, but keep the memory */
+    void clear() noexcept;
+
+private:
+    // 8 hex digits and CRLF. Leading zeros are allowed in the chunk size.
+    static constexpr size_t header_size = 10;
+    // The empty line that ends the event, and the CRLF that ends the chunk
+    static constexpr std::string_view trailer = "\n\r\n";
+
+    void field(std::string_view name, std::string_view value);
+    void lines(std::string_view name, std::string_view text);
+    void reopen() noexcept;
+    void finish();
+
+    std::string buffer_;
+    bool finished_ = false;
+};
+
+} // ns
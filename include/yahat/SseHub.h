@@ -0,0 +1,353 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "yahat/config.h"
+#include "yahat/HttpServer.h"
+#include "yahat/Metrics.h"
+#include "yahat/SingleFlight.h"
+#include "yahat/TimerWheel.h"
+
+namespace yahat {
+
+/*! Broadcast of Server Sent Events to subscribers of topics
+ *
+ *  Clients subscribe by connecting to a route added with `HttpServer::addSseRoute()`.
+ *  The application calls `publish()` once for each event, and the event is
+ *  encoded once, as a HTTP chunk, into an immutable buffer that is shared
+ *  by all the subscribers. Each subscribers session writes the shared buffer
+ *  to its own connection.
+ *
+ *  The subscribers to a topic are spread over a few lanes, each with its own
+ *  strand. The fan-out to the subscribers is done in batches that are posted
+ *  to the servers worker threads, through the strand for the batches lane.
+ *  The lanes run in parallel. A subscriber stays in the same lane, so it
+ *  gets the events in the order they were published.
+ *
+ *  If `Config::replay_size` is set, the events get an id, and the most recent
+ *  events for each topic are kept in a ring buffer. When a client reconnects
+ *  with a `Last-Event-ID` header, the events it missed are sent from the ring
+ *  buffer before the live events. If it missed too many, it gets `Config::reset_event`.
+ *  Topics without subscribers are removed after `Config::topic_ttl`.
+ *
+ *  Idle streams get a heartbeat (an SSE comment) every `Config::heartbeat_interval`.
+ *  The heartbeats for all the streams are driven by a few timer wheels, not
+ *  by one timer per stream. A stream that has not been able to write anything
+ *  for 3 heartbeat intervals is considered dead, and is cancelled. That aborts
+ *  a write that is stuck on a peer that is gone.
+ *
+ *  Each subscriber has a bounded queue, so a slow client never blocks the
+ *  publisher or the other subscribers. `Config::overflow` decides what
+ *  happens when a queue is full.
+ */
+class SseHub {
+public:
+    /*! An encoded event, ready to be written to a chunked HTTP stream */
+    using buffer_t = std::shared_ptr<const std::string>;
+
+    /*! What to do when a subscribers queue is full */
+    enum class Overflow {
+        /// Drop the oldest queued event
+        DROP_OLDEST,
+        /// Drop all the queued events. For streams where each event has the full state.
+        COALESCE,
+        /// Close the stream. The client can reconnect and get the events it missed from the replay buffer.
+        DISCONNECT
+    };
+
+    struct Config {
+        /*! Name of the hub. Used in logs and metrics.
+         *  Instances with the same name share their metrics.
+         */
+        std::string name = "default";
+
+        /*! Number of subscribers processed by one fan-out job */
+        size_t fanout_batch_size = 256;
+
+        /*! Number of fan-out lanes (strands). 0 uses one for each CPU core.
+         *
+         *  New subscribers fill up a batch in one lane before the next lane is used,
+         *  so topics with few subscribers only use one lane.
+         */
+        size_t fanout_lanes = 0;
+
+        /*! Get the topic for a subscription request.
+         *
+         *  The default is the part of the target after the route, without the
+         *  leading slash. For a route "/events", the target "/events/news" subscribes
+         *  to the topic "news", and "/events" subscribes to "".
+         */
+        std::function<std::string(const Request&)> topic;
+
+        /*! Number of recent events kept for each topic, for replay to clients
+         *  that reconnect. 0 disables replay, and the events are sent without an id.
+         */
+        size_t replay_size = 0;
+
+        /*! Sent to a client that has missed more events than there are in
+         *  the replay buffer. The client must get the full state elsewhere.
+         */
+        std::string reset_event = "event: reset\ndata: {}\n\n";
+
+        /*! How long a topic without subscribers keeps its replay buffer.
+         *
+         *  Only used with `replay_size`. The topics come from the clients targets,
+         *  so they must not be kept forever. 0 keeps them.
+         */
+        std::chrono::milliseconds topic_ttl{std::chrono::minutes{10}};
+
+        /*! Interval between heartbeats on idle streams. 0 disables the heartbeats. */
+        std::chrono::milliseconds heartbeat_interval{15000};
+
+        /*! Number of timer wheels for the heartbeats. 0 uses one for each CPU core. */
+        size_t heartbeat_shards = 0;
+
+        /*! Max number of events queued for one subscriber. 0 is unlimited. */
+        size_t max_queue = 1024;
+
+        Overflow overflow = Overflow::DROP_OLDEST;
+    };
+
+    /*! Settings for a subscribers queue */
+    struct QueueOptions {
+        size_t max_size = 0;
+        Overflow overflow = Overflow::DROP_OLDEST;
+#ifdef YAHAT_ENABLE_METRICS
+        Metrics::Gauge<uint64_t> *queued{};
+        Metrics::Counter<uint64_t> *dropped{};
+        Metrics::Counter<uint64_t> *disconnected{};
+#endif
+    };
+
+    /*! One subscribers connection
+     *
+     *  Events are queued by the fan-out, and written by the subscribers session.
+     */
+    class Subscriber {
+    public:
+        using clock_t = TimerWheel::clock_t;
+
+        Subscriber(std::string topic);
+        Subscriber(std::string topic, QueueOptions queue);
+
+        ~Subscriber();
+
+        const std::string& topic() const noexcept {
+            return topic_;
+        }
+
+        /*! Add an event to the queue and wake up the session
+         *
+         *  If the queue is full, the overflow policy is applied.
+         */
+        void push(buffer_t event);
+
+        /*! Move all the queued events to `events` */
+        void take(std::vector<buffer_t>& events);
+
+        /*! Close the subscription. The session ends the stream. */
+        void close();
+
+        /*! Close the subscription, and abort the sessions IO.
+         *
+         *  Used for dead streams, where the session may be blocked in a write
+         *  that will not complete until the IO timeout.
+         */
+        void cancel();
+
+        /*! Set the function that aborts the sessions IO. Called by `cancel()`.
+         *
+         *  The session must reset it before the connection is destroyed.
+         */
+        void setCancel(std::function<void()> fn);
+
+        bool closed() const;
+
+        /*! End the subscription after the queued events are written */
+        void end();
+
+        bool ended() const;
+
+        /*! Number of queued events */
+        size_t pending() const;
+
+        /*! Called by the session when it has written to the stream */
+        void written(clock_t::time_point when = clock_t::now()) noexcept {
+            last_write_ = when.time_since_epoch().count();
+        }
+
+        clock_t::time_point lastWrite() const noexcept {
+            return clock_t::time_point{clock_t::duration{last_write_.load()}};
+        }
+
+        /*! Signaled when there are new events, or the subscription is closed */
+        AsyncSignal& signal() noexcept {
+            return signal_;
+        }
+
+    private:
+        // Must be called with the lock held
+        void clear();
+
+        const std::string topic_;
+        const QueueOptions options_;
+        mutable std::mutex mutex_;
+        std::deque<buffer_t> queue_;
+        bool closed_ = false;
+        bool ended_ = false;
+        AsyncSignal signal_;
+        std::function<void()> cancel_;
+        std::atomic<clock_t::rep> last_write_{clock_t::now().time_since_epoch().count()};
+    };
+
+#ifdef YAHAT_ENABLE_METRICS
+    /*! Constructor
+     *
+     *  @param ctx io-context used for the fan-out. Normally `HttpServer::getCtx()`.
+     *  @param config Configuration
+     *  @param metrics Optional metrics instance, for example from `HttpServer::metrics()`.
+     */
+    SseHub(boost::asio::io_context& ctx, Config config, Metrics *metrics = {});
+#else
+    SseHub(boost::asio::io_context& ctx, Config config);
+#endif
+
+    ~SseHub();
+
+    /*! Publish an event to all the subscribers of a topic.
+     *
+     *  @param topic The topic
+     *  @param event Complete and correctly formatted SSE event.
+     */
+    void publish(std::string_view topic, std::string_view event);
+
+    /*! The heartbeat, encoded as a HTTP chunk */
+    static const buffer_t& heartbeat();
+
+    /*! Encode an SSE event as a HTTP chunk
+     *
+     *  @param event The event
+     *  @param id If not 0, an `id` field is added to the event.
+     */
+    static buffer_t encode(std::string_view event, uint64_t id = 0);
+
+    /*! Get the topic for a subscription request */
+    std::string topicFor(const Request& req) const;
+
+    /*! Subscribe to a topic
+     *
+     *  @param topic The topic
+     *  @param lastEventId The id of the last event the client received, from the
+     *         `Last-Event-ID` header. The events after it are queued for the new subscriber.
+     */
+    std::shared_ptr<Subscriber> subscribe(std::string topic, std::optional<uint64_t> lastEventId = {});
+    void unsubscribe(const std::shared_ptr<Subscriber>& subscriber);
+
+    /*! Create a subscriber that is not subscribed to a topic
+     *
+     *  Used for the streams from `Request::sse_stream`, where the events are
+     *  queued directly. It gets heartbeats, and is cancelled if it's dead,
+     *  like the subscribers to the topics.
+     */
+    std::shared_ptr<Subscriber> createStream();
+
+    /*! Number of subscribers to a topic */
+    size_t subscribers(std::string_view topic) const;
+
+    /*! Number of topics, including idle topics that are kept for replay */
+    size_t topics() const;
+
+    const Config& config() const noexcept {
+        return config_;
+    }
+
+private:
+    using subscribers_t = std::vector<std::shared_ptr<Subscriber>>;
+    using clock_t = TimerWheel::clock_t;
+    using strand_t = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+    struct Lane {
+        subscribers_t subscribers;
+
+        // Copy of `subscribers`, shared by the fan-out batches until the subscribers change
+        std::shared_ptr<const subscribers_t> snapshot;
+    };
+
+    struct Topic {
+        explicit Topic(size_t numLanes)
+            : lanes(numLanes) {}
+
+        size_t size() const noexcept;
+
+        // A lane for each of the hubs strands
+        std::vector<Lane> lanes;
+
+        // Protects the lanes snapshots, as events can be published with the shared lock
+        std::mutex snapshot_mutex;
+
+        // Id of the last published event
+        uint64_t last_id = 0;
+
+        // Recent events. The event with id `n` is at `n % size()`
+        std::vector<buffer_t> ring;
+
+        // When the topic was last published to, or lost its last subscriber
+        clock_t::time_point last_used = clock_t::now();
+    };
+
+    // A timer wheel, and the asio timer that drives it
+    class HeartbeatShard;
+
+    // Must be called with the lock held
+    void fanOut(Topic& topic, const buffer_t& event);
+    void replay(Topic& topic, Subscriber& subscriber, uint64_t lastEventId);
+
+    // Must be called with the unique lock held
+    void removeIdleTopics(clock_t::time_point now);
+
+    void addHeartbeat(const std::shared_ptr<Subscriber>& subscriber);
+
+    boost::asio::io_context& ctx_;
+    const Config config_;
+    std::vector<strand_t> strands_;
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, Topic> topics_;
+    clock_t::time_point last_sweep_ = clock_t::now();
+    std::vector<std::shared_ptr<HeartbeatShard>> heartbeats_;
+    std::atomic<size_t> next_shard_{0};
+
+#ifdef YAHAT_ENABLE_METRICS
+    Metrics::Gauge<uint64_t> *subscribers_{};
+    Metrics::Counter<uint64_t> *published_{};
+    Metrics::Counter<uint64_t> *replayed_{};
+    Metrics::Counter<uint64_t> *resets_{};
+#endif
+    QueueOptions queue_options_;
+};
+
+/*! The state shared by the copies of a `SseStream` handle */
+struct SseStream::Impl {
+    explicit Impl(std::shared_ptr<SseHub::Subscriber> subscriber)
+        : subscriber{std::move(subscriber)} {}
+
+    ~Impl() {
+        subscriber->end();
+    }
+
+    const std::shared_ptr<SseHub::Subscriber> subscriber;
+};
+
+} // ns
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace yahat {
+
+/*! Hierarchical timer wheel
+ *
+ *  Cheap timers for large numbers of connections, like heartbeats for SSE streams.
+ *  Adding and cancelling a timer is O(1), and each tick only touches the timers
+ *  that expire (and now and then a slot of timers that moves to a lower level).
+ *
+ *  The wheel has 4 levels of 64 slots. A slot at level 0 is one tick, at
+ *  level 1 it's 64 ticks, and so on. Timers further into the future than the
+ *  wheel can hold are put in the last slot, and re-inserted when it's reached.
+ *
+ *  The wheel is not thread-safe.
+ */
+class TimerWheel {
+public:
+    using clock_t = std::chrono::steady_clock;
+    using callback_t = std::function<void()>;
+    using id_t = uint64_t;
+
+    /*! Constructor
+     *
+     *  @param resolution The length of one tick
+     *  @param now Start time for the wheel
+     */
+    TimerWheel(clock_t::duration resolution, clock_t::time_point now = clock_t::now());
+
+    /*! Add a timer
+     *
+     *  @param delay Time until the timer expires. It's rounded up to the next tick.
+     *  @param callback Called when the timer expires
+     *  @param now The current time. The wheel is not advanced while it's empty,
+     *         so if it is, it skips ahead to `now` before the timer is added.
+     *  @return Id that can be used to cancel the timer
+     */
+    id_t add(clock_t::duration delay, callback_t callback, clock_t::time_point now = clock_t::now());
+
+    /*! Cancel a timer
+     *
+     *  @return true if the timer was active
+     */
+    bool cancel(id_t id);
+
+    /*! Advance the wheel to `now`
+     *
+     *  The callbacks for the expired timers are moved to `expired`, so that
+     *  the caller can call them after releasing any locks.
+     */
+    void advance(clock_t::time_point now, std::vector<callback_t>& expired);
+
+    /*! Number of active timers */
+    size_t size() const noexcept {
+        return callbacks_.size();
+    }
+
+    bool empty() const noexcept {
+        return callbacks_.empty();
+    }
+
+    clock_t::duration resolution() const noexcept {
+        return resolution_;
+    }
+
+private:
+    static constexpr unsigned slot_bits = 6;
+    static constexpr uint64_t slots = 1 << slot_bits;
+    static constexpr unsigned levels = 4;
+
+    struct Timer {
+        id_t id;
+        uint64_t expires; // tick
+    };
+
+    using slot_t = std::vector<Timer>;
+
+    void insert(Timer timer);
+    void cascade(unsigned level);
+    void skipTo(clock_t::time_point now);
+
+    const clock_t::duration resolution_;
+    const clock_t::time_point start_;
+    uint64_t current_ = 0; // tick
+    id_t next_id_ = 0;
+    std::array<std::array<slot_t, slots>, levels> wheel_;
+
+    // Cancelled timers are removed from here, and skipped when their slot is reached
+    std::unordered_map<id_t, callback_t> callbacks_;
+};
+
+} // ns
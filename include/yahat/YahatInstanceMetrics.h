@@ -42,6 +42,8 @@ public:
     gauge_t * currentSessions() { return current_sessions_; }
     counter_t * httpRequests(const std::string& route);
     gauge_t * workerThreads() { return worker_threads_; }
+    counter_t * requestArenaAllocations() { return request_arena_allocations_; }
+    counter_t * requestArenaOverflows() { return request_arena_overflows_; }
 
     HttpServer::handler_t metricsHandler();
 
@@ -59,6 +61,8 @@ private:
     counter_t * tcp_connections_{};
     gauge_t * current_sessions_{};
     gauge_t * worker_threads_{};
+    counter_t * request_arena_allocations_{};
+    counter_t * request_arena_overflows_{};
     std::map<std::string, counter_t *> http_requests_; // Count of requests per route
 
     alignas(cache_line_size_) std::mutex mutex_;
@@ -0,0 +1,113 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "yahat/ConcurrencyLimiter.h"
+#include "yahat/logging.h"
+
+using namespace std;
+
+namespace yahat {
+
+#ifdef YAHAT_ENABLE_METRICS
+ConcurrencyLimiter::ConcurrencyLimiter(Config config, Metrics *metrics)
+#else
+ConcurrencyLimiter::ConcurrencyLimiter(Config config)
+#endif
+    : config_{std::move(config)}
+    , limit_{clamp(config_.initial_limit, config_.min_limit, config_.max_limit)}
+    , estimated_limit_(limit_)
+{
+#ifdef YAHAT_ENABLE_METRICS
+    if (metrics) {
+        const Metrics::labels_t labels{{"limiter", config_.name}};
+        limit_gauge_ = metrics->AddGauge("yahat_concurrency_limit", "Current adaptive concurrency limit", {}, labels);
+        inflight_gauge_ = metrics->AddGauge("yahat_concurrency_inflight", "Requests currently being processed", {}, labels);
+        rejected_ = metrics->AddCounter("yahat_concurrency_rejected", "Requests rejected by the concurrency limiter", {}, labels);
+        limit_gauge_->set(limit());
+    }
+#endif
+}
+
+optional<ConcurrencyLimiter::Permit> ConcurrencyLimiter::tryAcquire()
+{
+    auto current = inflight_.load(memory_order_relaxed);
+    do {
+        if (current >= limit()) {
+#ifdef YAHAT_ENABLE_METRICS
+            if (rejected_) {
+                rejected_->inc();
+            }
+#endif
+            return {};
+        }
+    } while(!inflight_.compare_exchange_weak(current, current + 1, memory_order_relaxed));
+
+#ifdef YAHAT_ENABLE_METRICS
+    if (inflight_gauge_) {
+        inflight_gauge_->inc();
+    }
+#endif
+
+    return optional<Permit>{in_place, *this, current + 1};
+}
+
+void ConcurrencyLimiter::release() noexcept
+{
+    inflight_.fetch_sub(1, memory_order_relaxed);
+#ifdef YAHAT_ENABLE_METRICS
+    if (inflight_gauge_) {
+        inflight_gauge_->dec();
+    }
+#endif
+}
+
+void ConcurrencyLimiter::release(clock_t::time_point start, unsigned inflight)
+{
+    release();
+    addSample(clock_t::now() - start, inflight);
+}
+
+void ConcurrencyLimiter::addSample(std::chrono::nanoseconds rtt, unsigned inflight)
+{
+    const auto short_rtt = static_cast<double>(max<int64_t>(rtt.count(), 1));
+
+    lock_guard lock{mutex_};
+
+    // Warm up the long-term average with a simple average, then smooth it exponentially.
+    ++samples_;
+    const auto window = static_cast<double>(min<uint64_t>(samples_, max(config_.long_window, 1u)));
+    long_rtt_ += (short_rtt - long_rtt_) / window;
+
+    // If the long-term latency is much higher than the current, we are recovering
+    // from a period of high latency. Let the long-term average catch up faster.
+    if (long_rtt_ / short_rtt > 2.0) {
+        long_rtt_ *= 0.95;
+    }
+
+    // Don't grow the limit if the application don't use it
+    if (inflight < estimated_limit_ / 2) {
+        return;
+    }
+
+    const auto gradient = clamp(config_.rtt_tolerance * long_rtt_ / short_rtt, 0.5, 1.0);
+    const auto queue_size = sqrt(estimated_limit_);
+    const auto new_limit = estimated_limit_ * gradient + queue_size;
+
+    estimated_limit_ = clamp(estimated_limit_ * (1.0 - config_.smoothing) + new_limit * config_.smoothing,
+                             static_cast<double>(config_.min_limit),
+                             static_cast<double>(config_.max_limit));
+
+    const auto limit = static_cast<unsigned>(estimated_limit_);
+    if (limit != limit_.exchange(limit, memory_order_relaxed)) {
+        LOG_TRACE << "ConcurrencyLimiter " << config_.name << " limit is now " << limit;
+#ifdef YAHAT_ENABLE_METRICS
+        if (limit_gauge_) {
+            limit_gauge_->set(limit);
+        }
+#endif
+    }
+}
+
+} // ns
@@ -1,5 +1,10 @@
 
+#include <bit>
+#include <charconv>
+#include <cstring>
 #include <fstream>
+#include <memory_resource>
+#include <variant>
 
 #define ZLIB_CONST
 #include <zlib.h>
@@ -13,12 +18,20 @@
 #include <boost/beast/ssl.hpp>
 #include <boost/beast/ssl/ssl_stream.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/container/small_vector.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include <boost/uuid/random_generator.hpp>
 #include <boost/scope_exit.hpp>
 
 #include "yahat/logging.h"
 #include "yahat/HttpServer.h"
+#include "yahat/ConcurrencyLimiter.h"
+#include "yahat/RateLimiter.h"
+#include "yahat/RequestArena.h"
+#include "yahat/RequestQueue.h"
+#include "yahat/ResponseCache.h"
+#include "yahat/SingleFlight.h"
+#include "yahat/SseHub.h"
 #include "yahat/YahatInstanceMetrics.h"
 
 using namespace std;
@@ -80,41 +93,206 @@ string decompressGzip(string_view compressedData, size_t maxDecompressedBytes) {
     return decompressed_data;
 }
 
-string compressGzip(string_view input) {
+// Suspend the coroutine and resume it on a thread from another executor.
+template <typename executorT>
+void switchTo(const executorT& ex, boost::asio::yield_context& yield) {
+    boost::asio::async_initiate<boost::asio::yield_context, void()>([ex](auto handler) {
+        boost::asio::post(ex, [handler = std::move(handler)]() mutable {
+            handler();
+        });
+    }, yield);
+}
+
+uint64_t mix64(uint64_t v) noexcept {
+    // splitmix64 finalizer
+    v ^= v >> 30;
+    v *= 0xbf58476d1ce4e5b9ULL;
+    v ^= v >> 27;
+    v *= 0x94d049bb133111ebULL;
+    v ^= v >> 31;
+    return v;
+}
+
+// Fast, non-cryptographic hash, used for ETags.
+// Processes 8 bytes at the time.
+uint64_t hashBody(string_view data) noexcept {
+    constexpr uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = data.size() * k;
+    auto p = data.data();
+    auto len = data.size();
+
+    for(; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = rotl(h ^ mix64(v), 27) * k;
+    }
+
+    if (len) {
+        uint64_t v = 0;
+        memcpy(&v, p, len);
+        h = rotl(h ^ mix64(v), 27) * k;
+    }
+
+    return mix64(h);
+}
+
+string makeEtag(string_view body) {
+    static constexpr string_view hex = "0123456789abcdef";
+    auto h = hashBody(body);
+
+    // Weak, as the same body is sent with different content-encodings
+    string etag = "W/\"0123456789abcdef\"";
+    for(auto i = 18; i > 2; --i, h >>= 4) {
+        etag[i] = hex[h & 0xf];
+    }
+    return etag;
+}
+
+// Weak comparison of the etag with the value of a If-None-Match header
+bool etagMatches(string_view ifNoneMatch, string_view etag) {
+    auto strip = [](string_view v) {
+        while(!v.empty() && (v.front() == ' ' || v.front() == '\t')) {
+            v.remove_prefix(1);
+        }
+        while(!v.empty() && (v.back() == ' ' || v.back() == '\t')) {
+            v.remove_suffix(1);
+        }
+        if (v.starts_with("W/")) {
+            v.remove_prefix(2);
+        }
+        return v;
+    };
+
+    etag = strip(etag);
+    while(!ifNoneMatch.empty()) {
+        const auto pos = ifNoneMatch.find(',');
+        const auto candidate = strip(ifNoneMatch.substr(0, pos));
+        if (candidate == "*" || candidate == etag) {
+            return true;
+        }
+        if (pos == string_view::npos) {
+            break;
+        }
+        ifNoneMatch.remove_prefix(pos + 1);
+    }
+
+    return false;
+}
+
+yahat::Response overloaded() {
+    yahat::Response r{503, "Service Unavailable"};
+    r.retry_after = chrono::seconds{1};
+    return r;
+}
+
+// The compression runs on the request path. The best compression is several
+// times slower than the default, for a few percent smaller bodies.
+constexpr int compression_level = Z_DEFAULT_COMPRESSION;
+
+// Compress a body that may be split in several fragments, as one gzip stream
+string compressGzip(span<const string_view> fragments) {
     z_stream zs;
     memset(&zs, 0, sizeof(zs));
     string compressed_output;
-    compressed_output.reserve(input.size());
+    size_t input_size = 0;
+    for(const auto& fragment : fragments) {
+        input_size += fragment.size();
+    }
+    compressed_output.reserve(input_size);
 
     // Initialize zlib for compression (deflate)
-    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    if (deflateInit2(&zs, compression_level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
         throw std::runtime_error("deflateInit2 failed");
     }
 
-    zs.next_in = reinterpret_cast<const unsigned char*>(input.data());
-    zs.avail_in = input.size();
+    const string_view empty;
+    if (fragments.empty()) {
+        fragments = {&empty, 1};
+    }
+
     array<char, 4096> buffer{};
     int ret{};
 
-    do {
-        zs.next_out = reinterpret_cast<unsigned char*>(buffer.data());
-        zs.avail_out = buffer.size();
+    for(size_t i = 0; i < fragments.size(); ++i) {
+        const auto input = fragments[i];
+        const auto flush = i + 1 >= fragments.size() ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = reinterpret_cast<const unsigned char*>(input.data());
+        zs.avail_in = input.size();
 
-        ret = deflate(&zs, Z_FINISH);
+        do {
+            zs.next_out = reinterpret_cast<unsigned char*>(buffer.data());
+            zs.avail_out = buffer.size();
 
-        if (ret == Z_STREAM_ERROR) {
-            deflateEnd(&zs);
-            throw std::runtime_error("Compression error");
-        }
+            ret = deflate(&zs, flush);
+
+            if (ret == Z_STREAM_ERROR) {
+                deflateEnd(&zs);
+                throw std::runtime_error("Compression error");
+            }
 
-        compressed_output.append(buffer.data(), buffer.size() - zs.avail_out);
+            compressed_output.append(buffer.data(), buffer.size() - zs.avail_out);
 
-    } while (ret != Z_STREAM_END);
+        } while (flush == Z_FINISH ? ret != Z_STREAM_END : zs.avail_out == 0);
+    }
 
     deflateEnd(&zs);
     return compressed_output;
 }
 
+string compressGzip(string_view input) {
+    return compressGzip(span<const string_view>{&input, 1});
+}
+
+// Incremental gzip compression, for bodies that are produced in chunks
+class GzipStream {
+public:
+    GzipStream() {
+        if (deflateInit2(&zs_, compression_level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("deflateInit2 failed");
+        }
+    }
+
+    GzipStream(const GzipStream&) = delete;
+    GzipStream& operator = (const GzipStream&) = delete;
+
+    ~GzipStream() {
+        deflateEnd(&zs_);
+    }
+
+    // The previous input must be consumed
+    void input(string_view data) noexcept {
+        zs_.next_in = reinterpret_cast<const unsigned char*>(data.data());
+        zs_.avail_in = data.size();
+    }
+
+    bool needsInput() const noexcept {
+        return zs_.avail_in == 0;
+    }
+
+    bool finished() const noexcept {
+        return finished_;
+    }
+
+    // Compress the input into `out`, after the `used` bytes that are already there.
+    // Set `finish` when there is no more input. Returns the number of bytes used in `out`.
+    size_t compress(span<char> out, size_t used, bool finish) {
+        zs_.next_out = reinterpret_cast<unsigned char*>(out.data() + used);
+        zs_.avail_out = out.size() - used;
+
+        const auto ret = deflate(&zs_, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR) {
+            throw std::runtime_error("Compression error");
+        }
+
+        finished_ = ret == Z_STREAM_END;
+        return out.size() - zs_.avail_out;
+    }
+
+private:
+    z_stream zs_{};
+    bool finished_ = false;
+};
+
 
 } // anon ns
 
@@ -124,6 +302,14 @@ ostream& operator << (ostream& o, const yahat::Request::Type& t) {
 
 namespace yahat {
 
+// The reply to coalesced requests. Prepared once, by the caller that ran the handler.
+struct HttpServer::CoalescedReply {
+    Response response;
+
+    // Set if the reply was added to the routes cache
+    ResponseCache::entry_t entry;
+};
+
 namespace {
 
 template <typename T>
@@ -144,26 +330,303 @@ private:
     T fn_;
 };
 
+using fields_t = Request::fields_t;
+// Body for the replies. The data is owned by the body, shared, or borrowed
+// from something that outlives the write, so it's never copied into the message.
+// A body composed of fragments is written as a list of buffers, and a json
+// value is serialized in chunks while it's written.
+struct ReplyBody {
+    class value_type {
+    public:
+        void own(std::string data) {
+            data_ = std::move(data);
+        }
+
+        void share(std::shared_ptr<const std::string> data) {
+            data_ = std::move(data);
+        }
+
+        // The data must outlive the write
+        void borrow(std::string_view data) {
+            data_ = data;
+        }
+
+        // The fragments must outlive the write
+        void gather(const std::vector<Response::Fragment>& fragments) {
+            fragments_ = &fragments;
+        }
+
+        const std::vector<Response::Fragment> *fragments() const noexcept {
+            return fragments_;
+        }
+
+#ifdef USING_BOOST_JSON
+        // The value must outlive the write
+        void serialize(const boost::json::value& json, bool gzip) {
+            json_ = &json;
+            gzip_ = gzip;
+        }
+
+        const boost::json::value *json() const noexcept {
+            return json_;
+        }
+
+        bool gzip() const noexcept {
+            return gzip_;
+        }
+#endif
+
+        std::string_view view() const noexcept {
+            if (const auto *owned = get_if<std::string>(&data_)) {
+                return *owned;
+            }
+            if (const auto *shared = get_if<std::shared_ptr<const std::string>>(&data_)) {
+                return **shared;
+            }
+            return get<std::string_view>(data_);
+        }
+
+    private:
+        std::variant<std::string_view, std::string, std::shared_ptr<const std::string>> data_;
+        const std::vector<Response::Fragment> *fragments_ = {};
+#ifdef USING_BOOST_JSON
+        const boost::json::value *json_ = {};
+        bool gzip_ = false;
+#endif
+    };
+
+    // Not known for json values. They are sent with chunked transfer-encoding.
+    static uint64_t size(const value_type& body) noexcept {
+        if (const auto *fragments = body.fragments()) {
+            uint64_t size = 0;
+            for(const auto& fragment : *fragments) {
+                size += fragment.view().size();
+            }
+            return size;
+        }
+        return body.view().size();
+    }
+
+    class writer {
+    public:
+        using const_buffers_type = std::span<const boost::asio::const_buffer>;
+
+        template <bool isRequest, typename fieldsT>
+        writer(const http::header<isRequest, fieldsT>&, const value_type& body)
+            : body_{body} {}
+
+        void init(beast::error_code& ec) {
+            ec = {};
+#ifdef USING_BOOST_JSON
+            if (const auto *json = body_.json()) {
+                try {
+                    json_.emplace();
+                    json_->reset(json);
+                    chunk_ = make_unique<char[]>(chunk_size);
+                    if (body_.gzip()) {
+                        gzip_ = make_unique<GzipStream>();
+                        input_ = make_unique<char[]>(chunk_size);
+                    }
+                } catch(const exception& ex) {
+                    LOG_ERROR << "Failed to prepare json body: " << ex.what();
+                    ec = boost::system::errc::make_error_code(boost::system::errc::not_enough_memory);
+                }
+                return;
+            }
+#endif
+            if (const auto *fragments = body_.fragments()) {
+                for(const auto& fragment : *fragments) {
+                    if (const auto data = fragment.view(); !data.empty()) {
+                        buffers_.emplace_back(data.data(), data.size());
+                    }
+                }
+            } else {
+                const auto data = body_.view();
+                buffers_.emplace_back(data.data(), data.size());
+            }
+        }
+
+        boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+            ec = {};
+#ifdef USING_BOOST_JSON
+            if (json_) {
+                try {
+                    return nextJsonChunk();
+                } catch(const exception& ex) {
+                    LOG_ERROR << "Failed to serialize json body: " << ex.what();
+                    ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+                    return boost::none;
+                }
+            }
+#endif
+            return {{const_buffers_type{buffers_.data(), buffers_.size()}, false}};
+        }
+
+    private:
+#ifdef USING_BOOST_JSON
+        static constexpr size_t chunk_size = 16 * 1024;
+
+        // Serialize the next chunk of the json value into the buffer that is written to the socket
+        std::pair<const_buffers_type, bool> nextJsonChunk() {
+            size_t len = 0;
+            bool more = true;
+            if (gzip_) {
+                // Feed the serialized json to the compressor until a chunk of compressed data is ready
+                while(len < chunk_size && !gzip_->finished()) {
+                    if (gzip_->needsInput() && !json_->done()) {
+                        gzip_->input(json_->read(input_.get(), chunk_size));
+                    }
+                    len = gzip_->compress({chunk_.get(), chunk_size}, len, json_->done());
+                }
+                more = !gzip_->finished();
+            } else {
+                len = json_->read(chunk_.get(), chunk_size).size();
+                more = !json_->done();
+            }
+
+            buffers_.assign(1, {chunk_.get(), len});
+            return {const_buffers_type{buffers_.data(), buffers_.size()}, more};
+        }
+
+        std::optional<boost::json::serializer> json_;
+        std::unique_ptr<char[]> chunk_;
+        std::unique_ptr<char[]> input_;
+        std::unique_ptr<GzipStream> gzip_;
+#endif
+        const value_type& body_;
+        boost::container::small_vector<boost::asio::const_buffer, 8> buffers_;
+    };
+};
+
+using request_t = http::request<http::string_body, fields_t>;
+using response_t = http::response<ReplyBody, fields_t>;
+
+// Make a beast message with the headers in the arena
+template <typename T>
+T makeMessage(std::pmr::memory_resource& arena) {
+    return T{piecewise_construct, make_tuple(), make_tuple(fields_t::allocator_type{&arena})};
+}
+
+using header_parser_t = http::request_parser<http::empty_body, fields_t::allocator_type>;
+
+// Read the body of a request, after the header is read
+template <typename streamT>
+request_t readBody(streamT& stream, beast::flat_buffer& buffer, header_parser_t& header,
+                   boost::asio::yield_context& yield, beast::error_code& ec) {
+    http::request_parser<http::string_body, fields_t::allocator_type> parser{std::move(header)};
+    http::async_read(stream, buffer, parser, yield[ec]);
+    return parser.release();
+}
+
+#ifdef USING_BOOST_JSON
+// Body for requests that feeds the data to a json parser as it's received.
+// If the json is invalid, the rest of the body is discarded, so that the
+// client can get an error reply.
+struct JsonRequestBody {
+    struct value_type {
+        boost::json::stream_parser *parser = {};
+        beast::error_code error;
+    };
+
+    class reader {
+    public:
+        template <bool isRequest, typename fieldsT>
+        reader(http::header<isRequest, fieldsT>&, value_type& body)
+            : body_{body} {}
+
+        void init(const boost::optional<uint64_t>&, beast::error_code& ec) {
+            ec = {};
+        }
+
+        template <typename buffersT>
+        size_t put(const buffersT& buffers, beast::error_code& ec) {
+            ec = {};
+            if (!body_.error) {
+                for(const auto b : beast::buffers_range_ref(buffers)) {
+                    body_.parser->write(static_cast<const char *>(b.data()), b.size(), body_.error);
+                    if (body_.error) {
+                        break;
+                    }
+                }
+            }
+            return beast::buffer_bytes(buffers);
+        }
+
+        void finish(beast::error_code& ec) {
+            ec = {};
+            if (!body_.error) {
+                body_.parser->finish(body_.error);
+            }
+        }
+
+    private:
+        value_type& body_;
+    };
+};
+
+// Lets the json parser get its memory from the request arena
+class JsonArena : public boost::json::memory_resource {
+public:
+    explicit JsonArena(std::pmr::memory_resource& arena)
+        : arena_{arena} {}
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        return arena_.allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        arena_.deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::memory_resource& arena_;
+};
+
+// Read the body of a request, and parse it as json while it's received
+template <typename streamT>
+request_t readJsonBody(streamT& stream, beast::flat_buffer& buffer, header_parser_t& header,
+                       boost::json::stream_parser& json, beast::error_code& jsonError,
+                       boost::asio::yield_context& yield, beast::error_code& ec) {
+    http::request_parser<JsonRequestBody, fields_t::allocator_type> parser{std::move(header)};
+    parser.get().body().parser = &json;
+    http::async_read(stream, buffer, parser, yield[ec]);
+    jsonError = parser.get().body().error;
+    return request_t{std::move(parser.get().base())};
+}
+#endif
+
 string generateUuid() {
     static boost::uuids::random_generator uuid_gen_;
     return boost::uuids::to_string(uuid_gen_());
 }
 
+// Tell the client the id for the request, so that it can be found in our logs
+template <typename T>
+void setRequestId(T& res, const RequestId& id) {
+    res.set("X-Request-ID", id.str());
+}
+
 struct LogRequest {
     LogRequest() = delete;
     LogRequest(const LogRequest& ) = delete;
     LogRequest(LogRequest&& ) = delete;
     LogRequest(const Request& r)
         : type{r.type}
+        , location{r.arena}
+        , replyText{r.arena}
         , uuid{r.uuid} {}
 
     boost::asio::ip::tcp::endpoint local, remote;
     Request::Type type;
-    string location;
+    std::pmr::string location;
     string_view user;
     int replyValue = 0;
-    string replyText;
-    boost::uuids::uuid uuid;
+    std::pmr::string replyText;
+    const RequestId& uuid; // Owned by the request
 
 private:
     std::once_flag done_;
@@ -213,16 +676,36 @@ auto to_type(const http::verb& verb) {
     }
 }
 
+template <typename T>
+void setCorsHeaders(T& res) {
+    res.base().set(http::field::access_control_allow_origin, "*");
+    res.base().set(http::field::access_control_allow_credentials, "true");
+    res.base().set(http::field::access_control_allow_methods, "GET,OPTIONS,POST,PUT,PATCH,DELETE");
+    res.base().set(http::field::access_control_allow_headers, "Authorization, Content-Encoding, Access-Control-Allow-Headers, Origin, Accept, X-Requested-With, Content-Type, Access-Control-Request-Method, Access-Control-Request-Headers");
+}
+
 template <typename T>
 auto makeReply(HttpServer& server, T&res, const Response& r, bool closeConnection, LogRequest& lr, Request::Type rt) {
 
-    string_view body = r.body;
+    string_view body = r.bodyView();
     string body_buffer;
-    if (rt != Request::Type::OPTIONS) {
-        if (r.body.empty()) {
+    const bool has_body = r.hasBody();
+    // Empty fragments are replaced by the status json, like an empty body
+    const bool fragmented = has_body && !r.fragments.empty();
+    const bool gzip = r.compression == Response::Compression::GZIP;
+#ifdef USING_BOOST_JSON
+    const auto *json = r.json ? &*r.json : nullptr;
+#else
+    const void *json = nullptr;
+#endif
+    if (rt != Request::Type::OPTIONS && r.code != 304) {
+        if (!has_body) {
             // Use the http code and reason to compose a json reply
-            body_buffer = r.responseStatusAsJson();
-            body = body_buffer;
+            body = r.staticStatusJson();
+            if (body.empty()) {
+                body_buffer = r.responseStatusAsJson();
+                body = body_buffer;
+            }
             auto mime = Response::getMimeType();
             res.base().set(http::field::content_type, mime);
         } else {
@@ -239,31 +722,430 @@ auto makeReply(HttpServer& server, T&res, const Response& r, bool closeConnectio
         }
     }
 
-    if (!body.empty() && r.compression == Response::Compression::GZIP) {
-        body_buffer = compressGzip(body);
+    if (gzip && !json && (fragmented || !body.empty())) {
+        if (fragmented) {
+            boost::container::small_vector<string_view, 8> fragments;
+            for(const auto& fragment : r.fragments) {
+                fragments.emplace_back(fragment.view());
+            }
+            body_buffer = compressGzip({fragments.data(), fragments.size()});
+        } else {
+            body_buffer = compressGzip(body);
+        }
         body = body_buffer;
         res.base().set(http::field::content_encoding, "gzip");
     }
 
-    res.body() = body;
+    // The response outlives the write, so its body is not copied
+    if (json) {
+#ifdef USING_BOOST_JSON
+        res.body().serialize(*json, gzip);
+        if (gzip) {
+            res.base().set(http::field::content_encoding, "gzip");
+        }
+#endif
+    } else if (!body_buffer.empty()) {
+        res.body().own(std::move(body_buffer));
+    } else if (!has_body) {
+        // The status json, or nothing
+        res.body().borrow(body);
+    } else if (fragmented) {
+        res.body().gather(r.fragments);
+    } else if (r.shared_body) {
+        res.body().share(r.shared_body);
+    } else {
+        res.body().borrow(body);
+    }
     res.result(r.code);
     res.reason(r.reason);
     res.base().set(http::field::server, server.serverId());
     res.base().set(http::field::connection, closeConnection ? "close" : "keep-alive");
+    setRequestId(res.base(), lr.uuid);
     if (r.cors) {
-        res.base().set(http::field::access_control_allow_origin, "*");
-        res.base().set(http::field::access_control_allow_credentials, "true");
-        res.base().set(http::field::access_control_allow_methods, "GET,OPTIONS,POST,PUT,PATCH,DELETE");
-        res.base().set(http::field::access_control_allow_headers, "Authorization, Content-Encoding, Access-Control-Allow-Headers, Origin, Accept, X-Requested-With, Content-Type, Access-Control-Request-Method, Access-Control-Request-Headers");
+        setCorsHeaders(res);
+    }
+
+    if (r.retry_after.count() > 0) {
+        res.base().set(http::field::retry_after, to_string(r.retry_after.count()));
+    }
+
+    if (!r.etag.empty()) {
+        res.base().set(http::field::etag, r.etag);
     }
 
     if (auto mime = r.mimeType(); !mime.empty()) {
         res.base().set(http::field::content_type, {mime.data(), mime.size()});
     }
+    if (json) {
+        // The size is not known until it's serialized
+        res.chunked(true);
+    } else {
+        res.prepare_payload();
+    }
+    lr.set(res);
+}
+
+// Reply from a cached response. The body is already compressed.
+template <typename T>
+void makeReply(HttpServer& server, T&res, const ResponseCache::entry_t& entry, bool gzip, bool cors,
+               bool closeConnection, LogRequest& lr) {
+
+    const auto& e = *entry;
+
+    // The body is shared with the cache. The entry is kept alive by the reply,
+    // even if it's removed from the cache.
+    if (gzip && !e.gzip_body.empty()) {
+        res.body().share({entry, &e.gzip_body});
+        res.base().set(http::field::content_encoding, "gzip");
+    } else {
+        res.body().share({entry, &e.body});
+    }
+
+    res.result(e.code);
+    res.reason(e.reason);
+    res.base().set(http::field::content_type, e.mime_type);
+    res.base().set(http::field::server, server.serverId());
+    res.base().set(http::field::connection, closeConnection ? "close" : "keep-alive");
+    setRequestId(res.base(), lr.uuid);
+    if (!e.gzip_body.empty()) {
+        res.base().set(http::field::vary, "Accept-Encoding");
+    }
+    if (!e.etag.empty()) {
+        res.base().set(http::field::etag, e.etag);
+    }
+    if (cors) {
+        setCorsHeaders(res);
+    }
     res.prepare_payload();
     lr.set(res);
 }
 
+// Key for requests that can share a response
+string coalesceKey(const Request& req) {
+    string key;
+    key.reserve(req.target.size() + req.query.size() + req.auth.account.size() + 2);
+    key = req.target;
+    key += '?';
+    key += req.query;
+    key += ' ';
+    key += req.auth.account;
+    return key;
+}
+
+// The body is moved from the response to the entry, if it's owned by the response
+ResponseCache::entry_t makeCacheEntry(const ResponseCache& cache, Response& r) {
+    r.flatten();
+    auto e = make_shared<ResponseCache::Entry>();
+    e->code = r.code;
+    e->reason = r.reason;
+    if (const auto body = r.bodyView(); body.empty()) {
+        e->body = r.responseStatusAsJson();
+    } else if (r.shared_body || !r.static_body.empty()) {
+        e->body = body;
+    } else {
+        e->body = std::move(r.body);
+    }
+
+    auto mime = r.mimeType();
+    if (mime.empty()) {
+        mime = Response::getMimeType();
+    }
+    e->mime_type = mime;
+    e->etag = r.etag;
+
+    if (e->body.size() >= cache.config().min_compress_size) {
+        e->gzip_body = compressGzip(e->body);
+    }
+
+    e->expires = cache.expires();
+    return e;
+}
+
+// Write the events queued for a subscriber as an event-stream, until the
+// subscription ends or the client disconnects
+template <typename streamT>
+void streamSse(streamT& stream, HttpServer& instance, const shared_ptr<SseHub::Subscriber>& subscriber,
+               const Request& request, LogRequest& lr, boost::asio::yield_context& yield,
+               std::function<void()> onClientClosed = {}) {
+
+    http::response<http::empty_body> res{http::status::ok, 11};
+    res.set(http::field::server, instance.serverId());
+    res.set(http::field::content_type, "text/event-stream");
+    res.set(http::field::cache_control, "no-cache");
+    setRequestId(res, request.uuid);
+    res.chunked(true);
+    lr.set(res);
+
+    beast::error_code ec;
+    auto& tcp_stream = beast::get_lowest_layer(stream);
+    tcp_stream.expires_after(chrono::seconds(instance.config().http_io_timeout));
+    http::response_serializer<http::empty_body> sr{res};
+    http::async_write_header(stream, sr, yield[ec]);
+    if (ec) {
+        LOG_DEBUG << "Request " << request.uuid << " - failed to send SSE header: " << ec;
+        return;
+    }
+
+    subscriber->written();
+
+    // The stream is idle between the events. Idle streams are kept alive,
+    // and dead streams are detected, by the heartbeats from the hub.
+    tcp_stream.expires_never();
+
+    // A dead stream is cancelled from the heartbeat timer, on another thread.
+    // Shutting down the socket is just a system call, and makes a write that
+    // is stuck on the dead peer fail right away.
+    subscriber->setCancel([&tcp_stream] {
+        boost::system::error_code ec;
+        tcp_stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+    });
+    ScopedExit reset_cancel{[&] {
+        subscriber->setCancel({});
+    }};
+
+    // Detect when the client closes the connection
+    auto eos_buffer = make_shared<array<char, 1>>();
+    boost::asio::async_read(stream, boost::asio::buffer(*eos_buffer),
+                            [eos_buffer, subscriber, onClientClosed=std::move(onClientClosed)](beast::error_code ec, size_t) {
+        LOG_TRACE << "SSE subscriber read handler called: " << ec;
+        subscriber->close();
+        if (onClientClosed) {
+            onClientClosed();
+        }
+    });
+
+    vector<SseHub::buffer_t> events;
+    vector<boost::asio::const_buffer> buffers;
+    while(true) {
+        subscriber->signal().async_wait(yield);
+        subscriber->signal().reset();
+        if (subscriber->closed()) {
+            break;
+        }
+
+        subscriber->take(events);
+        if (!events.empty()) {
+            // Write all the pending events in one operation
+            buffers.clear();
+            for(const auto& event : events) {
+                buffers.emplace_back(event->data(), event->size());
+            }
+
+            tcp_stream.expires_after(chrono::seconds(instance.config().http_io_timeout));
+            boost::asio::async_write(stream, buffers, yield[ec]);
+            tcp_stream.expires_never();
+            if (ec) {
+                LOG_DEBUG << "Request " << request.uuid << " - failed to send SSE events: " << ec;
+                return;
+            }
+            subscriber->written();
+        }
+
+        if (subscriber->ended() && !subscriber->pending()) {
+            break;
+        }
+    }
+
+    if (!subscriber->closed()) {
+        tcp_stream.expires_after(chrono::seconds(instance.config().http_io_timeout));
+        boost::asio::async_write(stream, http::make_chunk_last(), yield[ec]);
+    }
+}
+
+// Stream events from a SSE hub until the client disconnects
+template <typename streamT>
+void serveSseHub(streamT& stream, HttpServer& instance, SseHub& hub, const Request& request,
+                 string_view lastEventIdHeader, LogRequest& lr, boost::asio::yield_context& yield) {
+
+    optional<uint64_t> last_event_id;
+    if (!lastEventIdHeader.empty()) {
+        uint64_t id = 0;
+        const auto end = lastEventIdHeader.data() + lastEventIdHeader.size();
+        if (auto [ptr, err] = from_chars(lastEventIdHeader.data(), end, id); err == errc{} && ptr == end) {
+            last_event_id = id;
+        } else {
+            LOG_DEBUG << "Request " << request.uuid << " - ignoring invalid Last-Event-ID: " << lastEventIdHeader;
+        }
+    }
+
+    auto subscriber = hub.subscribe(hub.topicFor(request), last_event_id);
+    ScopedExit unsubscribe{[&] {
+        hub.unsubscribe(subscriber);
+    }};
+
+    streamSse(stream, instance, subscriber, request, lr, yield);
+}
+
+// The state for SSE from a handler, with `Request::sse_send`, `Request::sse_send_event`
+// or `Request::sse_stream`. Very few requests use SSE, so nothing is allocated
+// until it's used. The functors only capture `this`, so they fit in the small
+// buffer in `std::function`.
+template <typename streamT>
+struct SseSupport {
+    SseSupport(streamT& stream, HttpServer& instance, Request& request, boost::asio::yield_context& yield)
+        : stream_{stream}, instance_{instance}, request_{request}, yield_{yield}
+    {
+        request.sse_send = [this](string_view sse) {
+            send(sse);
+        };
+        request.sse_send_event = [this](SseEvent& event) {
+            return send(event);
+        };
+        request.sse_stream = [this] {
+            return makeStream();
+        };
+        request.probe_connection_ok = [this] {
+            return !eos_ || eos_->ok;
+        };
+    }
+
+    SseSupport(const SseSupport&) = delete;
+    SseSupport& operator = (const SseSupport&) = delete;
+
+    // Send the header for the event-stream, and start to watch for the client to close the connection
+    bool init() {
+        if (initialized) {
+            return true;
+        }
+
+        LOG_TRACE << "Initializing SSE for request " << request_.uuid;
+        http::response<http::empty_body> res{http::status::ok, 11};
+        res.set(http::field::server, "yahat "s + YAHAT_VERSION);
+        res.set(http::field::content_type, "text/event-stream");
+        res.set(http::field::keep_alive, "true");
+        setRequestId(res, request_.uuid);
+        res.chunked(true);
+        http::response_serializer<http::empty_body> sr{res};
+
+        boost::system::error_code ec;
+        http::async_write_header(stream_, sr, yield_[ec]);
+        if (ec) {
+            LOG_DEBUG << "Request " << request_.uuid
+                      << " - failed to send SSE header: " << ec;
+            return false;
+        }
+
+        initialized = true;
+        request_.event_stream = true;
+
+        // Set up a callback for the read-direction to make sure that
+        // we detect if the SSE connection is closed while it is idle.
+        eos_ = make_shared<EosData>();
+        eos_->uuid = request_.uuid;
+        if (request_.notify_connection_closed) {
+            LOG_TRACE << "Added notify_connection_closed while setting up SSE";
+            eos_->notify_connection_closed = std::move(request_.notify_connection_closed);
+        }
+
+        boost::asio::mutable_buffer rbb{eos_->buffer.data(), eos_->buffer.size()};
+        boost::asio::async_read(stream_, rbb, [eos=eos_](boost::system::error_code ec, size_t) {
+            LOG_DEBUG << "Request " << eos->uuid
+                      << " - Read handler called: " << ec;
+            eos->ok = false;
+            if (eos->notify_connection_closed) {
+                eos->notify_connection_closed();
+            }
+        });
+
+        return true;
+    }
+
+    bool send(string_view sse) {
+        return onIoThread([&] {
+            beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(instance_.config().http_io_timeout));
+            if (!init()) {
+                return false;
+            }
+
+            if (!sse.empty()) {
+                boost::system::error_code ec;
+                boost::asio::const_buffer b{sse.data(), sse.size()};
+                boost::beast::net::async_write(stream_, http::make_chunk(b), yield_[ec]);
+
+                if (ec) {
+                    LOG_DEBUG << "Request " << request_.uuid
+                              << " - failed to send SSE payload: " << ec;
+                    return false;
+                }
+            }
+
+            return true;
+        });
+    }
+
+    bool send(SseEvent& event) {
+        return onIoThread([&] {
+            beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(instance_.config().http_io_timeout));
+            if (!init()) {
+                return false;
+            }
+
+            // The event is already framed as a chunk
+            boost::system::error_code ec;
+            const auto chunk = event.chunk();
+            boost::asio::async_write(stream_, boost::asio::buffer(chunk.data(), chunk.size()), yield_[ec]);
+            event.clear();
+            if (ec) {
+                LOG_DEBUG << "Request " << request_.uuid
+                          << " - failed to send SSE event: " << ec;
+                return false;
+            }
+
+            return true;
+        });
+    }
+
+    // A handle for a stream that outlives the handler
+    SseStream makeStream() {
+        if (auto impl = stream_impl_.lock()) {
+            return SseStream{impl};
+        }
+        if (!subscriber) {
+            subscriber = instance_.sseStreams().createStream();
+        }
+        auto impl = make_shared<SseStream::Impl>(subscriber);
+        stream_impl_ = impl;
+        request_.event_stream = true;
+        return SseStream{impl};
+    }
+
+    bool initialized = false;
+
+    // Set if the handler asked for a `SseStream`
+    shared_ptr<SseHub::Subscriber> subscriber;
+
+private:
+    // The yield-based operations complete on the coroutines executor. If the handler
+    // runs on the handler threads, do the IO from the HTTP worker threads, and go
+    // back to the handler thread before we return to the handler.
+    template <typename fnT>
+    bool onIoThread(const fnT& fn) {
+        const auto handler_ex = instance_.getHandlerCtx().get_executor();
+        if (!handler_ex.running_in_this_thread()) {
+            return fn();
+        }
+
+        switchTo(stream_.get_executor(), yield_);
+        const auto result = fn();
+        switchTo(handler_ex, yield_);
+        return result;
+    }
+
+    struct EosData {
+        array<char, 1> buffer;
+        atomic_bool ok{true};
+        RequestId uuid;
+        std::function<void()> notify_connection_closed;
+    };
+
+    streamT& stream_;
+    HttpServer& instance_;
+    Request& request_;
+    boost::asio::yield_context& yield_;
+    shared_ptr<EosData> eos_;
+    weak_ptr<SseStream::Impl> stream_impl_;
+};
+
 template <bool isTls, typename streamT>
 void DoSession(streamT& streamPtr,
                HttpServer& instance,
@@ -296,12 +1178,29 @@ void DoSession(streamT& streamPtr,
         }
     }
 
+    // Memory for each request. Released at the end of each iteration.
+    RequestArena arena;
+
     while(!close) {
         LOG_TRACE << "Start of loop - close=" << close;
 
+        // Declared first, so that it runs after everything in the iteration that uses the arena is destroyed
+        ScopedExit release_arena{[&] {
+            [[maybe_unused]] const auto allocations = arena.release();
+            [[maybe_unused]] const auto overflows = arena.overflows();
+#ifdef YAHAT_ENABLE_METRICS
+            if (metrics) {
+                metrics->requestArenaAllocations()->inc(allocations);
+                metrics->requestArenaOverflows()->inc(overflows);
+            }
+#endif
+        }};
+
         beast::get_lowest_layer(stream).expires_after(chrono::seconds(instance.config().http_io_timeout));
-        http::request<http::string_body> req;
-        auto bytes = http::async_read(stream, buffer, req, yield[ec]);
+
+        // Read the header first, so that the route can decide how the body is read
+        header_parser_t header_parser{piecewise_construct, make_tuple(), make_tuple(fields_t::allocator_type{&arena})};
+        http::async_read_header(stream, buffer, header_parser, yield[ec]);
         if(ec == http::error::end_of_stream) {
             LOG_TRACE << "Exiting loop end_of_stream";
             break;
@@ -311,6 +1210,38 @@ void DoSession(streamT& streamPtr,
             break;
         }
 
+#ifdef USING_BOOST_JSON
+        // The memory for `Request::json`. Declared before the request, so it outlives the value.
+        JsonArena json_arena{arena};
+        std::optional<boost::json::monotonic_resource> json_memory;
+#endif
+
+        const auto& header = header_parser.get();
+        Request request{header.target(), {}, to_type(header.method()), &yield};
+        const auto match = instance.findRoute(request.target);
+        const bool gzipped = header[http::field::content_encoding] == "gzip";
+
+#ifdef USING_BOOST_JSON
+        // Parse the json body while it's received
+        std::optional<boost::json::stream_parser> json_parser;
+        beast::error_code json_error;
+        if (match.route && match.route->options.parse_json) {
+            json_memory.emplace(4096, boost::json::storage_ptr{&json_arena});
+            json_parser.emplace();
+            json_parser->reset(&*json_memory);
+        }
+
+        auto req = json_parser && !gzipped
+            ? readJsonBody(stream, buffer, header_parser, *json_parser, json_error, yield, ec)
+            : readBody(stream, buffer, header_parser, yield, ec);
+#else
+        auto req = readBody(stream, buffer, header_parser, yield, ec);
+#endif
+        if(ec) {
+            LOG_ERROR << "read failed: " << ec.message();
+            break;
+        }
+
         if (!req.keep_alive()) {
             close = true;
         }
@@ -323,32 +1254,63 @@ void DoSession(streamT& streamPtr,
 
         // TODO: Check that the client accepts our json reply
 
-        string req_body;
-        if (req[http::field::content_encoding] == "gzip") {
-            req_body = decompressGzip(req.body(), instance.config().max_decompressed_size);
+        if (gzipped) {
+            request.body = decompressGzip(req.body(), instance.config().max_decompressed_size);
         } else {
-            req_body = req.body();
+            request.body = std::move(req.body());
+        }
+
+#ifdef USING_BOOST_JSON
+        if (json_parser) {
+            if (gzipped && !request.body.empty()) {
+                // Compressed bodies are parsed when they are decompressed
+                json_parser->write(request.body.data(), request.body.size(), json_error);
+                if (!json_error) {
+                    json_parser->finish(json_error);
+                }
+                request.body.clear();
+            }
+
+            if (!json_error && json_parser->done()) {
+                request.json = json_parser->release();
+            }
         }
+#endif
 
-        Request request{req.base().target(), std::move(req_body), to_type(req.base().method()), &yield};
         Response::Compression compression = Response::Compression::NONE;
         if (req[http::field::accept_encoding].find("gzip") != std::string::npos) {
             compression = Response::Compression::GZIP;
         }
 
+        request.headers = &req.base();
+        request.arena = &arena;
+
+        if (instance.config().adopt_request_id) {
+            if (auto id = request.header("X-Request-ID"); !id.empty()) {
+                request.uuid.adopt(id);
+            } else if (auto tp = request.header("traceparent"); !tp.empty()) {
+                request.uuid.adoptTraceparent(tp);
+            }
+        }
+        request.remote = beast::get_lowest_layer(stream).socket().remote_endpoint();
+
         LogRequest lr{request};
-        lr.remote =  beast::get_lowest_layer(stream).socket().remote_endpoint();
+        lr.remote = request.remote;
         lr.local = beast::get_lowest_layer(stream).socket().local_endpoint();
         lr.location = req.base().target();
 
-        if (const auto& ah = instance.authenticator()) {
+        const auto auth_policy = match.route ? match.route->options.auth : AuthPolicy::REQUIRED;
+
+        const auto& ah = instance.authenticator();
+        const auto& aah = instance.asyncAuthenticator();
+        if ((ah || aah) && auth_policy != AuthPolicy::PUBLIC) {
             AuthReq ar{request, yield};
             if (auto it = req.base().find(http::field::authorization) ; it != req.base().end()) {
                 auto [a, u] = instance.Authenticate({it->value().data(), it->value().size()});
                 ar.auth_header = {it->value().data(), it->value().size()};
             }
 
-            request.auth = ah(ar);
+            request.auth = aah ? instance.authenticateAsync(ar) : ah(ar);
             lr.user = request.auth.account;
         }
 
@@ -357,7 +1319,7 @@ void DoSession(streamT& streamPtr,
             Response r{200, "OK"};
             r.cors = true;
             r.compression = compression;
-            http::response<http::string_body> res;
+            auto res = makeMessage<response_t>(arena);
             res.base().set(http::field::server, instance.serverId());
             makeReply(instance, res, r, close, lr, request.type);
             http::async_write(stream, res, yield[ec]);
@@ -368,12 +1330,12 @@ void DoSession(streamT& streamPtr,
             continue;
         }
 
-        if (!request.auth.access) {
+        if (!request.auth.access && auth_policy == AuthPolicy::REQUIRED) {
             LOG_TRACE << "Request was unauthorized!";
 
             Response r{401, "Access Denied!"};
             r.compression = compression;
-            http::response<http::string_body> res;
+            auto res = makeMessage<response_t>(arena);
             res.base().set(http::field::server, instance.serverId());
             if (instance.config().enable_http_basic_auth) {
                 if (auto realm = instance.config().http_basic_auth_realm; !realm.empty()) {
@@ -392,6 +1354,43 @@ void DoSession(streamT& streamPtr,
             continue;
         }
 
+        if (match.route && match.route->options.rate_limiter) {
+            if (const auto rl = match.route->options.rate_limiter->check(request); !rl.allowed) {
+                LOG_TRACE << "Request was rate-limited by " << match.route->options.rate_limiter->config().name;
+
+                Response r{429, "Too Many Requests"};
+                r.retry_after = rl.retry_after;
+                r.compression = compression;
+                r.cors = instance.config().auto_handle_cors;
+                auto res = makeMessage<response_t>(arena);
+                makeReply(instance, res, r, close, lr, request.type);
+                http::async_write(stream, res, yield[ec]);
+                if(ec) {
+                    LOG_ERROR << "write failed: " << ec.message();
+                }
+
+                continue;
+            }
+        }
+
+#ifdef USING_BOOST_JSON
+        if (json_error) {
+            LOG_DEBUG << "Request " << request.uuid << " has invalid json: " << json_error.message();
+
+            Response r{400, "Bad Request"};
+            r.compression = compression;
+            r.cors = instance.config().auto_handle_cors;
+            auto res = makeMessage<response_t>(arena);
+            makeReply(instance, res, r, close, lr, request.type);
+            http::async_write(stream, res, yield[ec]);
+            if(ec) {
+                LOG_ERROR << "write failed: " << ec.message();
+            }
+
+            continue;
+        }
+#endif
+
         if (!req.body().empty()) {
             if (auto it = req.base().find(http::field::content_type) ; it != req.base().end()) {
                 // TODO: Check that the type is json
@@ -399,92 +1398,188 @@ void DoSession(streamT& streamPtr,
             }
         }
 
-        bool sse_initialized = false;
-        optional<http::response_serializer<http::empty_body>> sse_sr;
-        struct EosData {
-            array<char, 1> buffer;
-            atomic_bool ok{true};
-            boost::uuids::uuid uuid;
-            std::function<void()> notify_connection_closed;
-        };
+        if (match.route && match.route->options.sse_hub) {
+            if (request.type != Request::Type::GET) {
+                Response r{405, "Method Not Allowed"};
+                r.cors = instance.config().auto_handle_cors;
+                auto res = makeMessage<response_t>(arena);
+                makeReply(instance, res, r, close, lr, request.type);
+                http::async_write(stream, res, yield[ec]);
+                if(ec) {
+                    LOG_ERROR << "write failed: " << ec.message();
+                }
 
-        // Needed if the request is a SSE subscription
-        auto eos_data = make_shared<EosData>();
-        eos_data->uuid = request.uuid;
+                continue;
+            }
 
-        // Setup support for SSE
-        request.sse_send = [&](string_view sse) {
-            beast::get_lowest_layer(stream).expires_after(std::chrono::seconds(instance.config().http_io_timeout));
-            boost::system::error_code ec;
+            request.route = match.target;
+            serveSseHub(stream, instance, *match.route->options.sse_hub, request,
+                        request.header("Last-Event-ID"), lr, yield);
+
+            // The event-stream is the last response on this connection
+            break;
+        }
 
-            if (!sse_initialized) {
-               LOG_TRACE << "Initializing SSE for request " << request.uuid;
-               http::response<http::empty_body>  res{http::status::ok, 11};
-               res.set(http::field::server, "yahat "s + YAHAT_VERSION);
-               res.set(http::field::content_type, "text/event-stream");
-               res.set(http::field::keep_alive, "true");
-               res.chunked(true);
-               sse_sr.emplace(res);
-
-               http::async_write_header(stream, *sse_sr, yield[ec]);
-               if (ec) {
-                   LOG_DEBUG << "Request " << request.uuid
-                             << " - failed to send SSE header: " << ec;
-                   return false;
-               }
-
-               sse_initialized = true;
-
-               // Set up a callback for the read-direction to make sure that
-               // we detect if the SSE connection is closed while it is idle.
-
-               boost::asio::mutable_buffer rbb{eos_data->buffer.data(), eos_data->buffer.size()};
-               auto uuid = request.uuid;
-
-               if (request.notify_connection_closed) {
-                   LOG_TRACE << "Added notify_connection_closed while setting up SSE";
-                   eos_data->notify_connection_closed = std::move(request.notify_connection_closed);
-               }
-
-               boost::asio::async_read(stream, rbb, [eos_data](boost::system::error_code ec, size_t) {
-                   LOG_DEBUG << "Request " << eos_data->uuid
-                             << " - Read handler called: " << ec;
-                   eos_data->ok = false;
-                   if (eos_data->notify_connection_closed) {
-                       eos_data->notify_connection_closed();
-                   }
-               });
+        // Serve GET requests from the routes cache, if it has one
+        auto *cache = match.route && request.type == Request::Type::GET
+                          ? match.route->options.cache.get() : nullptr;
+        string cache_key;
+        if (cache) {
+            cache_key = cache->makeKey(request);
+            if (const auto entry = cache->get(cache_key)) {
+                LOG_TRACE << "Request " << request.uuid << " served from cache " << cache->config().name;
+
+                auto res = makeMessage<response_t>(arena);
+                if (!entry->etag.empty() && etagMatches(req[http::field::if_none_match], entry->etag)) {
+                    Response r{304, "Not Modified"};
+                    r.etag = entry->etag;
+                    r.cors = instance.config().auto_handle_cors;
+                    makeReply(instance, res, r, close, lr, request.type);
+                } else {
+                    makeReply(instance, res, entry, compression == Response::Compression::GZIP,
+                              instance.config().auto_handle_cors, close, lr);
+                }
+                http::async_write(stream, res, yield[ec]);
+                if(ec) {
+                    LOG_ERROR << "write failed: " << ec.message();
+                }
+
+                continue;
             }
+        }
 
-            if (!sse.empty()) {
-                boost::asio::const_buffer b{sse.data(), sse.size()};
-                boost::beast::net::async_write(stream, http::make_chunk(b), yield[ec]);
+        // Support for SSE from the handler. Nothing is allocated unless it's used.
+        SseSupport sse{stream, instance, request, yield};
 
-                if (ec) {
-                    LOG_DEBUG << "Request " << request.uuid
-                              << " - failed to send SSE payload: " << ec;
-                    return false;
-                }
+        // Move normal priority handlers to the handler threads, so they
+        // don't delay IO and high priority requests on the HTTP worker threads.
+        // The handler threads io-context is the request queue.
+        auto *queue = instance.requestQueue();
+        const bool use_handler_thread = queue
+            && match.route && match.route->options.priority == Priority::NORMAL;
+
+        auto invoke = [&]() -> Response {
+            if (!use_handler_thread) {
+                return instance.onRequest(request, match);
             }
 
-            return true;
+            auto ticket = queue->tryEnqueue();
+            if (!ticket) {
+                LOG_TRACE << "Request " << request.uuid << " rejected. The request queue is full.";
+                return overloaded();
+            }
+
+            const auto handler_ex = instance.getHandlerCtx().get_executor();
+            switchTo(handler_ex, yield);
+
+            Response r = queue->dequeue(*ticket) ? instance.onRequest(request, match) : overloaded();
+
+            if (!handler_ex.running_in_this_thread()) {
+                LOG_WARN << "Request " << request.uuid << " - the handler for route '" << match.target
+                         << "' returned on a HTTP worker thread. Handlers on the handler threads "
+                            "must not use `Request::yield` for their own async operations.";
+            }
+
+            // Back to the HTTP worker threads
+            switchTo(stream.get_executor(), yield);
+            return r;
         };
 
-        request.probe_connection_ok = [eos_data]() {
-            return eos_data && eos_data->ok;
+        // Add the etag, and add the reply to the routes cache.
+        // Returns the cache entry if the reply was cached.
+        auto prepare = [&](Response& r) -> ResponseCache::entry_t {
+            if (match.route && match.route->options.etag && r.ok() && r.etag.empty()
+                && r.hasBody() && !sse.initialized) {
+                // The hash is over the whole body
+                r.flatten();
+                r.etag = makeEtag(r.bodyView());
+            }
+
+            if (cache && r.ok() && !r.close && !sse.initialized && !sse.subscriber) {
+                auto entry = makeCacheEntry(*cache, r);
+                cache->put(cache_key, entry);
+                return entry;
+            }
+            return {};
         };
 
-        const auto reply = instance.onRequest(request);
+        Response reply;
+        ResponseCache::entry_t entry;
+        if (match.route && match.route->options.coalesce && request.type == Request::Type::GET) {
+            if (cache_key.empty()) {
+                cache_key = coalesceKey(request);
+            }
+
+            // Only the first caller runs the handler, and prepares the reply.
+            // The callers that arrive while it runs share the result.
+            const auto shared = instance.coalesce(cache_key, yield, [&] {
+                auto r = make_shared<HttpServer::CoalescedReply>();
+                r->response = invoke();
+                r->entry = prepare(r->response);
+                if (!r->entry) {
+                    // Each caller gets a copy of the response, but not of the body
+                    r->response.flatten();
+                    if (!r->response.body.empty()) {
+                        r->response.shared_body = make_shared<const string>(std::move(r->response.body));
+                        r->response.body.clear();
+                    }
+                }
+                return shared_ptr<const HttpServer::CoalescedReply>{std::move(r)};
+            });
+            reply = shared->response;
+            entry = shared->entry;
+        } else {
+            reply = invoke();
+            if (!sse.subscriber) {
+                entry = prepare(reply);
+            }
+        }
+
+        if (sse.subscriber && !sse.initialized) {
+            if (reply.ok()) {
+                streamSse(stream, instance, sse.subscriber, request, lr, yield,
+                          std::move(request.notify_connection_closed));
+
+                // The event-stream is the last response on this connection
+                break;
+            }
+
+            // The handler failed after it asked for a stream
+            sse.subscriber->close();
+        }
+
+        // Don't send the body if the client already has it
+        if (!reply.etag.empty() && reply.ok() && request.type == Request::Type::GET
+            && etagMatches(req[http::field::if_none_match], reply.etag)) {
+            LOG_TRACE << "Request " << request.uuid << " - the client has the current version";
+            Response not_modified{304, "Not Modified"};
+            not_modified.etag = std::move(reply.etag);
+            not_modified.close = reply.close;
+            reply = std::move(not_modified);
+            entry.reset();
+        }
+
         if (reply.close) {
             close = true;
         }
 
         reply.cors = instance.config().auto_handle_cors;
         reply.compression = compression;
+#ifdef USING_BOOST_JSON
+        if (reply.json && req.version() < 11) {
+            // Json values are sent with chunked transfer-encoding, which requires HTTP/1.1
+            reply.flatten();
+        }
+#endif
 
         LOG_TRACE << "Preparing reply";
-        http::response<http::string_body> res;
-        makeReply(instance, res, reply, close, lr, request.type);
+        auto res = makeMessage<response_t>(arena);
+        if (entry) {
+            makeReply(instance, res, entry, compression == Response::Compression::GZIP,
+                      reply.cors, close, lr);
+        } else {
+            makeReply(instance, res, reply, close, lr, request.type);
+        }
         http::async_write(stream, res, yield[ec]);
         if(ec) {
             LOG_WARN << "write failed: " << ec.message();
@@ -515,35 +1610,23 @@ void Request::init(const string& undecodedTtarget)
 #ifdef USING_BOOST_URL
     auto url = boost::urls::parse_origin_form(undecodedTtarget).value();
     target = url.path();
-    all_arguments = url.query();
-    string_view aa = all_arguments;
-    for(auto pos = aa.find('&'); !aa.empty(); pos = aa.find('&')) {
-        string_view current;
-        if (pos == string_view::npos) {
-            current = aa;
-            aa = {};
-        } else {
-            current = aa.substr(0, pos);
-            aa = aa.substr(pos + 1);
-        }
-
-        if (auto eq = current.find('='); eq != string_view::npos) {
-            auto key = current.substr(0, eq);
-            auto val = current.substr(eq +1);
-            arguments[key] = val;
-        } else {
-            arguments[current] = {};
-        }
-    }
+    // The arguments are decoded on demand by `args()`
+    query = url.encoded_query();
 #else
     target = undecodedTtarget;
     if (auto pos = target.find('?'); pos != string::npos) {
-        auto all_args = target.substr(pos + 1);
+        query = target.substr(pos + 1);
         target = target.substr(0, pos);
     }
 #endif
 }
 
+// Work that is shared by concurrent requests
+struct HttpServer::Flights {
+    SingleFlight<std::string, Auth> auth;
+    SingleFlight<std::string, std::shared_ptr<const CoalescedReply>> requests;
+};
+
 HttpServer::HttpServer(const HttpConfig &config, authenticator_t authHandler, const std::string& branding)
     : config_{config}, authenticator_(std::move(authHandler))
     , server_{branding.empty() ? "yahat "s + YAHAT_VERSION : branding + "/yahat "s + YAHAT_VERSION}
@@ -552,10 +1635,10 @@ HttpServer::HttpServer(const HttpConfig &config, authenticator_t authHandler, co
     if (config.enable_metrics) {
         metrics_ = make_shared<YahatInstanceMetrics>();
 
-        LOG_INFO << "Metrics enabled at '" << config.metrics_target <<'\'';
-        addRoute(config_.metrics_target, metrics_->metricsHandler(), "GET");
+        addMetricsRoute();
     }
 #endif
+    init();
 }
 
 #ifdef YAHAT_ENABLE_METRICS
@@ -563,13 +1646,64 @@ HttpServer::HttpServer(const HttpConfig &config, authenticator_t authHandler, Me
 : config_{config}, authenticator_(std::move(authHandler)), server_{branding.empty() ? "yahat "s + YAHAT_VERSION : branding + "/yahat "s + YAHAT_VERSION}
 {
     metrics_ = make_shared<YahatInstanceMetrics>(&metricsInstance);
+    addMetricsRoute();
+    init();
+}
+
+void HttpServer::addMetricsRoute()
+{
+    RouteOptions options;
+    options.priority = Priority::HIGH;
+    if (config_.public_metrics) {
+        options.auth = AuthPolicy::PUBLIC;
+    }
 
-    addRoute(config_.metrics_target, metrics_->metricsHandler(), "GET");
-    LOG_INFO << "Metrics enabled at '" << config.metrics_target <<'\'';
-    addRoute(config_.metrics_target, metrics_->metricsHandler(), "GET");
+    LOG_INFO << "Metrics enabled at '" << config_.metrics_target <<'\'';
+    addRoute(config_.metrics_target, metrics_->metricsHandler(), options, "GET");
 }
 #endif
 
+HttpServer::~HttpServer() = default;
+
+void HttpServer::init()
+{
+    flights_ = make_unique<Flights>();
+
+    SseHub::Config sc;
+    sc.name = "streams";
+    sc.max_queue = config_.sse_max_queue;
+    sc.heartbeat_interval = chrono::seconds{config_.sse_heartbeat_interval};
+    sc.heartbeat_shards = 1;
+#ifdef YAHAT_ENABLE_METRICS
+    sse_streams_ = make_shared<SseHub>(ctx_, sc, metrics_ ? &metrics_->metrics() : nullptr);
+#else
+    sse_streams_ = make_shared<SseHub>(ctx_, sc);
+#endif
+
+    if (config_.num_handler_threads) {
+        RequestQueue::Config qc;
+        qc.name = "handlers";
+        qc.max_depth = config_.handler_queue_max_depth;
+        qc.target = chrono::milliseconds{config_.handler_queue_target_ms};
+        qc.interval = chrono::milliseconds{config_.handler_queue_interval_ms};
+#ifdef YAHAT_ENABLE_METRICS
+        request_queue_ = make_shared<RequestQueue>(qc, metrics_ ? &metrics_->metrics() : nullptr);
+#else
+        request_queue_ = make_shared<RequestQueue>(qc);
+#endif
+    }
+
+    if (config_.adaptive_concurrency_limit) {
+        ConcurrencyLimiter::Config cc;
+        cc.name = "server";
+#ifdef YAHAT_ENABLE_METRICS
+        concurrency_limiter_ = make_shared<ConcurrencyLimiter>(cc, metrics_ ? &metrics_->metrics() : nullptr);
+#else
+        concurrency_limiter_ = make_shared<ConcurrencyLimiter>(cc);
+#endif
+    }
+}
+
 std::future<void> HttpServer::start()
 {
 
@@ -712,6 +1846,11 @@ void HttpServer::stop()
     for(auto& worker : workers_) {
         worker.join();
     }
+    handler_work_.reset();
+    handler_ctx_.stop();
+    for(auto& worker : handler_workers_) {
+        worker.join();
+    }
     promise_.set_value();
 }
 
@@ -724,9 +1863,10 @@ Metrics *HttpServer::metrics() noexcept
 #endif
 
 #ifdef YAHAT_ENABLE_METRICS
-void HttpServer::addRoute_(std::string_view target, handler_t handler, const std::span<std::string_view> methods)
+void HttpServer::addRoute_(std::string_view target, handler_t handler, const std::span<std::string_view> methods,
+                           RouteOptions options)
 #else
-void HttpServer::addRoute(std::string_view target, handler_t handler)
+void HttpServer::addRoute(std::string_view target, handler_t handler, RouteOptions options)
 #endif
 {
     if (target.size() == 0) {
@@ -738,7 +1878,73 @@ void HttpServer::addRoute(std::string_view target, handler_t handler)
     }
 #endif
     string key{target};
-    routes_[std::move(key)] = handler;
+    routes_[std::move(key)] = {std::move(handler), std::move(options)};
+}
+
+void HttpServer::addSseRoute(std::string_view target, std::shared_ptr<SseHub> hub, RouteOptions options)
+{
+    if (!hub) {
+        throw runtime_error{"addSseRoute: The hub cannot be empty"};
+    }
+
+    options.sse_hub = std::move(hub);
+#ifdef YAHAT_ENABLE_METRICS
+    addRoute(target, {}, std::move(options), "GET");
+#else
+    addRoute(target, {}, std::move(options));
+#endif
+}
+
+void HttpServer::setAuthenticator(async_authenticator_t authenticator, bool singleflight)
+{
+    async_authenticator_ = std::move(authenticator);
+    auth_singleflight_ = singleflight;
+}
+
+Auth HttpServer::authenticateAsync(const AuthReq &ar)
+{
+    assert(async_authenticator_);
+
+    auto authenticate = [&] {
+        optional<Auth> auth;
+        exception_ptr error;
+        AsyncSignal done;
+
+        net::co_spawn(ctx_, async_authenticator_(ar), [&](exception_ptr ex, Auth result) {
+            error = ex;
+            auth = std::move(result);
+            done.notify();
+        });
+
+        done.async_wait(ar.yield);
+        if (error) {
+            rethrow_exception(error);
+        }
+        return std::move(*auth);
+    };
+
+    // Requests without credentials may be authenticated on other properties
+    // of the request, so we can only share results for the same credential.
+    // The authenticator may decide per route, so the method and target are part of the key.
+    if (auth_singleflight_ && !ar.auth_header.empty()) {
+        string key;
+        key.reserve(ar.auth_header.size() + ar.req.target.size() + 8);
+        key = toString(ar.req.type);
+        key += ' ';
+        key += ar.req.target;
+        key += '\n';
+        key += ar.auth_header;
+        return flights_->auth.run(key, ar.yield, authenticate);
+    }
+
+    return authenticate();
+}
+
+std::shared_ptr<const HttpServer::CoalescedReply>
+HttpServer::coalesce(const string& key, boost::asio::yield_context& yield,
+                     const std::function<std::shared_ptr<const CoalescedReply>()>& fn)
+{
+    return flights_->requests.run(key, yield, fn);
 }
 
 std::pair<bool, string_view> HttpServer::Authenticate(const std::string_view &/*authHeader*/)
@@ -748,47 +1954,82 @@ std::pair<bool, string_view> HttpServer::Authenticate(const std::string_view &/*
     return {true, teste};
 }
 
-Response HttpServer::onRequest(Request &req) noexcept
+HttpServer::RouteMatch HttpServer::findRoute(std::string_view target) const noexcept
 {
-    // Find the route!
-    string_view tw{req.target.data(), req.target.size()};
-
-    RequestHandler *best_handler = {};
-    string_view best_route;
+    RouteMatch best;
 
-    for(const auto& [route, handler] : routes_) {
+    for(const auto& [route, r] : routes_) {
         const auto len = route.size();
 
         // Target must be at least the lenght of the route
-        if (tw.size() < len) {
+        if (target.size() < len) {
             continue;
         }
 
         // Target is only relevant if it's the same size as the route
         // or if it has a slash at the location where target ends
-        if (tw.size() == len || tw.at(len) == '/') {
-            auto relevant = tw.substr(0, len);
+        if (target.size() == len || target.at(len) == '/') {
+            auto relevant = target.substr(0, len);
             if (relevant == route) {
                 // We need the longest possible match
-                if (!best_handler || (best_route.size() < route.size())) {
-                    best_handler = handler.get();
-                    best_route = route;
+                if (!best.route || (best.target.size() < route.size())) {
+                    best.route = &r;
+                    best.target = route;
                 }
             }
         }
     }
 
-    if (best_handler) {
+    return best;
+}
+
+Response HttpServer::onRequest(Request &req) noexcept
+{
+    return onRequest(req, findRoute(req.target));
+}
+
+Response HttpServer::onRequest(Request &req, const RouteMatch& match) noexcept
+{
+    if (match.route) {
+        // Held until the handler returns, so the limiters can measure its latency
+        optional<ConcurrencyLimiter::Permit> server_permit, route_permit;
+        if (concurrency_limiter_ && match.route->options.priority == Priority::NORMAL) {
+            if (server_permit = concurrency_limiter_->tryAcquire(); !server_permit) {
+                LOG_TRACE << "Request rejected by the servers concurrency limiter";
+                return overloaded();
+            }
+        }
+        if (const auto& cl = match.route->options.concurrency_limiter) {
+            if (route_permit = cl->tryAcquire(); !route_permit) {
+                LOG_TRACE << "Request rejected by the concurrency limiter " << cl->config().name;
+                if (server_permit) {
+                    // Not a latency sample
+                    server_permit->cancel();
+                }
+                return overloaded();
+            }
+        }
+
         try {
-            LOG_TRACE << "Found route '" << best_route << "' for target '" << tw << "'";
-            req.route = best_route;
+            LOG_TRACE << "Found route '" << match.target << "' for target '" << req.target << "'";
+            req.route = match.target;
 #ifdef YAHAT_ENABLE_METRICS
             auto * metrics = this->internalMetrics();
             if (metrics) {
-                metrics->incrementHttpRequestCount(best_route, toString(req.type));
+                metrics->incrementHttpRequestCount(match.target, toString(req.type));
             }
 #endif
-            return best_handler->onReqest(req);
+            auto reply = match.route->handler->onReqest(req);
+            if (req.event_stream) {
+                // The time is how long the client was connected, not the latency
+                if (server_permit) {
+                    server_permit->cancel();
+                }
+                if (route_permit) {
+                    route_permit->cancel();
+                }
+            }
+            return reply;
         } catch(const Response& resp) {
             return resp;
         } catch (const exception& ex) {
@@ -823,6 +2064,25 @@ void HttpServer::startWorkers()
             LOG_DEBUG << "HTTP worker thread #" << i << " done.";
         });
     }
+
+    if (config_.num_handler_threads) {
+        // The handler threads only get work from the sessions, so keep them alive when idle
+        handler_work_.emplace(handler_ctx_.get_executor());
+    }
+
+    for(size_t i = 0; i < config_.num_handler_threads; ++i) {
+        handler_workers_.emplace_back([this, i] {
+            LOG_DEBUG << "HTTP handler thread #" << i << " starting up.";
+            try {
+                handler_ctx_.run();
+            } catch(const exception& ex) {
+                LOG_ERROR << "HTTP handler thread #" << i
+                          << " caught exception: "
+                          << ex.what();
+            }
+            LOG_DEBUG << "HTTP handler thread #" << i << " done.";
+        });
+    }
 }
 
 HttpServer::FileHandler::FileHandler(std::filesystem::path root)
@@ -969,6 +2229,64 @@ string_view Response::getMimeType(string_view type)
 }
 
 
+string Response::responseStatusAsJson() const
+{
+#ifdef USING_BOOST_JSON
+    if (const auto json = staticStatusJson(); !json.empty()) {
+        return string{json};
+    }
+
+    boost::json::object o;
+    o["error"] = code / 100 > 2;
+    o["status"] = code;
+    o["reason"] = reason;
+    return boost::json::serialize(o);
+#else
+    return {};
+#endif
+}
+
+string_view Response::staticStatusJson() const noexcept
+{
+#ifdef USING_BOOST_JSON
+    struct StatusJson {
+        int code;
+        string_view reason;
+        string_view json;
+    };
+
+    // Same format as `responseStatusAsJson()`
+    static constexpr auto common = to_array<StatusJson>({
+        {200, "OK", R"({"error":false,"status":200,"reason":"OK"})"},
+        {201, "Created", R"({"error":false,"status":201,"reason":"Created"})"},
+        {202, "Accepted", R"({"error":false,"status":202,"reason":"Accepted"})"},
+        {400, "Bad Request", R"({"error":true,"status":400,"reason":"Bad Request"})"},
+        {401, "Unauthorized", R"({"error":true,"status":401,"reason":"Unauthorized"})"},
+        {401, "Access Denied!", R"({"error":true,"status":401,"reason":"Access Denied!"})"},
+        {403, "Forbidden", R"({"error":true,"status":403,"reason":"Forbidden"})"},
+        {404, "Not Found", R"({"error":true,"status":404,"reason":"Not Found"})"},
+        {404, "Document not found", R"({"error":true,"status":404,"reason":"Document not found"})"},
+        {405, "Method Not Allowed", R"({"error":true,"status":405,"reason":"Method Not Allowed"})"},
+        {409, "Conflict", R"({"error":true,"status":409,"reason":"Conflict"})"},
+        {413, "Payload Too Large", R"({"error":true,"status":413,"reason":"Payload Too Large"})"},
+        {429, "Too Many Requests", R"({"error":true,"status":429,"reason":"Too Many Requests"})"},
+        {500, "Internal Server Error", R"({"error":true,"status":500,"reason":"Internal Server Error"})"},
+        {500, "Internal server error", R"({"error":true,"status":500,"reason":"Internal server error"})"},
+        {501, "Not Implemented", R"({"error":true,"status":501,"reason":"Not Implemented"})"},
+        {502, "Bad Gateway", R"({"error":true,"status":502,"reason":"Bad Gateway"})"},
+        {503, "Service Unavailable", R"({"error":true,"status":503,"reason":"Service Unavailable"})"},
+        {504, "Gateway Timeout", R"({"error":true,"status":504,"reason":"Gateway Timeout"})"},
+    });
+
+    for(const auto& s : common) {
+        if (s.code == code && s.reason == reason) {
+            return s.json;
+        }
+    }
+#endif
+    return {};
+}
+
 string_view Response::mimeType() const
 {
     if (!mime_type.empty()) {
@@ -989,7 +2307,7 @@ string_view Response::mimeType() const
 
 boost::uuids::uuid generateUuid()
 {
-    static boost::uuids::random_generator uuid_gen;
+    thread_local boost::uuids::random_generator uuid_gen;
     return uuid_gen();
 }
 
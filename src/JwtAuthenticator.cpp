@@ -0,0 +1,604 @@
+
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/obj_mac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#   include <openssl/core_names.h>
+#   include <openssl/param_build.h>
+#else
+#   include <openssl/ec.h>
+#   include <openssl/rsa.h>
+#endif
+
+#include "yahat/JwtAuthenticator.h"
+#include "yahat/logging.h"
+
+#ifdef USING_BOOST_JSON
+
+using namespace std;
+namespace json = boost::json;
+
+namespace yahat {
+
+namespace {
+
+enum class Alg {
+    HS256,
+    RS256,
+    ES256
+};
+
+optional<Alg> toAlg(string_view name) {
+    if (name == "HS256") {
+        return Alg::HS256;
+    }
+    if (name == "RS256") {
+        return Alg::RS256;
+    }
+    if (name == "ES256") {
+        return Alg::ES256;
+    }
+    return {};
+}
+
+// RFC 4648 section 5, without padding
+string base64UrlDecode(string_view in) {
+    static constexpr auto table = [] {
+        array<int8_t, 256> t{};
+        t.fill(-1);
+        constexpr string_view chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        for(size_t i = 0; i < chars.size(); ++i) {
+            t[static_cast<uint8_t>(chars[i])] = static_cast<int8_t>(i);
+        }
+        return t;
+    }();
+
+    while(!in.empty() && in.back() == '=') {
+        in.remove_suffix(1);
+    }
+
+    string out;
+    out.reserve((in.size() * 3) / 4);
+
+    uint32_t acc = 0;
+    int bits = 0;
+    for(const auto ch : in) {
+        const auto v = table[static_cast<uint8_t>(ch)];
+        if (v < 0) {
+            throw runtime_error{"Invalid base64url encoding"};
+        }
+        acc = (acc << 6) | static_cast<uint32_t>(v);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back(static_cast<char>((acc >> bits) & 0xff));
+        }
+    }
+
+    return out;
+}
+
+struct BnDeleter {
+    void operator()(BIGNUM *bn) const { BN_free(bn); }
+};
+using bn_ptr_t = unique_ptr<BIGNUM, BnDeleter>;
+
+struct PkeyDeleter {
+    void operator()(EVP_PKEY *key) const { EVP_PKEY_free(key); }
+};
+using pkey_ptr_t = unique_ptr<EVP_PKEY, PkeyDeleter>;
+
+bn_ptr_t toBn(const string& bin) {
+    bn_ptr_t bn{BN_bin2bn(reinterpret_cast<const unsigned char *>(bin.data()),
+                          static_cast<int>(bin.size()), nullptr)};
+    if (!bn) {
+        throw runtime_error{"BN_bin2bn failed"};
+    }
+    return bn;
+}
+
+string getString(const json::object& o, string_view name) {
+    if (auto it = o.find(name); it != o.end() && it->value().is_string()) {
+        return string{it->value().as_string()};
+    }
+    return {};
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+pkey_ptr_t pkeyFromParams(const char *type, OSSL_PARAM_BLD *bld) {
+    unique_ptr<OSSL_PARAM, decltype(&OSSL_PARAM_free)> params{OSSL_PARAM_BLD_to_param(bld), OSSL_PARAM_free};
+    unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx{EVP_PKEY_CTX_new_from_name(nullptr, type, nullptr), EVP_PKEY_CTX_free};
+    EVP_PKEY *pkey = {};
+    if (!params || !ctx
+        || EVP_PKEY_fromdata_init(ctx.get()) != 1
+        || EVP_PKEY_fromdata(ctx.get(), &pkey, EVP_PKEY_PUBLIC_KEY, params.get()) != 1) {
+        throw runtime_error{"EVP_PKEY_fromdata failed"};
+    }
+    return pkey_ptr_t{pkey};
+}
+#endif
+
+pkey_ptr_t makeRsaKey(const string& n, const string& e) {
+    auto bn_n = toBn(n);
+    auto bn_e = toBn(e);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    unique_ptr<OSSL_PARAM_BLD, decltype(&OSSL_PARAM_BLD_free)> bld{OSSL_PARAM_BLD_new(), OSSL_PARAM_BLD_free};
+    if (!bld
+        || OSSL_PARAM_BLD_push_BN(bld.get(), OSSL_PKEY_PARAM_RSA_N, bn_n.get()) != 1
+        || OSSL_PARAM_BLD_push_BN(bld.get(), OSSL_PKEY_PARAM_RSA_E, bn_e.get()) != 1) {
+        throw runtime_error{"Failed to prepare RSA key parameters"};
+    }
+    return pkeyFromParams("RSA", bld.get());
+#else
+    unique_ptr<RSA, decltype(&RSA_free)> rsa{RSA_new(), RSA_free};
+    if (!rsa || RSA_set0_key(rsa.get(), bn_n.get(), bn_e.get(), nullptr) != 1) {
+        throw runtime_error{"RSA_set0_key failed"};
+    }
+    // Now owned by rsa
+    bn_n.release();
+    bn_e.release();
+
+    pkey_ptr_t pkey{EVP_PKEY_new()};
+    if (!pkey || EVP_PKEY_assign_RSA(pkey.get(), rsa.get()) != 1) {
+        throw runtime_error{"EVP_PKEY_assign_RSA failed"};
+    }
+    rsa.release();
+    return pkey;
+#endif
+}
+
+pkey_ptr_t makeEcKey(const string& x, const string& y) {
+    if (x.size() != 32 || y.size() != 32) {
+        throw runtime_error{"Invalid P-256 coordinates"};
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // Uncompressed point: 0x04 | x | y
+    string point;
+    point.reserve(1 + x.size() + y.size());
+    point.push_back(0x04);
+    point.append(x);
+    point.append(y);
+
+    unique_ptr<OSSL_PARAM_BLD, decltype(&OSSL_PARAM_BLD_free)> bld{OSSL_PARAM_BLD_new(), OSSL_PARAM_BLD_free};
+    if (!bld
+        || OSSL_PARAM_BLD_push_utf8_string(bld.get(), OSSL_PKEY_PARAM_GROUP_NAME, SN_X9_62_prime256v1, 0) != 1
+        || OSSL_PARAM_BLD_push_octet_string(bld.get(), OSSL_PKEY_PARAM_PUB_KEY, point.data(), point.size()) != 1) {
+        throw runtime_error{"Failed to prepare EC key parameters"};
+    }
+    return pkeyFromParams("EC", bld.get());
+#else
+    auto bn_x = toBn(x);
+    auto bn_y = toBn(y);
+    unique_ptr<EC_KEY, decltype(&EC_KEY_free)> ec{EC_KEY_new_by_curve_name(NID_X9_62_prime256v1), EC_KEY_free};
+    if (!ec || EC_KEY_set_public_key_affine_coordinates(ec.get(), bn_x.get(), bn_y.get()) != 1) {
+        throw runtime_error{"Failed to set EC public key"};
+    }
+
+    pkey_ptr_t pkey{EVP_PKEY_new()};
+    if (!pkey || EVP_PKEY_assign_EC_KEY(pkey.get(), ec.get()) != 1) {
+        throw runtime_error{"EVP_PKEY_assign_EC_KEY failed"};
+    }
+    ec.release();
+    return pkey;
+#endif
+}
+
+bool verifyHmac(const string& secret, string_view data, const string& signature) {
+    array<unsigned char, EVP_MAX_MD_SIZE> md{};
+    unsigned int len = 0;
+    if (!HMAC(EVP_sha256(), secret.data(), static_cast<int>(secret.size()),
+              reinterpret_cast<const unsigned char *>(data.data()), data.size(),
+              md.data(), &len)) {
+        return false;
+    }
+
+    return len == signature.size()
+        && CRYPTO_memcmp(md.data(), signature.data(), len) == 0;
+}
+
+bool verifyDigest(EVP_PKEY *key, string_view data, const string& signature) {
+    unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx{EVP_MD_CTX_new(), EVP_MD_CTX_free};
+    if (!ctx || EVP_DigestVerifyInit(ctx.get(), nullptr, EVP_sha256(), nullptr, key) != 1) {
+        return false;
+    }
+
+    return EVP_DigestVerify(ctx.get(),
+                            reinterpret_cast<const unsigned char *>(signature.data()), signature.size(),
+                            reinterpret_cast<const unsigned char *>(data.data()), data.size()) == 1;
+}
+
+// JWS uses the raw R|S format for ECDSA signatures. OpenSSL wants DER.
+string ecdsaRawToDer(const string& raw) {
+    if (raw.size() != 64) {
+        return {};
+    }
+
+    unique_ptr<ECDSA_SIG, decltype(&ECDSA_SIG_free)> sig{ECDSA_SIG_new(), ECDSA_SIG_free};
+    auto *r = BN_bin2bn(reinterpret_cast<const unsigned char *>(raw.data()), 32, nullptr);
+    auto *s = BN_bin2bn(reinterpret_cast<const unsigned char *>(raw.data()) + 32, 32, nullptr);
+    if (!sig || !r || !s || ECDSA_SIG_set0(sig.get(), r, s) != 1) {
+        BN_free(r);
+        BN_free(s);
+        return {};
+    }
+
+    const auto len = i2d_ECDSA_SIG(sig.get(), nullptr);
+    if (len <= 0) {
+        return {};
+    }
+
+    string der(static_cast<size_t>(len), '\0');
+    auto *p = reinterpret_cast<unsigned char *>(der.data());
+    i2d_ECDSA_SIG(sig.get(), &p);
+    return der;
+}
+
+optional<chrono::system_clock::time_point> getTime(const json::object& claims, string_view name) {
+    // Seconds that can be converted to a time_point without overflow
+    static constexpr auto max_seconds = chrono::duration_cast<chrono::seconds>(
+        chrono::system_clock::duration::max()).count();
+
+    if (auto it = claims.find(name); it != claims.end()) {
+        const auto& v = it->value();
+        int64_t when = 0;
+        if (v.is_int64()) {
+            when = v.as_int64();
+        } else if (v.is_uint64()) {
+            if (v.as_uint64() > static_cast<uint64_t>(max_seconds)) {
+                throw runtime_error{"Time claim out of range"};
+            }
+            when = static_cast<int64_t>(v.as_uint64());
+        } else if (v.is_double()) {
+            const auto d = v.as_double();
+            // Also rejects NaN
+            if (!(d >= -static_cast<double>(max_seconds) && d <= static_cast<double>(max_seconds))) {
+                throw runtime_error{"Time claim out of range"};
+            }
+            when = static_cast<int64_t>(d);
+        } else {
+            throw runtime_error{"Invalid time claim"};
+        }
+
+        if (when > max_seconds || when < -max_seconds) {
+            throw runtime_error{"Time claim out of range"};
+        }
+        return chrono::system_clock::time_point{chrono::seconds{when}};
+    }
+    return {};
+}
+
+bool hasAudience(const json::object& claims, string_view audience) {
+    auto it = claims.find("aud");
+    if (it == claims.end()) {
+        return false;
+    }
+
+    if (it->value().is_string()) {
+        return it->value().as_string() == audience;
+    }
+
+    if (it->value().is_array()) {
+        for(const auto& a : it->value().as_array()) {
+            if (a.is_string() && a.as_string() == audience) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+} // anon ns
+
+struct JwtAuthenticator::Key {
+    string kid;
+    Alg alg = Alg::HS256;
+    string secret; // HS256
+    pkey_ptr_t pkey; // RS256 and ES256
+};
+
+struct JwtAuthenticator::KeySet {
+    vector<Key> keys;
+
+    const Key *find(string_view kid, Alg alg) const {
+        const Key *candidate = {};
+        for(const auto& key : keys) {
+            if (key.alg != alg) {
+                continue;
+            }
+            if (!kid.empty()) {
+                if (key.kid == kid) {
+                    return &key;
+                }
+                continue;
+            }
+            // No kid in the token. Only acceptable if there is exactly one key that may match.
+            if (candidate) {
+                return {};
+            }
+            candidate = &key;
+        }
+        return candidate;
+    }
+
+    static shared_ptr<const KeySet> load(const filesystem::path& path) {
+        ifstream file{path};
+        if (!file.is_open()) {
+            throw runtime_error{"Failed to open JWKS file " + path.string()};
+        }
+
+        stringstream content;
+        content << file.rdbuf();
+
+        auto jwks = json::parse(content.str());
+        auto ks = make_shared<KeySet>();
+
+        for(const auto& jv : jwks.as_object().at("keys").as_array()) {
+            const auto& jwk = jv.as_object();
+            Key key;
+            key.kid = getString(jwk, "kid");
+
+            if (const auto use = getString(jwk, "use"); !use.empty() && use != "sig") {
+                LOG_DEBUG << "JwtAuthenticator: Ignoring key '" << key.kid << "' with use=" << use;
+                continue;
+            }
+
+            const auto kty = getString(jwk, "kty");
+            try {
+                if (kty == "oct") {
+                    key.alg = Alg::HS256;
+                    key.secret = base64UrlDecode(getString(jwk, "k"));
+                } else if (kty == "RSA") {
+                    key.alg = Alg::RS256;
+                    key.pkey = makeRsaKey(base64UrlDecode(getString(jwk, "n")),
+                                          base64UrlDecode(getString(jwk, "e")));
+                } else if (kty == "EC" && getString(jwk, "crv") == "P-256") {
+                    key.alg = Alg::ES256;
+                    key.pkey = makeEcKey(base64UrlDecode(getString(jwk, "x")),
+                                         base64UrlDecode(getString(jwk, "y")));
+                } else {
+                    LOG_DEBUG << "JwtAuthenticator: Ignoring key '" << key.kid << "' with unsupported kty=" << kty;
+                    continue;
+                }
+            } catch(const exception& ex) {
+                LOG_WARN << "JwtAuthenticator: Ignoring invalid key '" << key.kid << "': " << ex.what();
+                continue;
+            }
+
+            // If the key specifies an algorithm, it must be the one implied by its type.
+            if (const auto alg = getString(jwk, "alg"); !alg.empty() && toAlg(alg) != key.alg) {
+                LOG_DEBUG << "JwtAuthenticator: Ignoring key '" << key.kid << "' with unsupported alg=" << alg;
+                continue;
+            }
+
+            ks->keys.emplace_back(std::move(key));
+        }
+
+        LOG_INFO << "JwtAuthenticator: Loaded " << ks->keys.size() << " key(s) from " << path;
+        return ks;
+    }
+};
+
+JwtAuthenticator::JwtAuthenticator(Config config)
+    : config_{std::move(config)}
+{
+    keys_mtime_ = filesystem::last_write_time(config_.jwks_path);
+    keys_ = KeySet::load(config_.jwks_path);
+    next_keys_check_ = chrono::steady_clock::now() + config_.jwks_check_interval;
+}
+
+JwtAuthenticator::~JwtAuthenticator() = default;
+
+Auth JwtAuthenticator::authenticate(const AuthReq &ar)
+{
+    static constexpr string_view bearer = "Bearer ";
+
+    auto header = ar.auth_header;
+    if (header.size() <= bearer.size()
+        || !equal(bearer.begin(), bearer.end(), header.begin(), [](char a, char b) {
+            return tolower(static_cast<unsigned char>(a)) == tolower(static_cast<unsigned char>(b));
+        })) {
+        return {};
+    }
+
+    return verify(header.substr(bearer.size()));
+}
+
+Auth JwtAuthenticator::verify(string_view token)
+{
+    // Check for changed keys before the cache is used, so that revoked keys are not accepted from the cache
+    const auto ks = keys();
+    if (auto cached = lookup(token, ks)) {
+        return std::move(*cached);
+    }
+
+    try {
+        const auto hdr_end = token.find('.');
+        const auto payload_end = token.rfind('.');
+        if (hdr_end == string_view::npos || payload_end == hdr_end) {
+            throw runtime_error{"Malformed token"};
+        }
+
+        const auto signed_part = token.substr(0, payload_end);
+        const auto header = json::parse(base64UrlDecode(token.substr(0, hdr_end))).as_object();
+        const auto alg = toAlg(getString(header, "alg"));
+        if (!alg) {
+            throw runtime_error{"Unsupported alg: " + getString(header, "alg")};
+        }
+
+        const auto *key = ks->find(getString(header, "kid"), *alg);
+        if (!key) {
+            throw runtime_error{"No matching key"};
+        }
+
+        const auto signature = base64UrlDecode(token.substr(payload_end + 1));
+        bool valid = false;
+        switch(*alg) {
+        case Alg::HS256:
+            valid = verifyHmac(key->secret, signed_part, signature);
+            break;
+        case Alg::RS256:
+            valid = verifyDigest(key->pkey.get(), signed_part, signature);
+            break;
+        case Alg::ES256:
+            if (const auto der = ecdsaRawToDer(signature); !der.empty()) {
+                valid = verifyDigest(key->pkey.get(), signed_part, der);
+            }
+            break;
+        }
+
+        if (!valid) {
+            throw runtime_error{"Invalid signature"};
+        }
+
+        auto claims = make_shared<json::object>(
+            json::parse(base64UrlDecode(token.substr(hdr_end + 1, payload_end - hdr_end - 1))).as_object());
+
+        const auto now = chrono::system_clock::now();
+        const auto exp = getTime(*claims, "exp");
+        if (!exp) {
+            throw runtime_error{"Missing exp claim"};
+        }
+        if (*exp + config_.leeway <= now) {
+            throw runtime_error{"Token expired"};
+        }
+        if (const auto nbf = getTime(*claims, "nbf"); nbf && *nbf > now + config_.leeway) {
+            throw runtime_error{"Token not yet valid"};
+        }
+        if (!config_.issuer.empty() && getString(*claims, "iss") != config_.issuer) {
+            throw runtime_error{"Unexpected issuer"};
+        }
+        if (!config_.audience.empty() && !hasAudience(*claims, config_.audience)) {
+            throw runtime_error{"Unexpected audience"};
+        }
+
+        Auth auth;
+        auth.account = getString(*claims, config_.account_claim);
+        auth.access = true;
+        auth.extra = shared_ptr<const json::object>{std::move(claims)};
+
+        addToCache(token, auth, *exp + config_.leeway, ks);
+        return auth;
+    } catch(const exception& ex) {
+        LOG_DEBUG << "JwtAuthenticator: Rejected token: " << ex.what();
+    }
+
+    return {};
+}
+
+size_t JwtAuthenticator::cachedTokens() const
+{
+    lock_guard lock{cache_mutex_};
+    return cache_.size();
+}
+
+shared_ptr<const JwtAuthenticator::KeySet> JwtAuthenticator::keys()
+{
+    if (chrono::steady_clock::now() >= next_keys_check_.load(memory_order_relaxed)) {
+        reloadKeysIfChanged();
+    }
+
+    lock_guard lock{keys_mutex_};
+    return keys_;
+}
+
+void JwtAuthenticator::reloadKeysIfChanged()
+{
+    unique_lock reload_lock{reload_mutex_, try_to_lock};
+    if (!reload_lock.owns_lock()) {
+        // Someone else is already checking
+        return;
+    }
+
+    next_keys_check_ = chrono::steady_clock::now() + config_.jwks_check_interval;
+
+    error_code ec;
+    const auto mtime = filesystem::last_write_time(config_.jwks_path, ec);
+    if (ec) {
+        LOG_WARN << "JwtAuthenticator: Failed to stat " << config_.jwks_path << ": " << ec.message();
+        return;
+    }
+
+    if (mtime == keys_mtime_) {
+        return;
+    }
+
+    // Read and parse the file without blocking the requests that use the current keys
+    shared_ptr<const KeySet> keys;
+    try {
+        keys = KeySet::load(config_.jwks_path);
+    } catch(const exception& ex) {
+        LOG_WARN << "JwtAuthenticator: Failed to reload " << config_.jwks_path
+                 << ". Keeping the old keys: " << ex.what();
+        return;
+    }
+
+    {
+        lock_guard lock{keys_mutex_};
+        keys_ = std::move(keys);
+    }
+    keys_mtime_ = mtime;
+    reload_lock.unlock();
+
+    // Keys may have been revoked.
+    clearCache();
+}
+
+optional<Auth> JwtAuthenticator::lookup(string_view token, const shared_ptr<const KeySet>& keys)
+{
+    lock_guard lock{cache_mutex_};
+    if (auto it = cache_.find(token); it != cache_.end()) {
+        // Tokens verified with keys that have since been replaced must be verified again
+        if (it->second->expires <= chrono::system_clock::now() || it->second->keys != keys) {
+            lru_.erase(it->second);
+            cache_.erase(it);
+            return {};
+        }
+
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->auth;
+    }
+
+    return {};
+}
+
+void JwtAuthenticator::addToCache(string_view token, const Auth &auth, chrono::system_clock::time_point expires,
+                                  shared_ptr<const KeySet> keys)
+{
+    if (config_.max_cached_tokens == 0) {
+        return;
+    }
+
+    lock_guard lock{cache_mutex_};
+    if (cache_.contains(token)) {
+        return;
+    }
+
+    while(cache_.size() >= config_.max_cached_tokens) {
+        cache_.erase(lru_.back().token);
+        lru_.pop_back();
+    }
+
+    lru_.push_front({string{token}, auth, expires, std::move(keys)});
+    cache_.emplace(lru_.front().token, lru_.begin());
+}
+
+void JwtAuthenticator::clearCache()
+{
+    lock_guard lock{cache_mutex_};
+    cache_.clear();
+    lru_.clear();
+}
+
+} // ns
+
+#endif // USING_BOOST_JSON
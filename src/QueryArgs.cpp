@@ -0,0 +1,182 @@
+
+#include <bit>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+#include "yahat/QueryArgs.h"
+
+using namespace std;
+
+namespace yahat {
+
+namespace {
+
+constexpr bool isSpecial(char ch) noexcept {
+    return ch == '&' || ch == '=' || ch == '%' || ch == '+';
+}
+
+// Call fn(pos) for each '&', '=', '%' and '+' in data
+template <typename fnT>
+void scan(const char *data, size_t len, fnT&& fn) {
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const auto amp = _mm_set1_epi8('&');
+    const auto eq = _mm_set1_epi8('=');
+    const auto pct = _mm_set1_epi8('%');
+    const auto plus = _mm_set1_epi8('+');
+
+    for(; i + 16 <= len; i += 16) {
+        const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        const auto hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, amp), _mm_cmpeq_epi8(chunk, eq)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, pct), _mm_cmpeq_epi8(chunk, plus)));
+
+        for(auto mask = static_cast<unsigned>(_mm_movemask_epi8(hits)); mask; mask &= mask - 1) {
+            fn(i + countr_zero(mask));
+        }
+    }
+#endif
+
+    for(; i < len; ++i) {
+        if (isSpecial(data[i])) {
+            fn(i);
+        }
+    }
+}
+
+int hexValue(char ch) noexcept {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+} // anon ns
+
+void QueryArgs::assign(std::string_view query)
+{
+    if (query.size() > numeric_limits<uint32_t>::max()) {
+        throw runtime_error{"QueryArgs: The query is too long"};
+    }
+
+    buffer_.assign(query);
+    args_.clear();
+
+    size_t begin = 0;
+    size_t eq = string_view::npos;
+    bool key_encoded = false;
+    bool value_encoded = false;
+
+    scan(buffer_.data(), buffer_.size(), [&](size_t pos) {
+        switch(buffer_[pos]) {
+        case '&':
+            add(begin, eq, pos, key_encoded, value_encoded);
+            begin = pos + 1;
+            eq = string_view::npos;
+            key_encoded = value_encoded = false;
+            break;
+        case '=':
+            if (eq == string_view::npos) {
+                eq = pos;
+            }
+            break;
+        default: // '%' or '+'
+            (eq == string_view::npos ? key_encoded : value_encoded) = true;
+        }
+    });
+
+    add(begin, eq, buffer_.size(), key_encoded, value_encoded);
+}
+
+optional<string_view> QueryArgs::get(string_view key) const
+{
+    if (const auto *arg = find(key)) {
+        return value(*arg);
+    }
+    return {};
+}
+
+size_t QueryArgs::decode(char *data, size_t len, bool plusIsSpace) noexcept
+{
+    char *out = data;
+    for(size_t i = 0; i < len; ++i) {
+        const auto ch = data[i];
+        if (ch == '+' && plusIsSpace) {
+            *out++ = ' ';
+            continue;
+        }
+
+        if (ch == '%' && i + 2 < len) {
+            const auto hi = hexValue(data[i + 1]);
+            const auto lo = hexValue(data[i + 2]);
+            if (hi >= 0 && lo >= 0) {
+                *out++ = static_cast<char>((hi << 4) | lo);
+                i += 2;
+                continue;
+            }
+        }
+
+        *out++ = ch;
+    }
+
+    return out - data;
+}
+
+void QueryArgs::add(size_t begin, size_t eq, size_t end, bool keyEncoded, bool valueEncoded)
+{
+    if (begin == end) {
+        return; // Empty segment, like in "a=1&&b=2"
+    }
+
+    Arg arg;
+    arg.key = begin;
+    arg.key_len = (eq == string_view::npos ? end : eq) - begin;
+    if (eq != string_view::npos) {
+        arg.value = eq + 1;
+        arg.value_len = end - eq - 1;
+    } else {
+        arg.value = end;
+    }
+    arg.encoded = valueEncoded;
+
+    if (keyEncoded) {
+        arg.key_len = decode(buffer_.data() + arg.key, arg.key_len);
+    }
+
+    args_.emplace_back(arg);
+}
+
+const QueryArgs::Arg *QueryArgs::find(string_view key) const
+{
+    for(auto it = args_.rbegin(); it != args_.rend(); ++it) {
+        if (this->key(*it) == key) {
+            return &*it;
+        }
+    }
+    return {};
+}
+
+string_view QueryArgs::value(const Arg &arg) const
+{
+    if (arg.encoded) {
+        // Decoded in place the first time the value is used
+        auto& a = const_cast<Arg&>(arg);
+        a.value_len = decode(buffer_.data() + a.value, a.value_len);
+        a.encoded = false;
+    }
+
+    return {buffer_.data() + arg.value, arg.value_len};
+}
+
+} // ns
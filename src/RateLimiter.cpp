@@ -0,0 +1,198 @@
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <mutex>
+
+#include "yahat/RateLimiter.h"
+#include "yahat/logging.h"
+
+using namespace std;
+
+namespace yahat {
+
+namespace {
+
+// Tags for the sources of the keys
+constexpr char tag_address = 'i';
+constexpr char tag_account = 'a';
+constexpr char tag_custom = 'c';
+
+} // anon ns
+
+#ifdef YAHAT_ENABLE_METRICS
+RateLimiter::RateLimiter(Config config, Metrics *metrics)
+#else
+RateLimiter::RateLimiter(Config config)
+#endif
+    : config_{std::move(config)}
+    , interval_ns_{static_cast<int64_t>(1'000'000'000.0 / max(config_.rate, 0.000001))}
+    , tolerance_ns_{interval_ns_ * max<int64_t>(config_.burst, 1)}
+{
+    if (config_.key == KeyType::CUSTOM && !config_.custom_key) {
+        throw runtime_error{"RateLimiter: KeyType::CUSTOM requires a custom_key function"};
+    }
+
+    const auto num_shards = bit_ceil(max<size_t>(config_.shards, 1));
+    shard_mask_ = num_shards - 1;
+    shards_ = make_unique<Shard[]>(num_shards);
+
+#ifdef YAHAT_ENABLE_METRICS
+    if (metrics) {
+        const Metrics::labels_t labels{{"limiter", config_.name}};
+        allowed_ = metrics->AddCounter("yahat_rate_limiter_allowed", "Requests allowed by the rate limiter", {}, labels);
+        limited_ = metrics->AddCounter("yahat_rate_limiter_limited", "Requests rejected by the rate limiter", {}, labels);
+        keys_ = metrics->AddGauge("yahat_rate_limiter_keys", "Number of keys tracked by the rate limiter", {}, labels);
+    }
+#endif
+
+    LOG_DEBUG << "RateLimiter " << config_.name << " created with rate "
+              << config_.rate << "/sec and burst " << config_.burst;
+}
+
+RateLimiter::Result RateLimiter::check(const Request &req, clock_t::time_point now)
+{
+    switch(config_.key) {
+    case KeyType::ACCOUNT:
+        if (!req.auth.account.empty()) {
+            return consume(KeyRef{tag_account, req.auth.account}, now);
+        }
+        [[fallthrough]];
+    case KeyType::REMOTE_IP:
+        return consume(req.remote.address(), now);
+    case KeyType::CUSTOM:
+        return consume(KeyRef{tag_custom, config_.custom_key(req)}, now);
+    }
+
+    return {};
+}
+
+RateLimiter::Result RateLimiter::check(string_view key, clock_t::time_point now)
+{
+    return consume(KeyRef{tag_custom, key}, now);
+}
+
+size_t RateLimiter::size() const
+{
+    size_t count = 0;
+    for(size_t i = 0; i <= shard_mask_; ++i) {
+        shared_lock lock{shards_[i].mutex};
+        count += shards_[i].buckets.size();
+    }
+    return count;
+}
+
+RateLimiter::Result RateLimiter::consume(const boost::asio::ip::address &address, clock_t::time_point now)
+{
+    if (address.is_v4()) {
+        const auto bytes = address.to_v4().to_bytes();
+        return consume(KeyRef{tag_address, {reinterpret_cast<const char *>(bytes.data()), bytes.size()}}, now);
+    }
+
+    const auto bytes = address.to_v6().to_bytes();
+    return consume(KeyRef{tag_address, {reinterpret_cast<const char *>(bytes.data()), bytes.size()}}, now);
+}
+
+RateLimiter::Result RateLimiter::consume(KeyRef key, clock_t::time_point now)
+{
+    // The low bits are used by the buckets hash-table
+    const uint64_t hash = KeyHash{}(key);
+    auto& shard = shards_[(hash >> 32) & shard_mask_];
+    const auto now_ns = toNs(now);
+
+    {
+        shared_lock lock{shard.mutex};
+        if (auto it = shard.buckets.find(key); it != shard.buckets.end()) {
+            return take(it->second, now_ns);
+        }
+    }
+
+    unique_lock lock{shard.mutex};
+    if (shard.buckets.size() >= config_.max_keys_per_shard && !shard.buckets.contains(key)) {
+        evict(shard, now_ns);
+    }
+
+    string stored(1, key.tag);
+    stored += key.value;
+    auto [it, added] = shard.buckets.try_emplace(std::move(stored));
+    if (added) {
+        // A new bucket is full
+        it->second.tat.store(now_ns, memory_order_relaxed);
+#ifdef YAHAT_ENABLE_METRICS
+        if (keys_) {
+            keys_->inc();
+        }
+#endif
+    }
+
+    return take(it->second, now_ns);
+}
+
+RateLimiter::Result RateLimiter::take(Bucket &bucket, int64_t now)
+{
+    // Must be called with a lock on the shard, so the bucket is not evicted under our feet.
+
+    bucket.last_seen.store(now, memory_order_relaxed);
+
+    auto tat = bucket.tat.load(memory_order_relaxed);
+    while(true) {
+        const auto new_tat = max(tat, now) + interval_ns_;
+        if (new_tat - now > tolerance_ns_) {
+#ifdef YAHAT_ENABLE_METRICS
+            if (limited_) {
+                limited_->inc();
+            }
+#endif
+            const auto wait_ns = new_tat - now - tolerance_ns_;
+            const auto retry_after = static_cast<int64_t>(ceil(wait_ns / 1'000'000'000.0));
+            return {false, chrono::seconds{max<int64_t>(retry_after, 1)}};
+        }
+
+        if (bucket.tat.compare_exchange_weak(tat, new_tat, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+#ifdef YAHAT_ENABLE_METRICS
+    if (allowed_) {
+        allowed_->inc();
+    }
+#endif
+    return {};
+}
+
+void RateLimiter::evict(Shard &shard, int64_t now)
+{
+    // Must be called with the shards unique lock held
+
+    const auto before = shard.buckets.size();
+
+    // A bucket that is completely refilled is the same as a new bucket, so we can forget it.
+    erase_if(shard.buckets, [now](const auto& v) {
+        return v.second.tat.load(memory_order_relaxed) <= now;
+    });
+
+    if (shard.buckets.size() >= config_.max_keys_per_shard) {
+        auto lru = min_element(shard.buckets.begin(), shard.buckets.end(), [](const auto& a, const auto& b) {
+            return a.second.last_seen.load(memory_order_relaxed) < b.second.last_seen.load(memory_order_relaxed);
+        });
+        assert(lru != shard.buckets.end());
+        shard.buckets.erase(lru);
+    }
+
+#ifdef YAHAT_ENABLE_METRICS
+    if (keys_) {
+        keys_->dec(before - shard.buckets.size());
+    }
+#endif
+
+    LOG_TRACE << "RateLimiter " << config_.name << " evicted " << (before - shard.buckets.size()) << " keys";
+}
+
+int64_t RateLimiter::toNs(clock_t::time_point when) const noexcept
+{
+    return chrono::duration_cast<chrono::nanoseconds>(when - epoch_).count();
+}
+
+} // ns
@@ -0,0 +1,59 @@
+
+#include <utility>
+
+#include "yahat/RequestArena.h"
+
+using namespace std;
+
+namespace yahat {
+
+RequestArena::RequestArena()
+    : initial_{make_unique<std::byte[]>(initial_size)}
+    , arena_{initial_.get(), initial_size, &upstream_}
+{
+}
+
+uint64_t RequestArena::release()
+{
+    arena_.release();
+    return exchange(allocations_, 0);
+}
+
+uint64_t RequestArena::overflows()
+{
+    return exchange(upstream_.blocks, 0);
+}
+
+void *RequestArena::Upstream::do_allocate(size_t bytes, size_t alignment)
+{
+    ++blocks;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void RequestArena::Upstream::do_deallocate(void *p, size_t bytes, size_t alignment)
+{
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+}
+
+bool RequestArena::Upstream::do_is_equal(const memory_resource &other) const noexcept
+{
+    return this == &other;
+}
+
+void *RequestArena::do_allocate(size_t bytes, size_t alignment)
+{
+    ++allocations_;
+    return arena_.allocate(bytes, alignment);
+}
+
+void RequestArena::do_deallocate(void *, size_t, size_t)
+{
+    // Released in bulk
+}
+
+bool RequestArena::do_is_equal(const memory_resource &other) const noexcept
+{
+    return this == &other;
+}
+
+} // ns
@@ -0,0 +1,187 @@
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include <boost/uuid/uuid_io.hpp>
+
+#include "yahat/RequestId.h"
+
+using namespace std;
+
+namespace yahat {
+
+namespace {
+
+int hexValue(char ch) noexcept {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+// Parse 32 hex digits, optionally with dashes in the canonical UUID positions
+bool parseUuid(string_view text, boost::uuids::uuid& uuid) {
+    if (text.size() == 36) {
+        if (text[8] != '-' || text[13] != '-' || text[18] != '-' || text[23] != '-') {
+            return false;
+        }
+    } else if (text.size() != 32) {
+        return false;
+    }
+
+    size_t byte = 0;
+    for(size_t i = 0; i < text.size();) {
+        if (text[i] == '-' && text.size() == 36) {
+            ++i;
+            continue;
+        }
+        const auto hi = hexValue(text[i]);
+        const auto lo = i + 1 < text.size() ? hexValue(text[i + 1]) : -1;
+        if (hi < 0 || lo < 0 || byte >= uuid.size()) {
+            return false;
+        }
+        uuid.data[byte++] = static_cast<uint8_t>((hi << 4) | lo);
+        i += 2;
+    }
+
+    return byte == uuid.size();
+}
+
+bool isValidIdChar(char ch) noexcept {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')
+           || ch == '-' || ch == '_' || ch == '.' || ch == ':' || ch == '/' || ch == '+' || ch == '=';
+}
+
+} // anon ns
+
+RequestId::RequestId(const RequestId &other)
+{
+    other.ensure();
+    uuid_ = other.uuid_;
+    ready_ = true;
+    adopted_ = other.adopted_;
+    text_ = other.text_;
+}
+
+RequestId &RequestId::operator =(const RequestId &other)
+{
+    if (this != &other) {
+        other.ensure();
+        uuid_ = other.uuid_;
+        ready_ = true;
+        adopted_ = other.adopted_;
+        text_ = other.text_;
+    }
+    return *this;
+}
+
+bool RequestId::adopt(string_view requestId)
+{
+    if (requestId.empty() || requestId.size() > 128
+        || !all_of(requestId.begin(), requestId.end(), isValidIdChar)) {
+        return false;
+    }
+
+    boost::uuids::uuid uuid;
+    if (parseUuid(requestId, uuid)) {
+        uuid_ = uuid;
+        text_.clear();
+    } else {
+        uuid_ = {};
+        text_ = requestId;
+    }
+
+    ready_ = adopted_ = true;
+    return true;
+}
+
+bool RequestId::adoptTraceparent(string_view traceparent)
+{
+    // version "-" trace-id "-" parent-id "-" trace-flags
+    // 00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01
+    if (traceparent.size() < 55 || traceparent[2] != '-' || traceparent[35] != '-') {
+        return false;
+    }
+
+    boost::uuids::uuid uuid;
+    if (!parseUuid(traceparent.substr(3, 32), uuid) || uuid.is_nil()) {
+        return false;
+    }
+
+    uuid_ = uuid;
+    text_.clear();
+    ready_ = adopted_ = true;
+    return true;
+}
+
+const boost::uuids::uuid &RequestId::uuid() const
+{
+    ensure();
+    return uuid_;
+}
+
+string RequestId::str() const
+{
+    ensure();
+    return text_.empty() ? boost::uuids::to_string(uuid_) : text_;
+}
+
+boost::uuids::uuid RequestId::generate()
+{
+    // One generator for each thread, so there is no locking or sharing
+    thread_local mt19937_64 rng{[] {
+        random_device rd;
+        seed_seq seq{rd(), rd(), rd(), rd()};
+        return mt19937_64{seq};
+    }()};
+
+    const auto ms = static_cast<uint64_t>(chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count());
+    const auto r1 = rng();
+    const auto r2 = rng();
+
+    boost::uuids::uuid uuid;
+
+    // 48 bit big-endian unix timestamp in milliseconds
+    for(auto i = 0; i < 6; ++i) {
+        uuid.data[i] = static_cast<uint8_t>(ms >> (8 * (5 - i)));
+    }
+
+    // Version 7, and 12 random bits
+    uuid.data[6] = static_cast<uint8_t>(0x70 | (r1 & 0x0f));
+    uuid.data[7] = static_cast<uint8_t>(r1 >> 8);
+
+    // Variant 10, and 62 random bits
+    uuid.data[8] = static_cast<uint8_t>(0x80 | ((r1 >> 16) & 0x3f));
+    for(auto i = 9; i < 16; ++i) {
+        uuid.data[i] = static_cast<uint8_t>(r2 >> (8 * (i - 9)));
+    }
+
+    return uuid;
+}
+
+void RequestId::ensure() const
+{
+    if (!ready_) {
+        uuid_ = generate();
+        ready_ = true;
+    }
+}
+
+ostream &operator <<(ostream &out, const RequestId &id)
+{
+    id.ensure();
+    if (!id.text_.empty()) {
+        return out << id.text_;
+    }
+    return out << id.uuid_;
+}
+
+} // ns
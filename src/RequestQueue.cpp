@@ -0,0 +1,111 @@
+
+#include <cassert>
+
+#include "yahat/RequestQueue.h"
+#include "yahat/logging.h"
+
+using namespace std;
+
+namespace yahat {
+
+#ifdef YAHAT_ENABLE_METRICS
+RequestQueue::RequestQueue(Config config, Metrics *metrics)
+#else
+RequestQueue::RequestQueue(Config config)
+#endif
+    : config_{std::move(config)}
+{
+#ifdef YAHAT_ENABLE_METRICS
+    if (metrics) {
+        const Metrics::labels_t labels{{"queue", config_.name}};
+        depth_gauge_ = metrics->AddGauge("yahat_request_queue_depth", "Requests waiting in the queue", {}, labels);
+        dequeued_ = metrics->AddCounter("yahat_request_queue_dequeued", "Requests taken out of the queue", {}, labels);
+        wait_time_ = metrics->AddCounter<double>("yahat_request_queue_wait", "Total time requests have waited in the queue", "seconds", labels);
+
+        auto shed_labels = labels;
+        shed_labels.emplace_back("reason", "full");
+        shed_full_ = metrics->AddCounter("yahat_request_queue_shed", "Requests shed by the queue", {}, shed_labels);
+        shed_labels.back().second = "wait";
+        shed_wait_ = metrics->AddCounter("yahat_request_queue_shed", "Requests shed by the queue", {}, shed_labels);
+    }
+#endif
+}
+
+optional<RequestQueue::Ticket> RequestQueue::tryEnqueue(clock_t::time_point now)
+{
+    auto current = depth_.load(memory_order_relaxed);
+    do {
+        if (config_.max_depth && current >= config_.max_depth) {
+#ifdef YAHAT_ENABLE_METRICS
+            if (shed_full_) {
+                shed_full_->inc();
+            }
+#endif
+            return {};
+        }
+    } while(!depth_.compare_exchange_weak(current, current + 1, memory_order_relaxed));
+
+    if (current == 0) {
+        // The queue was empty until now
+        last_empty_.store(toNs(now), memory_order_relaxed);
+    }
+
+#ifdef YAHAT_ENABLE_METRICS
+    if (depth_gauge_) {
+        depth_gauge_->inc();
+    }
+#endif
+
+    return optional<Ticket>{in_place, *this, now};
+}
+
+bool RequestQueue::dequeue(Ticket &ticket, clock_t::time_point now)
+{
+    assert(ticket.queue_ == this);
+    ticket.queue_ = {};
+
+    const auto wait = now - ticket.enqueued_;
+    const auto standing = toNs(now) - last_empty_.load(memory_order_relaxed)
+                          > chrono::nanoseconds{config_.interval}.count();
+    remove(now);
+
+#ifdef YAHAT_ENABLE_METRICS
+    if (dequeued_) {
+        dequeued_->inc();
+        wait_time_->inc(chrono::duration<double>(wait).count());
+    }
+#endif
+
+    const auto max_wait = standing ? config_.target : config_.interval;
+    if (wait > max_wait) {
+        LOG_TRACE << "RequestQueue " << config_.name << " shedding a request that waited "
+                  << chrono::duration_cast<chrono::milliseconds>(wait).count() << " ms";
+#ifdef YAHAT_ENABLE_METRICS
+        if (shed_wait_) {
+            shed_wait_->inc();
+        }
+#endif
+        return false;
+    }
+
+    return true;
+}
+
+void RequestQueue::remove(clock_t::time_point now) noexcept
+{
+#ifdef YAHAT_ENABLE_METRICS
+    if (depth_gauge_) {
+        depth_gauge_->dec();
+    }
+#endif
+    if (depth_.fetch_sub(1, memory_order_relaxed) == 1) {
+        last_empty_.store(toNs(now), memory_order_relaxed);
+    }
+}
+
+int64_t RequestQueue::toNs(clock_t::time_point when) const noexcept
+{
+    return chrono::duration_cast<chrono::nanoseconds>(when - epoch_).count();
+}
+
+} // ns
@@ -0,0 +1,142 @@
+
+#include <cassert>
+
+#include "yahat/ResponseCache.h"
+#include "yahat/logging.h"
+
+using namespace std;
+
+namespace yahat {
+
+#ifdef YAHAT_ENABLE_METRICS
+ResponseCache::ResponseCache(Config config, Metrics *metrics)
+#else
+ResponseCache::ResponseCache(Config config)
+#endif
+    : config_{std::move(config)}
+{
+#ifdef YAHAT_ENABLE_METRICS
+    if (metrics) {
+        const Metrics::labels_t labels{{"cache", config_.name}};
+        hits_ = metrics->AddCounter("yahat_response_cache_hits", "Requests served from the response cache", {}, labels);
+        misses_ = metrics->AddCounter("yahat_response_cache_misses", "Requests not found in the response cache", {}, labels);
+        entries_ = metrics->AddGauge("yahat_response_cache_entries", "Responses in the response cache", {}, labels);
+        bytes_gauge_ = metrics->AddGauge("yahat_response_cache_size", "Memory used by the response cache", "bytes", labels);
+    }
+#endif
+
+    LOG_DEBUG << "ResponseCache " << config_.name << " created with TTL "
+              << config_.ttl.count() << " ms and max size " << config_.max_bytes << " bytes";
+}
+
+string ResponseCache::makeKey(const Request &req) const
+{
+    string key;
+    key.reserve(req.target.size() + req.query.size() + req.auth.account.size() + 2);
+    key = req.target;
+    if (!req.query.empty()) {
+        key += '?';
+        key += req.query;
+    }
+
+    if (config_.scope == Scope::ACCOUNT) {
+        // Not valid in an URL, so it can't be confused with the arguments
+        key += ' ';
+        key += req.auth.account;
+    }
+
+    return key;
+}
+
+ResponseCache::entry_t ResponseCache::get(string_view key, clock_t::time_point now)
+{
+    lock_guard lock{mutex_};
+
+    if (auto it = index_.find(key); it != index_.end()) {
+        auto lit = it->second;
+        if (lit->entry->expires > now) {
+            lru_.splice(lru_.begin(), lru_, lit);
+#ifdef YAHAT_ENABLE_METRICS
+            if (hits_) {
+                hits_->inc();
+            }
+#endif
+            return lit->entry;
+        }
+
+        erase(lit);
+        updateMetrics();
+    }
+
+#ifdef YAHAT_ENABLE_METRICS
+    if (misses_) {
+        misses_->inc();
+    }
+#endif
+    return {};
+}
+
+void ResponseCache::put(string key, entry_t entry)
+{
+    assert(entry);
+    const auto size = entry->size() + key.size();
+    if (size > config_.max_bytes) {
+        LOG_TRACE << "ResponseCache " << config_.name << " - entry for " << key << " is too large to cache";
+        return;
+    }
+
+    lock_guard lock{mutex_};
+
+    if (auto it = index_.find(key); it != index_.end()) {
+        erase(it->second);
+    }
+
+    while(!lru_.empty() && bytes_ + size > config_.max_bytes) {
+        erase(prev(lru_.end()));
+    }
+
+    lru_.push_front({std::move(key), std::move(entry)});
+    index_.emplace(lru_.front().key, lru_.begin());
+    bytes_ += size;
+    updateMetrics();
+}
+
+size_t ResponseCache::size() const
+{
+    lock_guard lock{mutex_};
+    return index_.size();
+}
+
+size_t ResponseCache::bytes() const
+{
+    lock_guard lock{mutex_};
+    return bytes_;
+}
+
+void ResponseCache::clear()
+{
+    lock_guard lock{mutex_};
+    index_.clear();
+    lru_.clear();
+    bytes_ = 0;
+    updateMetrics();
+}
+
+void ResponseCache::erase(lru_t::iterator it)
+{
+    bytes_ -= it->entry->size() + it->key.size();
+    index_.erase(it->key);
+    lru_.erase(it);
+}
+
+void ResponseCache::updateMetrics()
+{
+#ifdef YAHAT_ENABLE_METRICS
+    if (entries_) {
+        entries_->set(index_.size());
+        bytes_gauge_->set(bytes_);
+    }
+#endif
+}
+
+} // ns
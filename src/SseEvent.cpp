@@ -0,0 +1,137 @@
+
+#include <array>
+#include <charconv>
+#include <stdexcept>
+
+#include "yahat/SseEvent.h"
+
+using namespace std;
+
+namespace yahat {
+
+SseEvent &SseEvent::event(string_view name)
+{
+    if (name.find_first_of("\r\n") != string_view::npos) {
+        throw runtime_error{"SseEvent: The event name cannot contain line breaks"};
+    }
+    field("event", name);
+    return *this;
+}
+
+SseEvent &SseEvent::id(uint64_t id)
+{
+    array<char, 20> buffer;
+    const auto [end, _] = to_chars(buffer.data(), buffer.data() + buffer.size(), id);
+    field("id", {buffer.data(), static_cast<size_t>(end - buffer.data())});
+    return *this;
+}
+
+SseEvent &SseEvent::id(string_view id)
+{
+    if (id.find_first_of(string_view{"\r\n\0", 3}) != string_view::npos) {
+        throw runtime_error{"SseEvent: The id cannot contain line breaks or null characters"};
+    }
+    field("id", id);
+    return *this;
+}
+
+SseEvent &SseEvent::retry(chrono::milliseconds delay)
+{
+    array<char, 20> buffer;
+    const auto [end, _] = to_chars(buffer.data(), buffer.data() + buffer.size(),
+                                   static_cast<uint64_t>(max<int64_t>(delay.count(), 0)));
+    field("retry", {buffer.data(), static_cast<size_t>(end - buffer.data())});
+    return *this;
+}
+
+SseEvent &SseEvent::data(string_view data)
+{
+    lines("data", data);
+    return *this;
+}
+
+SseEvent &SseEvent::comment(string_view text)
+{
+    lines({}, text);
+    return *this;
+}
+
+string_view SseEvent::chunk()
+{
+    finish();
+    return buffer_;
+}
+
+string_view SseEvent::str()
+{
+    finish();
+    return string_view{buffer_}.substr(header_size, buffer_.size() - header_size - 2);
+}
+
+string SseEvent::takeChunk()
+{
+    finish();
+    auto chunk = std::move(buffer_);
+    clear();
+    return chunk;
+}
+
+void SseEvent::clear() noexcept
+{
+    // Does not release the memory
+    buffer_.assign(header_size, '0');
+    finished_ = false;
+}
+
+void SseEvent::field(string_view name, string_view value)
+{
+    reopen();
+    buffer_ += name;
+    buffer_ += ": ";
+    buffer_ += value;
+    buffer_ += '\n';
+}
+
+void SseEvent::lines(string_view name, string_view text)
+{
+    // Split on "\r\n", "\n" and "\r"
+    while(true) {
+        const auto eol = text.find_first_of("\r\n");
+        field(name, text.substr(0, eol));
+        if (eol == string_view::npos) {
+            return;
+        }
+        // A line break at the end is followed by an empty line
+        const auto skip = text[eol] == '\r' && eol + 1 < text.size() && text[eol + 1] == '\n' ? 2 : 1;
+        text.remove_prefix(eol + skip);
+    }
+}
+
+void SseEvent::reopen() noexcept
+{
+    if (finished_) {
+        buffer_.resize(buffer_.size() - trailer.size());
+        finished_ = false;
+    }
+}
+
+void SseEvent::finish()
+{
+    if (finished_) {
+        return;
+    }
+
+    buffer_ += trailer;
+    finished_ = true;
+
+    // The chunk size is the event, without the header and the final CRLF
+    const auto size = buffer_.size() - header_size - 2;
+    static constexpr string_view digits = "0123456789abcdef";
+    for(int i = 7; i >= 0; --i) {
+        buffer_[i] = digits[(size >> ((7 - i) * 4)) & 0xf];
+    }
+    buffer_[8] = '\r';
+    buffer_[9] = '\n';
+}
+
+} // ns
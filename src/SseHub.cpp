@@ -0,0 +1,602 @@
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <charconv>
+#include <thread>
+
+#include "yahat/SseHub.h"
+#include "yahat/logging.h"
+
+using namespace std;
+
+namespace yahat {
+
+SseHub::Subscriber::Subscriber(std::string topic)
+    : topic_{std::move(topic)}
+{
+}
+
+SseHub::Subscriber::Subscriber(std::string topic, QueueOptions queue)
+    : topic_{std::move(topic)}, options_{queue}
+{
+}
+
+SseHub::Subscriber::~Subscriber()
+{
+    clear();
+}
+
+void SseHub::Subscriber::push(buffer_t event)
+{
+    {
+        lock_guard lock{mutex_};
+        if (closed_ || ended_) {
+            return;
+        }
+
+        if (options_.max_size && queue_.size() >= options_.max_size) {
+#ifdef YAHAT_ENABLE_METRICS
+            const auto dropped = options_.overflow == Overflow::DROP_OLDEST ? 1 : queue_.size();
+#endif
+            switch(options_.overflow) {
+            case Overflow::DROP_OLDEST:
+                queue_.pop_front();
+#ifdef YAHAT_ENABLE_METRICS
+                if (options_.queued) {
+                    options_.queued->dec();
+                }
+#endif
+                break;
+            case Overflow::COALESCE:
+                clear();
+                break;
+            case Overflow::DISCONNECT:
+                LOG_DEBUG << "SseHub - closing the stream for a slow subscriber to '" << topic_ << '\'';
+                closed_ = true;
+                clear();
+#ifdef YAHAT_ENABLE_METRICS
+                if (options_.disconnected) {
+                    options_.disconnected->inc();
+                }
+#endif
+                break;
+            }
+#ifdef YAHAT_ENABLE_METRICS
+            if (options_.dropped) {
+                options_.dropped->inc(dropped);
+            }
+#endif
+        }
+
+        if (!closed_) {
+            queue_.emplace_back(std::move(event));
+#ifdef YAHAT_ENABLE_METRICS
+            if (options_.queued) {
+                options_.queued->inc();
+            }
+#endif
+        }
+    }
+    signal_.notify();
+}
+
+void SseHub::Subscriber::take(std::vector<buffer_t> &events)
+{
+    events.clear();
+    lock_guard lock{mutex_};
+    events.reserve(queue_.size());
+    std::move(queue_.begin(), queue_.end(), back_inserter(events));
+    clear();
+}
+
+void SseHub::Subscriber::close()
+{
+    {
+        lock_guard lock{mutex_};
+        closed_ = true;
+        clear();
+    }
+    signal_.notify();
+}
+
+void SseHub::Subscriber::clear()
+{
+#ifdef YAHAT_ENABLE_METRICS
+    if (options_.queued) {
+        options_.queued->dec(queue_.size());
+    }
+#endif
+    queue_.clear();
+}
+
+void SseHub::Subscriber::cancel()
+{
+    {
+        lock_guard lock{mutex_};
+        closed_ = true;
+        clear();
+
+        // Called with the lock held, so the session can't reset it while it runs
+        if (cancel_) {
+            cancel_();
+        }
+    }
+    signal_.notify();
+}
+
+void SseHub::Subscriber::setCancel(std::function<void ()> fn)
+{
+    lock_guard lock{mutex_};
+    cancel_ = std::move(fn);
+}
+
+bool SseHub::Subscriber::closed() const
+{
+    lock_guard lock{mutex_};
+    return closed_;
+}
+
+void SseHub::Subscriber::end()
+{
+    {
+        lock_guard lock{mutex_};
+        ended_ = true;
+    }
+    signal_.notify();
+}
+
+bool SseHub::Subscriber::ended() const
+{
+    lock_guard lock{mutex_};
+    return ended_;
+}
+
+size_t SseHub::Subscriber::pending() const
+{
+    lock_guard lock{mutex_};
+    return queue_.size();
+}
+
+class SseHub::HeartbeatShard : public std::enable_shared_from_this<HeartbeatShard> {
+public:
+    using clock_t = TimerWheel::clock_t;
+
+    HeartbeatShard(boost::asio::io_context& ctx, clock_t::duration interval)
+        : interval_{interval}
+        , wheel_{clamp<clock_t::duration>(interval / 16, chrono::milliseconds{10}, chrono::seconds{1})}
+        , timer_{ctx}
+    {
+    }
+
+    void add(weak_ptr<Subscriber> subscriber, clock_t::duration delay) {
+        lock_guard lock{mutex_};
+        wheel_.add(delay, [this, subscriber=std::move(subscriber)] {
+            beat(subscriber);
+        });
+
+        if (!running_) {
+            running_ = true;
+            arm();
+        }
+    }
+
+    void stop() {
+        lock_guard lock{mutex_};
+        timer_.cancel();
+    }
+
+private:
+    // Must be called with the lock held
+    void arm() {
+        timer_.expires_after(wheel_.resolution());
+        timer_.async_wait([weak=weak_from_this()](boost::system::error_code ec) {
+            if (ec) {
+                return;
+            }
+            if (auto self = weak.lock()) {
+                self->tick();
+            }
+        });
+    }
+
+    void tick() {
+        vector<TimerWheel::callback_t> expired;
+        {
+            lock_guard lock{mutex_};
+            wheel_.advance(clock_t::now(), expired);
+
+            // Stop ticking when there are no streams
+            running_ = !wheel_.empty();
+            if (running_) {
+                arm();
+            }
+        }
+
+        // The callbacks add new timers, so they are called without the lock
+        for(auto& cb : expired) {
+            cb();
+        }
+    }
+
+    void beat(const weak_ptr<Subscriber>& weak) {
+        auto subscriber = weak.lock();
+        if (!subscriber || subscriber->closed()) {
+            return;
+        }
+
+        const auto idle = clock_t::now() - subscriber->lastWrite();
+        if (idle >= interval_ * 3) {
+            LOG_DEBUG << "SseHub - closing dead stream for topic '" << subscriber->topic()
+                      << "'. Nothing written for " << chrono::duration_cast<chrono::milliseconds>(idle).count() << " ms.";
+            subscriber->cancel();
+            return;
+        }
+
+        auto next = interval_ - idle;
+        if (idle + wheel_.resolution() >= interval_) {
+            // Don't queue a heartbeat behind events that are not written yet
+            if (!subscriber->pending()) {
+                subscriber->push(SseHub::heartbeat());
+            }
+            next = interval_;
+        }
+
+        add(weak, next);
+    }
+
+    const clock_t::duration interval_;
+    mutex mutex_;
+    TimerWheel wheel_;
+    boost::asio::steady_timer timer_;
+    bool running_ = false;
+};
+
+bool SseStream::send(string_view sseEvent) const
+{
+    assert(impl_);
+    if (!isOpen()) {
+        return false;
+    }
+    impl_->subscriber->push(SseHub::encode(sseEvent));
+    return true;
+}
+
+bool SseStream::send(SseEvent &event) const
+{
+    assert(impl_);
+    if (!isOpen()) {
+        return false;
+    }
+    impl_->subscriber->push(make_shared<const string>(event.takeChunk()));
+    return true;
+}
+
+void SseStream::close() const
+{
+    assert(impl_);
+    impl_->subscriber->end();
+}
+
+bool SseStream::isOpen() const
+{
+    return impl_ && !impl_->subscriber->closed() && !impl_->subscriber->ended();
+}
+
+#ifdef YAHAT_ENABLE_METRICS
+SseHub::SseHub(boost::asio::io_context& ctx, Config config, Metrics *metrics)
+#else
+SseHub::SseHub(boost::asio::io_context& ctx, Config config)
+#endif
+    : ctx_{ctx}, config_{std::move(config)}
+{
+#ifdef YAHAT_ENABLE_METRICS
+    if (metrics) {
+        const Metrics::labels_t labels{{"hub", config_.name}};
+        subscribers_ = metrics->AddGauge("yahat_sse_subscribers", "Current SSE subscribers", {}, labels);
+        published_ = metrics->AddCounter("yahat_sse_published", "Events published to the SSE hub", {}, labels);
+        replayed_ = metrics->AddCounter("yahat_sse_replayed", "Events replayed to reconnecting SSE subscribers", {}, labels);
+        resets_ = metrics->AddCounter("yahat_sse_resets", "Reconnecting SSE subscribers that missed too many events", {}, labels);
+        queue_options_.queued = metrics->AddGauge("yahat_sse_queued", "Events queued for SSE subscribers", {}, labels);
+        queue_options_.dropped = metrics->AddCounter("yahat_sse_dropped", "Events dropped for slow SSE subscribers", {}, labels);
+        queue_options_.disconnected = metrics->AddCounter("yahat_sse_slow_disconnects", "Slow SSE subscribers that were disconnected", {}, labels);
+    }
+#endif
+    queue_options_.max_size = config_.max_queue;
+    queue_options_.overflow = config_.overflow;
+
+    auto lanes = config_.fanout_lanes;
+    if (!lanes) {
+        lanes = max<size_t>(thread::hardware_concurrency(), 1);
+    }
+    strands_.reserve(lanes);
+    for(size_t i = 0; i < lanes; ++i) {
+        strands_.emplace_back(boost::asio::make_strand(ctx_));
+    }
+
+    if (config_.heartbeat_interval.count() > 0) {
+        auto shards = config_.heartbeat_shards;
+        if (!shards) {
+            shards = max<size_t>(thread::hardware_concurrency(), 1);
+        }
+        heartbeats_.reserve(shards);
+        for(size_t i = 0; i < shards; ++i) {
+            heartbeats_.emplace_back(make_shared<HeartbeatShard>(ctx_, config_.heartbeat_interval));
+        }
+    }
+}
+
+SseHub::~SseHub()
+{
+    for(auto& shard : heartbeats_) {
+        shard->stop();
+    }
+}
+
+void SseHub::publish(string_view topic, string_view event)
+{
+#ifdef YAHAT_ENABLE_METRICS
+    if (published_) {
+        published_->inc();
+    }
+#endif
+
+    if (!config_.replay_size) {
+        const auto buffer = encode(event);
+        shared_lock lock{mutex_};
+        if (auto it = topics_.find(string{topic}); it != topics_.end()) {
+            fanOut(it->second, buffer);
+        }
+        return;
+    }
+
+    // The topic is kept for a while without subscribers, so that clients
+    // that reconnect can get the events they missed.
+    const auto now = clock_t::now();
+    unique_lock lock{mutex_};
+    removeIdleTopics(now);
+    auto& t = topics_.try_emplace(string{topic}, strands_.size()).first->second;
+    t.last_used = now;
+    if (t.ring.empty()) {
+        t.ring.resize(config_.replay_size);
+    }
+
+    const auto id = ++t.last_id;
+    auto buffer = encode(event, id);
+    t.ring[id % t.ring.size()] = buffer;
+    fanOut(t, buffer);
+}
+
+const SseHub::buffer_t& SseHub::heartbeat()
+{
+    static const auto buffer = encode(":\n\n");
+    return buffer;
+}
+
+SseHub::buffer_t SseHub::encode(string_view event, uint64_t id)
+{
+    static constexpr string_view id_field = "id: ";
+
+    array<char, 20> id_buffer;
+    auto id_end = id_buffer.data();
+    if (id) {
+        id_end = to_chars(id_buffer.data(), id_buffer.data() + id_buffer.size(), id).ptr;
+    }
+    const auto id_len = id ? id_field.size() + (id_end - id_buffer.data()) + 1 : 0;
+
+    array<char, 16> size;
+    const auto [end, _] = to_chars(size.data(), size.data() + size.size(), event.size() + id_len, 16);
+
+    string chunk;
+    chunk.reserve(event.size() + id_len + (end - size.data()) + 4);
+    chunk.append(size.data(), end);
+    chunk += "\r\n";
+    if (id) {
+        chunk += id_field;
+        chunk.append(id_buffer.data(), id_end);
+        chunk += '\n';
+    }
+    chunk += event;
+    chunk += "\r\n";
+    return make_shared<const string>(std::move(chunk));
+}
+
+string SseHub::topicFor(const Request &req) const
+{
+    if (config_.topic) {
+        return config_.topic(req);
+    }
+
+    auto topic = string_view{req.target};
+    if (topic.starts_with(req.route)) {
+        topic.remove_prefix(req.route.size());
+    }
+    while(!topic.empty() && topic.front() == '/') {
+        topic.remove_prefix(1);
+    }
+    return string{topic};
+}
+
+std::shared_ptr<SseHub::Subscriber> SseHub::subscribe(std::string topic, optional<uint64_t> lastEventId)
+{
+    auto subscriber = make_shared<Subscriber>(topic, queue_options_);
+    {
+        unique_lock lock{mutex_};
+        auto& t = topics_.try_emplace(std::move(topic), strands_.size()).first->second;
+
+        // Fill up a batch in a lane before the next lane is used
+        const auto batch_size = max<size_t>(config_.fanout_batch_size, 1);
+        auto& lane = t.lanes[(t.size() / batch_size) % t.lanes.size()];
+        lane.subscribers.emplace_back(subscriber);
+        lane.snapshot.reset();
+
+        // Replay under the lock, so no events are missed or sent twice
+        if (lastEventId && config_.replay_size) {
+            replay(t, *subscriber, *lastEventId);
+        }
+    }
+
+    addHeartbeat(subscriber);
+
+#ifdef YAHAT_ENABLE_METRICS
+    if (subscribers_) {
+        subscribers_->inc();
+    }
+#endif
+    LOG_TRACE << "SseHub " << config_.name << " - new subscriber to topic '" << subscriber->topic() << '\'';
+    return subscriber;
+}
+
+void SseHub::unsubscribe(const std::shared_ptr<Subscriber> &subscriber)
+{
+    unique_lock lock{mutex_};
+    if (auto it = topics_.find(subscriber->topic()); it != topics_.end()) {
+        for(auto& lane : it->second.lanes) {
+            auto& subs = lane.subscribers;
+            if (auto sit = find(subs.begin(), subs.end(), subscriber); sit != subs.end()) {
+                // The order of the subscribers in a lane is not important
+                swap(*sit, subs.back());
+                subs.pop_back();
+                lane.snapshot.reset();
+#ifdef YAHAT_ENABLE_METRICS
+                if (subscribers_) {
+                    subscribers_->dec();
+                }
+#endif
+                break;
+            }
+        }
+
+        // Topics without events have nothing to replay
+        const auto empty = it->second.size() == 0;
+        if (empty && (!config_.replay_size || !it->second.last_id)) {
+            topics_.erase(it);
+        } else if (empty) {
+            it->second.last_used = clock_t::now();
+        }
+    }
+}
+
+std::shared_ptr<SseHub::Subscriber> SseHub::createStream()
+{
+    auto subscriber = make_shared<Subscriber>(string{}, queue_options_);
+    addHeartbeat(subscriber);
+    return subscriber;
+}
+
+void SseHub::addHeartbeat(const std::shared_ptr<Subscriber> &subscriber)
+{
+    if (!heartbeats_.empty()) {
+        const auto shard = next_shard_.fetch_add(1, memory_order_relaxed) % heartbeats_.size();
+        heartbeats_[shard]->add(subscriber, config_.heartbeat_interval);
+    }
+}
+
+size_t SseHub::topics() const
+{
+    shared_lock lock{mutex_};
+    return topics_.size();
+}
+
+void SseHub::removeIdleTopics(clock_t::time_point now)
+{
+    // Scan the topics a few times for each ttl
+    if (config_.topic_ttl.count() <= 0 || now - last_sweep_ < config_.topic_ttl / 4) {
+        return;
+    }
+    last_sweep_ = now;
+
+    const auto removed = erase_if(topics_, [&](const auto& v) {
+        return v.second.size() == 0 && now - v.second.last_used >= config_.topic_ttl;
+    });
+
+    if (removed) {
+        LOG_TRACE << "SseHub " << config_.name << " - removed " << removed << " idle topics";
+    }
+}
+
+size_t SseHub::subscribers(string_view topic) const
+{
+    shared_lock lock{mutex_};
+    if (auto it = topics_.find(string{topic}); it != topics_.end()) {
+        return it->second.size();
+    }
+    return 0;
+}
+
+size_t SseHub::Topic::size() const noexcept
+{
+    size_t count = 0;
+    for(const auto& lane : lanes) {
+        count += lane.subscribers.size();
+    }
+    return count;
+}
+
+void SseHub::fanOut(Topic& topic, const buffer_t &event)
+{
+    // The batches for a lane run in order on the lanes strand, so each subscriber
+    // gets the events in the order they were published. The lanes run in parallel.
+    const auto batch_size = max<size_t>(config_.fanout_batch_size, 1);
+    for(size_t l = 0; l < topic.lanes.size(); ++l) {
+        auto& lane = topic.lanes[l];
+        if (lane.subscribers.empty()) {
+            continue;
+        }
+
+        shared_ptr<const subscribers_t> subscribers;
+        {
+            lock_guard lock{topic.snapshot_mutex};
+            if (!lane.snapshot) {
+                lane.snapshot = make_shared<const subscribers_t>(lane.subscribers);
+            }
+            subscribers = lane.snapshot;
+        }
+
+        for(size_t i = 0; i < subscribers->size(); i += batch_size) {
+            const auto last = min(i + batch_size, subscribers->size());
+            boost::asio::post(strands_[l], [subscribers, first=i, last, event] {
+                for(auto n = first; n < last; ++n) {
+                    (*subscribers)[n]->push(event);
+                }
+            });
+        }
+    }
+}
+
+void SseHub::replay(Topic &topic, Subscriber &subscriber, uint64_t lastEventId)
+{
+    if (lastEventId == topic.last_id) {
+        return; // Nothing missed
+    }
+
+    const auto size = topic.ring.size();
+    const auto oldest = topic.last_id >= size ? topic.last_id - size + 1 : 1;
+
+    // If the id is from the future, the client has ids from before the server was restarted.
+    // If the missed events don't fit in the subscribers queue, it's better to reset.
+    if (size && lastEventId < topic.last_id && lastEventId + 1 >= oldest
+        && (!config_.max_queue || topic.last_id - lastEventId <= config_.max_queue)) {
+        for(auto id = lastEventId + 1; id <= topic.last_id; ++id) {
+            subscriber.push(topic.ring[id % size]);
+        }
+#ifdef YAHAT_ENABLE_METRICS
+        if (replayed_) {
+            replayed_->inc(topic.last_id - lastEventId);
+        }
+#endif
+        return;
+    }
+
+    LOG_TRACE << "SseHub " << config_.name << " - subscriber to '" << subscriber.topic()
+              << "' has missed too many events. Sending reset.";
+
+    subscriber.push(encode(config_.reset_event, topic.last_id));
+#ifdef YAHAT_ENABLE_METRICS
+    if (resets_) {
+        resets_->inc();
+    }
+#endif
+}
+
+} // ns
@@ -0,0 +1,126 @@
+
+#include <algorithm>
+#include <cassert>
+
+#include "yahat/TimerWheel.h"
+
+using namespace std;
+
+namespace yahat {
+
+TimerWheel::TimerWheel(clock_t::duration resolution, clock_t::time_point now)
+    : resolution_{max<clock_t::duration>(resolution, chrono::milliseconds{1})}
+    , start_{now}
+{
+}
+
+TimerWheel::id_t TimerWheel::add(clock_t::duration delay, callback_t callback, clock_t::time_point now)
+{
+    assert(callback);
+
+    if (callbacks_.empty()) {
+        // The delay is from now, not from when the wheel was last advanced
+        skipTo(now);
+    }
+
+    // Round up, and never expire in the current tick, as it may already have been processed
+    const auto ticks = max<int64_t>((delay + resolution_ - clock_t::duration{1}) / resolution_, 1);
+
+    const auto id = ++next_id_;
+    callbacks_.emplace(id, std::move(callback));
+    insert({id, current_ + static_cast<uint64_t>(ticks)});
+    return id;
+}
+
+bool TimerWheel::cancel(id_t id)
+{
+    return callbacks_.erase(id) > 0;
+}
+
+void TimerWheel::advance(clock_t::time_point now, std::vector<callback_t> &expired)
+{
+    if (now < start_) {
+        return;
+    }
+
+    const auto target = static_cast<uint64_t>((now - start_) / resolution_);
+    while(current_ < target && !callbacks_.empty()) {
+        ++current_;
+
+        // Move timers from the higher levels down when the lower level wraps around
+        for(unsigned level = levels - 1; level > 0; --level) {
+            if ((current_ & ((uint64_t{1} << (slot_bits * level)) - 1)) == 0) {
+                cascade(level);
+            }
+        }
+
+        auto& slot = wheel_[0][current_ & (slots - 1)];
+        auto timers = std::move(slot);
+        slot.clear();
+        for(const auto& timer : timers) {
+            if (timer.expires > current_) {
+                insert(timer);
+                continue;
+            }
+
+            if (auto it = callbacks_.find(timer.id); it != callbacks_.end()) {
+                expired.emplace_back(std::move(it->second));
+                callbacks_.erase(it);
+            }
+        }
+    }
+
+    if (callbacks_.empty()) {
+        // Nothing to do until a timer is added. Skip ahead.
+        skipTo(now);
+    }
+}
+
+void TimerWheel::skipTo(clock_t::time_point now)
+{
+    // Must only be called when there are no active timers
+    assert(callbacks_.empty());
+
+    if (now > start_) {
+        current_ = max(current_, static_cast<uint64_t>((now - start_) / resolution_));
+    }
+
+    // Remove cancelled timers
+    for(auto& level : wheel_) {
+        for(auto& slot : level) {
+            slot.clear();
+        }
+    }
+}
+
+void TimerWheel::insert(Timer timer)
+{
+    const auto delta = timer.expires > current_ ? timer.expires - current_ : 0;
+
+    for(unsigned level = 0; level < levels; ++level) {
+        const auto shift = slot_bits * level;
+        if (delta < (slots << shift) || level == levels - 1) {
+            auto expires = timer.expires;
+            if (level == levels - 1 && delta >= (slots << shift)) {
+                // Too far into the future. Re-inserted when the last slot is reached.
+                expires = current_ + ((slots - 1) << shift);
+            }
+            wheel_[level][(expires >> shift) & (slots - 1)].emplace_back(timer);
+            return;
+        }
+    }
+}
+
+void TimerWheel::cascade(unsigned level)
+{
+    auto& slot = wheel_[level][(current_ >> (slot_bits * level)) & (slots - 1)];
+    auto timers = std::move(slot);
+    slot.clear();
+    for(const auto& timer : timers) {
+        if (callbacks_.contains(timer.id)) {
+            insert(timer);
+        }
+    }
+}
+
+} // ns
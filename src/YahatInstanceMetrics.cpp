@@ -55,6 +55,8 @@ YahatInstanceMetrics::YahatInstanceMetrics(Metrics * metricsInstace) {
     tcp_connections_ = metrics().AddCounter<uint64_t>("yahat_tcp_connections", "Number of TCP connections", {});
     current_sessions_ = metrics().AddGauge<uint64_t>("yahat_current_sessions", "Number of current sessions", {});
     worker_threads_ = metrics().AddGauge<uint64_t>("yahat_worker_threads", "Number of worker threads", {});
+    request_arena_allocations_ = metrics().AddCounter<uint64_t>("yahat_request_arena_allocations", "Allocations served from the per-request memory arenas, without using the heap", {});
+    request_arena_overflows_ = metrics().AddCounter<uint64_t>("yahat_request_arena_overflows", "Blocks allocated from the heap when a request arena was full", {});
 
     metrics().AddInfo("yahat_system", "Yahat information", {}, {
         {"version", YAHAT_VERSION},
@@ -0,0 +1,120 @@
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "yahat/ConcurrencyLimiter.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace std::chrono_literals;
+using namespace yahat;
+
+namespace {
+
+// Samples from a fully used limiter, so the limit may grow
+void addSamples(ConcurrencyLimiter& limiter, chrono::nanoseconds rtt, int count) {
+    for(auto i = 0; i < count; ++i) {
+        limiter.addSample(rtt, limiter.limit());
+    }
+}
+
+} // anon ns
+
+TEST(ConcurrencyLimiter, RejectsAtLimit) {
+    ConcurrencyLimiter::Config config;
+    config.initial_limit = 4;
+    config.min_limit = 1;
+    ConcurrencyLimiter limiter{config};
+
+    vector<ConcurrencyLimiter::Permit> permits;
+    for(auto i = 0; i < 4; ++i) {
+        auto permit = limiter.tryAcquire();
+        ASSERT_TRUE(permit);
+        permits.emplace_back(std::move(*permit));
+    }
+    EXPECT_EQ(limiter.inflight(), 4);
+    EXPECT_FALSE(limiter.tryAcquire());
+
+    // A permit that is given back makes room for a new request
+    permits.back().cancel();
+    EXPECT_EQ(limiter.inflight(), 3);
+    EXPECT_TRUE(limiter.tryAcquire());
+}
+
+TEST(ConcurrencyLimiter, ShrinksWhenLatencyIncreases) {
+    ConcurrencyLimiter::Config config;
+    config.initial_limit = 50;
+    ConcurrencyLimiter limiter{config};
+
+    addSamples(limiter, 10ms, 100);
+    const auto stable = limiter.limit();
+    EXPECT_GE(stable, 50);
+
+    addSamples(limiter, 100ms, 20);
+    const auto high = limiter.limit();
+    EXPECT_LT(high, stable / 2);
+    EXPECT_GE(high, config.min_limit);
+}
+
+TEST(ConcurrencyLimiter, RecoversWhenLatencyDrops) {
+    ConcurrencyLimiter::Config config;
+    config.initial_limit = 50;
+    ConcurrencyLimiter limiter{config};
+
+    addSamples(limiter, 10ms, 100);
+    addSamples(limiter, 100ms, 20);
+    const auto high = limiter.limit();
+
+    addSamples(limiter, 10ms, 50);
+    EXPECT_GT(limiter.limit(), high * 2);
+}
+
+TEST(ConcurrencyLimiter, KeepsLimitWhenUnused) {
+    ConcurrencyLimiter::Config config;
+    config.initial_limit = 50;
+    ConcurrencyLimiter limiter{config};
+
+    // Few requests in flight, so there is no reason to probe for more capacity
+    for(auto i = 0; i < 100; ++i) {
+        limiter.addSample(10ms, 2);
+    }
+    EXPECT_EQ(limiter.limit(), 50);
+}
+
+TEST(ConcurrencyLimiter, StaysWithinBounds) {
+    ConcurrencyLimiter::Config config;
+    config.initial_limit = 20;
+    config.min_limit = 10;
+    config.max_limit = 40;
+    ConcurrencyLimiter limiter{config};
+
+    addSamples(limiter, 10ms, 200);
+    EXPECT_EQ(limiter.limit(), 40);
+
+    addSamples(limiter, 1s, 40);
+    EXPECT_EQ(limiter.limit(), 10);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
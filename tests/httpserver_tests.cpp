@@ -0,0 +1,852 @@
+
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+
+#include <zlib.h>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include "gtest/gtest.h"
+
+#include "yahat/HttpServer.h"
+#include "yahat/ResponseCache.h"
+#include "yahat/SingleFlight.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace std::chrono_literals;
+using namespace yahat;
+
+namespace http = boost::beast::http;
+using tcp = boost::asio::ip::tcp;
+
+namespace {
+
+class Handler : public RequestHandler {
+public:
+    using fn_t = std::function<Response(const Request&)>;
+
+    Handler(fn_t fn)
+        : fn_{std::move(fn)} {}
+
+    Response onReqest(const Request& req) override {
+        return fn_(req);
+    }
+
+private:
+    fn_t fn_;
+};
+
+string gunzip(string_view data) {
+    z_stream zs{};
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+        throw runtime_error{"inflateInit2 failed"};
+    }
+
+    string out;
+    array<char, 4096> buffer;
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    int result = Z_OK;
+    while(result == Z_OK) {
+        zs.next_out = reinterpret_cast<Bytef *>(buffer.data());
+        zs.avail_out = buffer.size();
+        result = inflate(&zs, Z_NO_FLUSH);
+        out.append(buffer.data(), buffer.size() - zs.avail_out);
+    }
+    inflateEnd(&zs);
+
+    if (result != Z_STREAM_END) {
+        throw runtime_error{"inflate failed"};
+    }
+    return out;
+}
+
+string gzip(string_view data) {
+    z_stream zs{};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw runtime_error{"deflateInit2 failed"};
+    }
+
+    string out(deflateBound(&zs, data.size()), 0);
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    zs.next_out = reinterpret_cast<Bytef *>(out.data());
+    zs.avail_out = static_cast<uInt>(out.size());
+    const auto result = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+
+    if (result != Z_STREAM_END) {
+        throw runtime_error{"deflate failed"};
+    }
+    return out;
+}
+
+// Data that does not compress to almost nothing
+string makeData(size_t size, unsigned seed) {
+    string data;
+    data.reserve(size);
+    auto v = seed;
+    while(data.size() < size) {
+        v = v * 1103515245 + 12345;
+        data += static_cast<char>('a' + (v >> 16) % 26);
+    }
+    return data;
+}
+
+uint16_t freePort() {
+    boost::asio::io_context ctx;
+    tcp::acceptor acceptor{ctx, {boost::asio::ip::make_address("127.0.0.1"), 0}};
+    return acceptor.local_endpoint().port();
+}
+
+// A server on localhost, with routes for the tests
+class TestServer {
+public:
+    TestServer(std::function<void(HttpConfig&)> configure = {}, authenticator_t authenticator = {}) {
+        config_.http_endpoint = "127.0.0.1";
+        config_.http_port = to_string(freePort());
+        config_.num_http_threads = 2;
+#ifdef YAHAT_ENABLE_METRICS
+        config_.enable_metrics = false;
+#endif
+        if (configure) {
+            configure(config_);
+        }
+        if (!authenticator) {
+            authenticator = [](const AuthReq&) {
+                return Auth{};
+            };
+        }
+        server_.emplace(config_, std::move(authenticator));
+    }
+
+    ~TestServer() {
+        if (done_.valid()) {
+            server_->stop();
+        }
+    }
+
+    void add(string_view target, Handler::fn_t fn, RouteOptions options = {}, AuthPolicy auth = AuthPolicy::PUBLIC) {
+        options.auth = auth;
+        server_->addRoute(target, make_shared<Handler>(std::move(fn)), std::move(options));
+    }
+
+    HttpServer& server() {
+        return *server_;
+    }
+
+    void start() {
+        done_ = server_->start();
+    }
+
+    uint16_t port() const {
+        return static_cast<uint16_t>(stoi(config_.http_port));
+    }
+
+private:
+    HttpConfig config_;
+    optional<HttpServer> server_;
+    future<void> done_;
+};
+
+// A client connection to the test server
+class Client {
+public:
+    using request_t = http::request<http::string_body>;
+    using response_t = http::response<http::string_body>;
+
+    Client(uint16_t port) {
+        // The server may not be listening yet
+        const tcp::endpoint ep{boost::asio::ip::make_address("127.0.0.1"), port};
+        for(auto i = 0;; ++i) {
+            boost::system::error_code ec;
+            socket_.connect(ep, ec);
+            if (!ec) {
+                break;
+            }
+            if (i == 100) {
+                throw runtime_error{"Failed to connect to the test server: "s + ec.message()};
+            }
+            socket_.close();
+            this_thread::sleep_for(20ms);
+        }
+    }
+
+    response_t send(request_t req) {
+        req.set(http::field::host, "localhost");
+        req.prepare_payload();
+        http::write(socket_, req);
+
+        response_t res;
+        http::read(socket_, buffer_, res);
+        return res;
+    }
+
+    response_t get(string_view target, http::field field, string_view value) {
+        request_t req{http::verb::get, target, 11};
+        req.set(field, value);
+        return send(std::move(req));
+    }
+
+    response_t get(string_view target, bool gzip = false, unsigned version = 11) {
+        request_t req{http::verb::get, target, version};
+        if (gzip) {
+            req.set(http::field::accept_encoding, "gzip");
+        }
+        return send(std::move(req));
+    }
+
+    response_t post(string_view target, string body, bool gzipped = false) {
+        request_t req{http::verb::post, target, 11};
+        req.set(http::field::content_type, "application/json");
+        if (gzipped) {
+            req.set(http::field::content_encoding, "gzip");
+        }
+        req.body() = std::move(body);
+        return send(std::move(req));
+    }
+
+private:
+    boost::asio::io_context ctx_;
+    tcp::socket socket_{ctx_};
+    boost::beast::flat_buffer buffer_;
+};
+
+// Send the same GET request from several clients at the same time
+vector<Client::response_t> getConcurrently(uint16_t port, int clients, string_view target,
+                                           http::field field = http::field::unknown, string_view value = {}) {
+    vector<future<Client::response_t>> pending;
+    for(auto i = 0; i < clients; ++i) {
+        pending.emplace_back(async(launch::async, [=] {
+            Client client{port};
+            if (field != http::field::unknown) {
+                return client.get(target, field, value);
+            }
+            return client.get(target);
+        }));
+    }
+
+    vector<Client::response_t> replies;
+    for(auto& p : pending) {
+        replies.emplace_back(p.get());
+    }
+    return replies;
+}
+
+} // anon ns
+
+TEST(HttpServer, FragmentedBody) {
+    static constexpr string_view footer = "</html>";
+    const auto header = makeData(20000, 1);
+    const auto shared = make_shared<const string>(makeData(30000, 2));
+
+    TestServer server;
+    server.add("/fragments", [&](const Request&) {
+        Response r{200, "OK"};
+        r.mime_type = "text/html";
+        r.fragments.emplace_back(header);
+        r.fragments.emplace_back(shared);
+        r.fragments.emplace_back(string{});
+        r.fragments.emplace_back(span<const char>{footer.data(), footer.size()});
+        return r;
+    });
+    server.start();
+
+    const auto expected = header + *shared + string{footer};
+
+    Client client{server.port()};
+    auto res = client.get("/fragments");
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(res[http::field::content_encoding], "");
+    EXPECT_EQ(res.body(), expected);
+
+    res = client.get("/fragments", true);
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(res[http::field::content_encoding], "gzip");
+    EXPECT_LT(res.body().size(), expected.size());
+    EXPECT_EQ(gunzip(res.body()), expected);
+}
+
+TEST(HttpServer, EmptyFragments) {
+    TestServer server;
+    server.add("/empty", [](const Request&) {
+        Response r{200, "OK"};
+        r.fragments.emplace_back(string{});
+        r.fragments.emplace_back(string{});
+        return r;
+    });
+    server.start();
+
+    // Like an empty body, the reply is the status json
+    const auto expected = Response{200, "OK"}.responseStatusAsJson();
+
+    Client client{server.port()};
+    auto res = client.get("/empty");
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(res[http::field::content_type], Response::getMimeType());
+    EXPECT_EQ(res.body(), expected);
+
+    res = client.get("/empty", true);
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(res[http::field::content_encoding], "gzip");
+    EXPECT_EQ(gunzip(res.body()), expected);
+}
+
+TEST(HttpServer, EmptySharedBody) {
+    TestServer server;
+    server.add("/empty", [](const Request&) {
+        Response r{200, "OK"};
+        r.shared_body = make_shared<const string>();
+        return r;
+    });
+    server.start();
+
+    Client client{server.port()};
+    const auto res = client.get("/empty");
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(res[http::field::content_type], Response::getMimeType());
+    const auto expected = Response{200, "OK"}.responseStatusAsJson();
+    EXPECT_EQ(res.body(), expected);
+}
+
+TEST(HttpServer, RequestIdHeader) {
+    TestServer server;
+    server.add("/id", [](const Request&) {
+        return Response{200, "OK", "id"};
+    });
+    server.start();
+
+    Client client{server.port()};
+    auto res = client.get("/id");
+    EXPECT_EQ(res.result_int(), 200);
+    const auto generated = string{res["X-Request-ID"]};
+    EXPECT_EQ(generated.size(), 36);
+
+    // Each request has its own id
+    res = client.get("/id");
+    EXPECT_NE(res["X-Request-ID"], generated);
+
+    // The id from the client is used
+    Client::request_t req{http::verb::get, "/id", 11};
+    req.set("X-Request-ID", "client-id-1");
+    res = client.send(std::move(req));
+    EXPECT_EQ(res["X-Request-ID"], "client-id-1");
+}
+
+TEST(HttpServer, QueryArguments) {
+    TestServer server;
+    server.add("/args", [](const Request& req) {
+        EXPECT_EQ(req.target, "/args");
+        EXPECT_EQ(req.query, "a=1&b=x%26y&a=2&c=a+b%20c");
+        EXPECT_EQ(req.args().get("a"), "2");
+        EXPECT_EQ(req.args().get("b"), "x&y");
+        EXPECT_EQ(req.args().get("c"), "a b c");
+
+        // The deprecated accessors work like the old members
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+        const auto arguments = req.arguments();
+        EXPECT_EQ(arguments.size(), 3);
+        EXPECT_EQ(arguments.at("a"), "2");
+        EXPECT_EQ(arguments.at("b"), "x&y");
+        EXPECT_EQ(req.all_arguments(), "a=1&b=x&y&a=2&c=a+b c");
+#pragma GCC diagnostic pop
+        return Response{200, "OK", "args"};
+    });
+    server.start();
+
+    Client client{server.port()};
+    const auto res = client.get("/args?a=1&b=x%26y&a=2&c=a+b%20c");
+    EXPECT_EQ(res.result_int(), 200);
+}
+
+TEST(HttpServer, CoalescedCachedReply) {
+    const auto data = makeData(64 * 1024, 3);
+    atomic_int calls{0};
+
+    TestServer server;
+    RouteOptions options;
+    options.coalesce = true;
+    options.cache = make_shared<ResponseCache>(ResponseCache::Config{});
+    server.add("/data", [&](const Request&) {
+        ++calls;
+        // Keep the request in flight while the other clients arrive
+        this_thread::sleep_for(200ms);
+        return Response{200, "OK", data};
+    }, options);
+    server.start();
+
+    vector<future<Client::response_t>> replies;
+    for(auto i = 0; i < 6; ++i) {
+        replies.emplace_back(async(launch::async, [&, gzip = i % 2 == 1] {
+            Client client{server.port()};
+            return client.get("/data", gzip);
+        }));
+    }
+
+    for(auto i = 0; i < 6; ++i) {
+        const auto res = replies[i].get();
+        EXPECT_EQ(res.result_int(), 200);
+        if (i % 2) {
+            EXPECT_EQ(res[http::field::content_encoding], "gzip");
+            EXPECT_EQ(gunzip(res.body()), data);
+        } else {
+            EXPECT_EQ(res.body(), data);
+        }
+    }
+
+    // One call prepared the reply for all the clients
+    EXPECT_EQ(calls, 1);
+}
+
+TEST(HttpServer, CoalescedRequests) {
+    atomic_int calls{0};
+
+    TestServer server;
+    RouteOptions options;
+    options.coalesce = true;
+    server.add("/data", [&](const Request& req) {
+        const auto call = ++calls;
+        this_thread::sleep_for(200ms);
+        return Response{200, "OK", req.query + "#" + to_string(call)};
+    }, options);
+    server.start();
+
+    // One invocation of the handler serves all the concurrent callers
+    for(const auto& res : getConcurrently(server.port(), 5, "/data?id=1")) {
+        EXPECT_EQ(res.result_int(), 200);
+        EXPECT_EQ(res.body(), "id=1#1");
+    }
+    EXPECT_EQ(calls, 1);
+
+    // Without a cache, the reply is not kept after the flight
+    Client client{server.port()};
+    auto res = client.get("/data?id=1");
+    EXPECT_EQ(res.body(), "id=1#2");
+
+    // Different query arguments are different requests
+    res = client.get("/data?id=2");
+    EXPECT_EQ(res.body(), "id=2#3");
+    EXPECT_EQ(calls, 3);
+}
+
+TEST(HttpServer, ETag) {
+    const auto data = makeData(8 * 1024, 5);
+    atomic_int calls{0};
+
+    TestServer server;
+    RouteOptions options;
+    options.etag = true;
+    server.add("/data", [&](const Request&) {
+        ++calls;
+        return Response{200, "OK", data};
+    }, options);
+    options.cache = make_shared<ResponseCache>(ResponseCache::Config{});
+    server.add("/cached", [&](const Request&) {
+        ++calls;
+        return Response{200, "OK", data};
+    }, options);
+    server.start();
+
+    Client client{server.port()};
+    for(const string_view target : {"/data", "/cached"}) {
+        SCOPED_TRACE(target);
+
+        auto res = client.get(target);
+        EXPECT_EQ(res.result_int(), 200);
+        EXPECT_EQ(res.body(), data);
+        const string etag{res[http::field::etag]};
+        ASSERT_FALSE(etag.empty());
+
+        // The same body gives the same etag
+        res = client.get(target, true);
+        EXPECT_EQ(res[http::field::etag], etag);
+        EXPECT_EQ(gunzip(res.body()), data);
+
+        const auto strong = etag.substr(etag.starts_with("W/") ? 2 : 0);
+        for(const string& value : {etag, strong, "\"other\", "s + etag, "*"s}) {
+            SCOPED_TRACE(value);
+            res = client.get(target, http::field::if_none_match, value);
+            EXPECT_EQ(res.result_int(), 304);
+            EXPECT_EQ(res[http::field::etag], etag);
+            EXPECT_TRUE(res.body().empty());
+        }
+
+        res = client.get(target, http::field::if_none_match, "\"other\"");
+        EXPECT_EQ(res.result_int(), 200);
+        EXPECT_EQ(res.body(), data);
+    }
+
+    // The cached route only called the handler once
+    EXPECT_EQ(calls, 7 + 1);
+}
+
+TEST(HttpServer, RequestHeaders) {
+    TestServer server;
+    server.add("/headers", [](const Request& req) {
+        EXPECT_NE(req.headers, nullptr);
+        EXPECT_EQ(req.header("X-Custom"), "first");
+        EXPECT_EQ(req.header("x-custom"), "first");
+        EXPECT_EQ(req.header("X-CUSTOM"), "first");
+        EXPECT_EQ(req.header(http::field::user_agent), "yahat-test");
+        EXPECT_EQ(req.header("user-agent"), "yahat-test");
+        EXPECT_TRUE(req.header("X-Missing").empty());
+        EXPECT_TRUE(req.header(http::field::cookie).empty());
+        return Response{200, "OK", string{req.header("x-custom")}};
+    });
+    server.start();
+
+    Client client{server.port()};
+    Client::request_t req{http::verb::get, "/headers", 11};
+    req.set("x-Custom", "first");
+    req.set(http::field::user_agent, "yahat-test");
+    const auto res = client.send(std::move(req));
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(res.body(), "first");
+}
+
+TEST(SingleFlight, FollowersShareTheResult) {
+    boost::asio::io_context ctx;
+    SingleFlight<string, int> flight;
+    int calls = 0;
+    vector<int> results;
+
+    for(auto i = 0; i < 4; ++i) {
+        boost::asio::spawn(ctx, [&](boost::asio::yield_context yield) {
+            results.push_back(flight.run("key", yield, [&] {
+                ++calls;
+                // Let the other coroutines arrive while this one is in flight
+                boost::asio::steady_timer timer{ctx, 50ms};
+                timer.async_wait(yield);
+                return 42;
+            }));
+        });
+    }
+    ctx.run();
+
+    EXPECT_EQ(calls, 1);
+    EXPECT_EQ(results, vector<int>(4, 42));
+    EXPECT_EQ(flight.size(), 0);
+
+    // The next call after the flight is done runs the function again
+    ctx.restart();
+    boost::asio::spawn(ctx, [&](boost::asio::yield_context yield) {
+        results.push_back(flight.run("key", yield, [&] {
+            return ++calls;
+        }));
+    });
+    ctx.run();
+    EXPECT_EQ(calls, 2);
+    EXPECT_EQ(results.back(), 2);
+}
+
+TEST(SingleFlight, FollowersGetTheException) {
+    boost::asio::io_context ctx;
+    SingleFlight<string, int> flight;
+    int calls = 0, errors = 0;
+
+    for(auto i = 0; i < 3; ++i) {
+        boost::asio::spawn(ctx, [&](boost::asio::yield_context yield) {
+            try {
+                flight.run("key", yield, [&]() -> int {
+                    ++calls;
+                    boost::asio::steady_timer timer{ctx, 50ms};
+                    timer.async_wait(yield);
+                    throw runtime_error{"failed"};
+                });
+            } catch(const runtime_error&) {
+                ++errors;
+            }
+        });
+    }
+    ctx.run();
+
+    EXPECT_EQ(calls, 1);
+    EXPECT_EQ(errors, 3);
+}
+
+TEST(HttpServer, AsyncAuthenticatorIsShared) {
+    atomic_int calls{0};
+
+    TestServer server;
+    server.server().setAuthenticator([&](const AuthReq& ar) -> boost::asio::awaitable<Auth> {
+        ++calls;
+        const auto access = ar.auth_header == "Bearer good";
+
+        // Like a call to a token introspection endpoint
+        boost::asio::steady_timer timer{co_await boost::asio::this_coro::executor, 200ms};
+        co_await timer.async_wait(boost::asio::use_awaitable);
+        co_return Auth{access ? "alice" : "", access};
+    });
+    server.add("/private", [](const Request& req) {
+        return Response{200, "OK", req.auth.account};
+    }, {}, AuthPolicy::REQUIRED);
+    server.start();
+
+    // Concurrent requests with the same credential share one call to the authenticator
+    for(const auto& res : getConcurrently(server.port(), 4, "/private", http::field::authorization, "Bearer good")) {
+        EXPECT_EQ(res.result_int(), 200);
+        EXPECT_EQ(res.body(), "alice");
+    }
+    EXPECT_EQ(calls, 1);
+
+    // The result is not kept after the flight
+    Client client{server.port()};
+    auto res = client.get("/private", http::field::authorization, "Bearer good");
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(calls, 2);
+
+    // Denied access is shared too
+    for(const auto& res : getConcurrently(server.port(), 3, "/private", http::field::authorization, "Bearer bad")) {
+        EXPECT_EQ(res.result_int(), 401);
+    }
+    EXPECT_EQ(calls, 3);
+
+    // Requests without credentials are not shared
+    for(const auto& res : getConcurrently(server.port(), 2, "/private")) {
+        EXPECT_EQ(res.result_int(), 401);
+    }
+    EXPECT_EQ(calls, 5);
+}
+
+TEST(HttpServer, AuthPolicies) {
+    atomic_int calls{0};
+
+    TestServer server{{}, [&](const AuthReq& ar) {
+        ++calls;
+        if (ar.auth_header == "Bearer good") {
+            return Auth{"alice", true};
+        }
+        return Auth{};
+    }};
+
+    auto handler = [](const Request& req) {
+        return Response{200, "OK", req.auth.access ? req.auth.account : "anonymous"};
+    };
+    server.add("/public", handler, {}, AuthPolicy::PUBLIC);
+    server.add("/optional", handler, {}, AuthPolicy::OPTIONAL);
+    server.add("/required", handler, {}, AuthPolicy::REQUIRED);
+    server.start();
+
+    struct Case {
+        string_view target;
+        string_view token;
+        unsigned status;
+        string_view body;
+    };
+
+    const Case cases[] = {
+        {"/public",   "",            200, "anonymous"},
+        {"/public",   "Bearer bad",  200, "anonymous"},
+        {"/public",   "Bearer good", 200, "anonymous"},
+        {"/optional", "",            200, "anonymous"},
+        {"/optional", "Bearer bad",  200, "anonymous"},
+        {"/optional", "Bearer good", 200, "alice"},
+        {"/required", "",            401, ""},
+        {"/required", "Bearer bad",  401, ""},
+        {"/required", "Bearer good", 200, "alice"},
+    };
+
+    Client client{server.port()};
+    for(const auto& c : cases) {
+        SCOPED_TRACE(string{c.target} + " with '" + string{c.token} + "'");
+        auto res = c.token.empty()
+            ? client.get(c.target)
+            : client.get(c.target, http::field::authorization, c.token);
+        EXPECT_EQ(res.result_int(), c.status);
+        if (c.status == 200) {
+            EXPECT_EQ(res.body(), c.body);
+        }
+    }
+
+    // The authenticator is never called for public routes
+    EXPECT_EQ(calls, 6);
+}
+
+TEST(HttpServer, PriorityDispatch) {
+    mutex mtx;
+    map<string, thread::id> threads;
+    auto record = [&](const string& name) {
+        lock_guard lock{mtx};
+        threads[name] = this_thread::get_id();
+    };
+
+    TestServer server{[](HttpConfig& config) {
+        config.num_handler_threads = 1;
+    }};
+
+    RouteOptions high;
+    high.priority = Priority::HIGH;
+    server.add("/slow", [&](const Request&) {
+        record("slow");
+        this_thread::sleep_for(500ms);
+        return Response{200, "OK", "slow"};
+    });
+    server.add("/normal", [&](const Request&) {
+        record("normal");
+        return Response{200, "OK", "normal"};
+    });
+    server.add("/high", [&](const Request&) {
+        record("high");
+        return Response{200, "OK", "high"};
+    }, high);
+    server.start();
+
+    auto slow = async(launch::async, [port = server.port()] {
+        Client client{port};
+        return client.get("/slow");
+    });
+    this_thread::sleep_for(100ms);
+
+    // The only handler thread is busy, but high priority requests run on the HTTP threads
+    Client client{server.port()};
+    const auto start = chrono::steady_clock::now();
+    auto res = client.get("/high");
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_LT(chrono::steady_clock::now() - start, 300ms);
+
+    EXPECT_EQ(slow.get().body(), "slow");
+    res = client.get("/normal");
+    EXPECT_EQ(res.result_int(), 200);
+
+    lock_guard lock{mtx};
+    ASSERT_EQ(threads.size(), 3);
+    EXPECT_EQ(threads["slow"], threads["normal"]);
+    EXPECT_NE(threads["slow"], threads["high"]);
+}
+
+#ifdef USING_BOOST_JSON
+namespace {
+
+boost::json::value makeJson(int items) {
+    boost::json::array list;
+    for(auto i = 0; i < items; ++i) {
+        list.emplace_back(boost::json::object{{"id", i}, {"name", makeData(32, i)}});
+    }
+    return list;
+}
+
+} // anon ns
+
+TEST(HttpServer, JsonBody) {
+    // Larger than the chunks it's serialized in
+    const auto json = makeJson(1000);
+    ASSERT_GT(boost::json::serialize(json).size(), 16 * 1024);
+
+    TestServer server;
+    server.add("/json", [&](const Request&) {
+        Response r{200, "OK"};
+        r.json = json;
+        return r;
+    });
+    server.start();
+
+    Client client{server.port()};
+    auto res = client.get("/json");
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_TRUE(res.chunked());
+    EXPECT_EQ(res[http::field::content_type], Response::getMimeType());
+    EXPECT_EQ(boost::json::parse(res.body()), json);
+
+    res = client.get("/json", true);
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_TRUE(res.chunked());
+    EXPECT_EQ(res[http::field::content_encoding], "gzip");
+    EXPECT_EQ(boost::json::parse(gunzip(res.body())), json);
+}
+
+TEST(HttpServer, ParseJson) {
+    TestServer server;
+    RouteOptions options;
+    options.parse_json = true;
+    server.add("/json", [](const Request& req) {
+        EXPECT_TRUE(req.body.empty());
+        if (!req.json) {
+            return Response{200, "OK", "none"};
+        }
+        return Response{200, "OK", boost::json::serialize(*req.json)};
+    }, options);
+    server.start();
+
+    const auto json = makeJson(1000);
+    const auto text = boost::json::serialize(json);
+
+    Client client{server.port()};
+    auto res = client.post("/json", text);
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(boost::json::parse(res.body()), json);
+
+    // Invalid json gets a 400 reply, and the connection can still be used
+    res = client.post("/json", "{\"a\": [1, 2");
+    EXPECT_EQ(res.result_int(), 400);
+    EXPECT_TRUE(res.keep_alive());
+
+    res = client.post("/json", gzip(text), true);
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(boost::json::parse(res.body()), json);
+
+    res = client.post("/json", gzip("{\"a\""), true);
+    EXPECT_EQ(res.result_int(), 400);
+
+    // Without a body, there is no value
+    res = client.post("/json", {});
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_EQ(res.body(), "none");
+}
+
+TEST(HttpServer, JsonBodyHttp10) {
+    const auto json = makeJson(1000);
+
+    TestServer server;
+    server.add("/json", [&](const Request&) {
+        Response r{200, "OK"};
+        r.json = json;
+        return r;
+    });
+    server.start();
+
+    // HTTP/1.0 has no chunked transfer-encoding
+    Client client{server.port()};
+    auto res = client.get("/json", false, 10);
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_FALSE(res.chunked());
+    EXPECT_EQ(res[http::field::content_length], to_string(res.body().size()));
+    EXPECT_EQ(boost::json::parse(res.body()), json);
+
+    Client gzip_client{server.port()};
+    res = gzip_client.get("/json", true, 10);
+    EXPECT_EQ(res.result_int(), 200);
+    EXPECT_FALSE(res.chunked());
+    EXPECT_EQ(res[http::field::content_encoding], "gzip");
+    EXPECT_EQ(boost::json::parse(gunzip(res.body())), json);
+}
+#endif
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,372 @@
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <limits>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rsa.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#   include <openssl/core_names.h>
+#endif
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "yahat/JwtAuthenticator.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace std::chrono_literals;
+using namespace yahat;
+
+#ifdef USING_BOOST_JSON
+
+namespace {
+
+string base64UrlEncode(string_view in) {
+    static constexpr string_view chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    string out;
+    uint32_t acc = 0;
+    int bits = 0;
+    for(const auto ch : in) {
+        acc = (acc << 8) | static_cast<uint8_t>(ch);
+        bits += 8;
+        while(bits >= 6) {
+            bits -= 6;
+            out.push_back(chars[(acc >> bits) & 0x3f]);
+        }
+    }
+    if (bits > 0) {
+        out.push_back(chars[(acc << (6 - bits)) & 0x3f]);
+    }
+    return out;
+}
+
+const string secret = "very-secret-key-for-unit-tests!!";
+
+string makeHs256Token(const boost::json::object& claims, string_view kid = "k1") {
+    boost::json::object header{{"alg", "HS256"}, {"typ", "JWT"}};
+    if (!kid.empty()) {
+        header["kid"] = kid;
+    }
+
+    auto token = base64UrlEncode(boost::json::serialize(header)) + "."
+                 + base64UrlEncode(boost::json::serialize(claims));
+
+    array<unsigned char, EVP_MAX_MD_SIZE> md{};
+    unsigned int len = 0;
+    HMAC(EVP_sha256(), secret.data(), secret.size(),
+         reinterpret_cast<const unsigned char *>(token.data()), token.size(), md.data(), &len);
+
+    return token + "." + base64UrlEncode({reinterpret_cast<const char *>(md.data()), len});
+}
+
+using pkey_ptr_t = unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
+
+pkey_ptr_t generateKey(int type) {
+    unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx{EVP_PKEY_CTX_new_id(type, nullptr), EVP_PKEY_CTX_free};
+    EVP_PKEY *pkey = {};
+    if (!ctx || EVP_PKEY_keygen_init(ctx.get()) != 1
+        || (type == EVP_PKEY_RSA && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx.get(), 2048) != 1)
+        || (type == EVP_PKEY_EC && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1) != 1)
+        || EVP_PKEY_keygen(ctx.get(), &pkey) != 1) {
+        throw runtime_error{"Failed to generate key"};
+    }
+    return {pkey, EVP_PKEY_free};
+}
+
+string toBin(const BIGNUM *bn, int len = 0) {
+    string bin(static_cast<size_t>(len ? len : BN_num_bytes(bn)), '\0');
+    BN_bn2binpad(bn, reinterpret_cast<unsigned char *>(bin.data()), static_cast<int>(bin.size()));
+    return bin;
+}
+
+// Public key as a JWK
+string toJwk(EVP_PKEY *key, string_view kid) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    auto param = [key](const char *name) {
+        BIGNUM *bn = {};
+        EVP_PKEY_get_bn_param(key, name, &bn);
+        unique_ptr<BIGNUM, decltype(&BN_free)> owned{bn, BN_free};
+        return owned;
+    };
+
+    if (EVP_PKEY_base_id(key) == EVP_PKEY_RSA) {
+        return R"({"kty":"RSA","kid":")" + string{kid} + R"(","n":")" + base64UrlEncode(toBin(param(OSSL_PKEY_PARAM_RSA_N).get()))
+               + R"(","e":")" + base64UrlEncode(toBin(param(OSSL_PKEY_PARAM_RSA_E).get())) + R"("})";
+    }
+
+    return R"({"kty":"EC","crv":"P-256","kid":")" + string{kid} + R"(","x":")" + base64UrlEncode(toBin(param(OSSL_PKEY_PARAM_EC_PUB_X).get(), 32))
+           + R"(","y":")" + base64UrlEncode(toBin(param(OSSL_PKEY_PARAM_EC_PUB_Y).get(), 32)) + R"("})";
+#else
+    if (EVP_PKEY_base_id(key) == EVP_PKEY_RSA) {
+        const BIGNUM *n = {}, *e = {};
+        RSA_get0_key(EVP_PKEY_get0_RSA(key), &n, &e, nullptr);
+        return R"({"kty":"RSA","kid":")" + string{kid} + R"(","n":")" + base64UrlEncode(toBin(n))
+               + R"(","e":")" + base64UrlEncode(toBin(e)) + R"("})";
+    }
+
+    const auto *ec = EVP_PKEY_get0_EC_KEY(key);
+    unique_ptr<BIGNUM, decltype(&BN_free)> x{BN_new(), BN_free}, y{BN_new(), BN_free};
+    EC_POINT_get_affine_coordinates(EC_KEY_get0_group(ec), EC_KEY_get0_public_key(ec), x.get(), y.get(), nullptr);
+    return R"({"kty":"EC","crv":"P-256","kid":")" + string{kid} + R"(","x":")" + base64UrlEncode(toBin(x.get(), 32))
+           + R"(","y":")" + base64UrlEncode(toBin(y.get(), 32)) + R"("})";
+#endif
+}
+
+// RS256 or ES256 token, depending on the type of the key
+string makeToken(EVP_PKEY *key, const boost::json::object& claims, string_view kid) {
+    const bool rsa = EVP_PKEY_base_id(key) == EVP_PKEY_RSA;
+    boost::json::object header{{"alg", rsa ? "RS256" : "ES256"}, {"typ", "JWT"}, {"kid", kid}};
+    auto token = base64UrlEncode(boost::json::serialize(header)) + "."
+                 + base64UrlEncode(boost::json::serialize(claims));
+
+    unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx{EVP_MD_CTX_new(), EVP_MD_CTX_free};
+    size_t len = 0;
+    if (!ctx || EVP_DigestSignInit(ctx.get(), nullptr, EVP_sha256(), nullptr, key) != 1
+        || EVP_DigestSign(ctx.get(), nullptr, &len, reinterpret_cast<const unsigned char *>(token.data()), token.size()) != 1) {
+        throw runtime_error{"Failed to sign"};
+    }
+    string signature(len, '\0');
+    auto *sig = reinterpret_cast<unsigned char *>(signature.data());
+    if (EVP_DigestSign(ctx.get(), sig, &len, reinterpret_cast<const unsigned char *>(token.data()), token.size()) != 1) {
+        throw runtime_error{"Failed to sign"};
+    }
+    signature.resize(len);
+
+    if (!rsa) {
+        // DER to the raw R|S format used by JWS
+        const auto *p = reinterpret_cast<const unsigned char *>(signature.data());
+        unique_ptr<ECDSA_SIG, decltype(&ECDSA_SIG_free)> ecdsa{d2i_ECDSA_SIG(nullptr, &p, static_cast<long>(signature.size())), ECDSA_SIG_free};
+        if (!ecdsa) {
+            throw runtime_error{"Failed to decode signature"};
+        }
+        const BIGNUM *r = {}, *s = {};
+        ECDSA_SIG_get0(ecdsa.get(), &r, &s);
+        signature = toBin(r, 32) + toBin(s, 32);
+    }
+
+    return token + "." + base64UrlEncode(signature);
+}
+
+int64_t inSeconds(chrono::seconds offset) {
+    return chrono::duration_cast<chrono::seconds>((chrono::system_clock::now() + offset).time_since_epoch()).count();
+}
+
+struct JwksFile {
+    JwksFile(const vector<string>& keys = {}) {
+        path = filesystem::temp_directory_path() / ("yahat-jwks-test-" + to_string(::getpid()) + ".json");
+        write(keys);
+    }
+
+    // The HS256 key "k1" and `keys`
+    void write(const vector<string>& keys) {
+        const auto mtime = filesystem::exists(path) ? filesystem::last_write_time(path) : filesystem::file_time_type{};
+        {
+            ofstream out{path};
+            out << R"({"keys":[{"kty":"oct","kid":"k1","alg":"HS256","k":")" << base64UrlEncode(secret) << R"("})";
+            for(const auto& key : keys) {
+                out << ',' << key;
+            }
+            out << "]}";
+        }
+
+        // Make sure the change is detected, even if the clock has a coarse resolution
+        if (mtime != filesystem::file_time_type{}) {
+            filesystem::last_write_time(path, mtime + 1s);
+        }
+    }
+
+    ~JwksFile() {
+        filesystem::remove(path);
+    }
+
+    filesystem::path path;
+};
+
+} // anon ns
+
+TEST(JwtAuthenticator, ValidHs256Token) {
+    JwksFile jwks;
+    JwtAuthenticator ja{{jwks.path}};
+
+    const auto token = makeHs256Token({{"sub", "alice"}, {"exp", inSeconds(60s)}});
+    auto auth = ja.verify(token);
+    EXPECT_TRUE(auth.access);
+    EXPECT_EQ(auth.account, "alice");
+
+    auto claims = any_cast<shared_ptr<const boost::json::object>>(auth.extra);
+    ASSERT_TRUE(claims);
+    EXPECT_EQ(claims->at("sub").as_string(), "alice");
+    EXPECT_EQ(ja.cachedTokens(), 1);
+
+    // Second time from the cache
+    auth = ja.verify(token);
+    EXPECT_TRUE(auth.access);
+    EXPECT_EQ(auth.account, "alice");
+    EXPECT_EQ(ja.cachedTokens(), 1);
+}
+
+TEST(JwtAuthenticator, InvalidSignature) {
+    JwksFile jwks;
+    JwtAuthenticator ja{{jwks.path}};
+
+    auto token = makeHs256Token({{"sub", "alice"}, {"exp", inSeconds(60s)}});
+    token.back() = token.back() == 'A' ? 'B' : 'A';
+    EXPECT_FALSE(ja.verify(token).access);
+    EXPECT_EQ(ja.cachedTokens(), 0);
+}
+
+TEST(JwtAuthenticator, ExpiredToken) {
+    JwksFile jwks;
+    JwtAuthenticator ja{{jwks.path}};
+
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "alice"}, {"exp", inSeconds(-300s)}})).access);
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "alice"}})).access);
+}
+
+TEST(JwtAuthenticator, UnknownKey) {
+    JwksFile jwks;
+    JwtAuthenticator ja{{jwks.path}};
+
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "alice"}, {"exp", inSeconds(60s)}}, "k2")).access);
+}
+
+TEST(JwtAuthenticator, Audience) {
+    JwksFile jwks;
+    JwtAuthenticator::Config config{jwks.path};
+    config.audience = "yahat";
+    JwtAuthenticator ja{config};
+
+    EXPECT_TRUE(ja.verify(makeHs256Token({{"sub", "alice"}, {"aud", "yahat"}, {"exp", inSeconds(60s)}})).access);
+    EXPECT_TRUE(ja.verify(makeHs256Token({{"sub", "bob"}, {"aud", boost::json::array{"other", "yahat"}}, {"exp", inSeconds(60s)}})).access);
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "eve"}, {"aud", "other"}, {"exp", inSeconds(60s)}})).access);
+}
+
+TEST(JwtAuthenticator, CacheIsBounded) {
+    JwksFile jwks;
+    JwtAuthenticator::Config config{jwks.path};
+    config.max_cached_tokens = 2;
+    JwtAuthenticator ja{config};
+
+    for(auto i = 0; i < 5; ++i) {
+        EXPECT_TRUE(ja.verify(makeHs256Token({{"sub", "user" + to_string(i)}, {"exp", inSeconds(60s)}})).access);
+    }
+
+    EXPECT_EQ(ja.cachedTokens(), 2);
+}
+
+TEST(JwtAuthenticator, ValidRs256Token) {
+    auto key = generateKey(EVP_PKEY_RSA);
+    JwksFile jwks{{toJwk(key.get(), "rsa1")}};
+    JwtAuthenticator ja{{jwks.path}};
+
+    auto auth = ja.verify(makeToken(key.get(), {{"sub", "alice"}, {"exp", inSeconds(60s)}}, "rsa1"));
+    EXPECT_TRUE(auth.access);
+    EXPECT_EQ(auth.account, "alice");
+
+    // Signed by another key with the same kid
+    auto other = generateKey(EVP_PKEY_RSA);
+    EXPECT_FALSE(ja.verify(makeToken(other.get(), {{"sub", "eve"}, {"exp", inSeconds(60s)}}, "rsa1")).access);
+}
+
+TEST(JwtAuthenticator, ValidEs256Token) {
+    auto key = generateKey(EVP_PKEY_EC);
+    JwksFile jwks{{toJwk(key.get(), "ec1")}};
+    JwtAuthenticator ja{{jwks.path}};
+
+    auto auth = ja.verify(makeToken(key.get(), {{"sub", "bob"}, {"exp", inSeconds(60s)}}, "ec1"));
+    EXPECT_TRUE(auth.access);
+    EXPECT_EQ(auth.account, "bob");
+
+    auto other = generateKey(EVP_PKEY_EC);
+    EXPECT_FALSE(ja.verify(makeToken(other.get(), {{"sub", "eve"}, {"exp", inSeconds(60s)}}, "ec1")).access);
+}
+
+TEST(JwtAuthenticator, ReloadRevokesKey) {
+    auto key = generateKey(EVP_PKEY_EC);
+    JwksFile jwks{{toJwk(key.get(), "ec1")}};
+    JwtAuthenticator::Config config{jwks.path};
+    config.jwks_check_interval = 0s;
+    JwtAuthenticator ja{config};
+
+    const auto token = makeToken(key.get(), {{"sub", "bob"}, {"exp", inSeconds(60s)}}, "ec1");
+    EXPECT_TRUE(ja.verify(token).access);
+    EXPECT_EQ(ja.cachedTokens(), 1);
+
+    // The key is removed from the JWKS file. The cached token must no longer be accepted.
+    jwks.write({});
+    EXPECT_FALSE(ja.verify(token).access);
+    EXPECT_EQ(ja.cachedTokens(), 0);
+}
+
+TEST(JwtAuthenticator, NotBefore) {
+    JwksFile jwks;
+    JwtAuthenticator::Config config{jwks.path};
+    config.leeway = 10s;
+    JwtAuthenticator ja{config};
+
+    EXPECT_TRUE(ja.verify(makeHs256Token({{"sub", "alice"}, {"nbf", inSeconds(-60s)}, {"exp", inSeconds(60s)}})).access);
+
+    // Within the leeway
+    EXPECT_TRUE(ja.verify(makeHs256Token({{"sub", "bob"}, {"nbf", inSeconds(5s)}, {"exp", inSeconds(60s)}})).access);
+
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "eve"}, {"nbf", inSeconds(60s)}, {"exp", inSeconds(120s)}})).access);
+}
+
+TEST(JwtAuthenticator, Issuer) {
+    JwksFile jwks;
+    JwtAuthenticator::Config config{jwks.path};
+    config.issuer = "https://issuer.example.com";
+    JwtAuthenticator ja{config};
+
+    EXPECT_TRUE(ja.verify(makeHs256Token({{"sub", "alice"}, {"iss", "https://issuer.example.com"}, {"exp", inSeconds(60s)}})).access);
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "bob"}, {"iss", "https://other.example.com"}, {"exp", inSeconds(60s)}})).access);
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "eve"}, {"exp", inSeconds(60s)}})).access);
+}
+
+TEST(JwtAuthenticator, TimeClaimsOutOfRange) {
+    JwksFile jwks;
+    JwtAuthenticator ja{{jwks.path}};
+
+    // Fractional seconds are allowed
+    EXPECT_TRUE(ja.verify(makeHs256Token({{"sub", "alice"}, {"exp", inSeconds(60s) + 0.5}})).access);
+
+    // Values that would overflow the clock are rejected, not wrapped around
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "bob"}, {"exp", numeric_limits<uint64_t>::max()}})).access);
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "bob"}, {"exp", numeric_limits<int64_t>::max()}})).access);
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "bob"}, {"exp", 1e300}})).access);
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "bob"}, {"exp", 1e10}})).access);
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "eve"}, {"nbf", -1e20}, {"exp", inSeconds(60s)}})).access);
+    EXPECT_FALSE(ja.verify(makeHs256Token({{"sub", "eve"}, {"nbf", numeric_limits<int64_t>::min()}, {"exp", inSeconds(60s)}})).access);
+    EXPECT_EQ(ja.cachedTokens(), 1);
+}
+
+#endif // USING_BOOST_JSON
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
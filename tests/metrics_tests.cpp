@@ -6,6 +6,8 @@
 #include "gtest/gtest.h"
 
 #include "yahat/Metrics.h"
+#include "yahat/RateLimiter.h"
+#include "yahat/RequestQueue.h"
 #include "yahat/logging.h"
 
 using namespace std;
@@ -262,6 +264,47 @@ TEST(Metrics, CloneDuplicateLabels) {
     EXPECT_THROW(metrics.clone(*gauge, gauge->labels()), std::invalid_argument);
 }
 
+TEST(Metrics, AddExisting) {
+    Metrics metrics;
+
+    auto *counter = metrics.AddCounter("requests", "Number of requests", "", Metrics::labels_t{{"method", "GET"}});
+    EXPECT_EQ(metrics.AddCounter("requests", "Number of requests", "", Metrics::labels_t{{"method", "GET"}}), counter);
+    EXPECT_NE(metrics.AddCounter("requests", "Number of requests", "", Metrics::labels_t{{"method", "PUT"}}), counter);
+    EXPECT_THROW(metrics.AddCounter<double>("requests", "Number of requests", "", Metrics::labels_t{{"method", "GET"}}), std::invalid_argument);
+}
+
+TEST(Metrics, DefaultNamedInstances) {
+    Metrics metrics;
+
+    auto second = make_unique<RateLimiter>(RateLimiter::Config{}, &metrics);
+    {
+        RateLimiter first{RateLimiter::Config{}, &metrics};
+        EXPECT_TRUE(first.check("a").allowed);
+    }
+    EXPECT_TRUE(second->check("b").allowed);
+
+    auto *allowed = dynamic_cast<Metrics::Counter<uint64_t> *>(
+        metrics.lookup("yahat_rate_limiter_allowed", {{"limiter", "default"}}, Metrics::DataType::Type::Counter));
+    ASSERT_NE(allowed, nullptr);
+    EXPECT_EQ(allowed->value(), 2);
+
+    RequestQueue queue{RequestQueue::Config{}, &metrics};
+    {
+        RequestQueue other{RequestQueue::Config{}, &metrics};
+        auto ticket = other.tryEnqueue();
+        ASSERT_TRUE(ticket);
+        EXPECT_TRUE(other.dequeue(*ticket));
+    }
+    auto ticket = queue.tryEnqueue();
+    ASSERT_TRUE(ticket);
+    EXPECT_TRUE(queue.dequeue(*ticket));
+
+    auto *dequeued = dynamic_cast<Metrics::Counter<uint64_t> *>(
+        metrics.lookup("yahat_request_queue_dequeued", {{"queue", "default"}}, Metrics::DataType::Type::Counter));
+    ASSERT_NE(dequeued, nullptr);
+    EXPECT_EQ(dequeued->value(), 2);
+}
+
 #else
 TEST(Metrics, Placeholder) {
     EXPECT_TRUE(true);
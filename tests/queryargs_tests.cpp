@@ -0,0 +1,96 @@
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+
+#include "gtest/gtest.h"
+
+#include "yahat/QueryArgs.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace yahat;
+
+TEST(QueryArgs, Basic) {
+    QueryArgs args{"a=1&b=two&flag&c="};
+    EXPECT_EQ(args.size(), 4);
+    EXPECT_EQ(args.get("a"), "1");
+    EXPECT_EQ(args.get("b"), "two");
+    EXPECT_EQ(args.get("flag"), "");
+    EXPECT_EQ(args.get("c"), "");
+    EXPECT_FALSE(args.get("d"));
+    EXPECT_EQ(args.get("d", "default"), "default");
+    EXPECT_TRUE(args.contains("flag"));
+}
+
+TEST(QueryArgs, Empty) {
+    QueryArgs args{""};
+    EXPECT_TRUE(args.empty());
+
+    args.assign("&&a=1&");
+    EXPECT_EQ(args.size(), 1);
+    EXPECT_EQ(args.get("a"), "1");
+}
+
+TEST(QueryArgs, Decode) {
+    QueryArgs args{"q=hello+world%21&amp%26=%3D&path=%2Fa%2fb&bad=%zz%4"};
+    EXPECT_EQ(args.get("q"), "hello world!");
+    EXPECT_EQ(args.get("amp&"), "=");
+    EXPECT_EQ(args.get("path"), "/a/b");
+    EXPECT_EQ(args.get("bad"), "%zz%4");
+
+    // Decoded only once
+    EXPECT_EQ(args.get("q"), "hello world!");
+}
+
+TEST(QueryArgs, LongQuery) {
+    // Longer than the SIMD block size, with delimiters on the block boundaries
+    string query;
+    for(auto i = 0; i < 50; ++i) {
+        query += "key" + to_string(i) + "=value%20" + to_string(i) + "&";
+    }
+    QueryArgs args{query};
+    EXPECT_EQ(args.size(), 50);
+    for(auto i = 0; i < 50; ++i) {
+        EXPECT_EQ(args.get("key" + to_string(i)), "value " + to_string(i));
+    }
+}
+
+TEST(QueryArgs, RepeatedKeyAndOrder) {
+    QueryArgs args{"a=1&b=2&a=3"};
+    EXPECT_EQ(args.get("a"), "3");
+
+    vector<pair<string, string>> all;
+    args.forEach([&](string_view key, string_view value) {
+        all.emplace_back(key, value);
+    });
+    EXPECT_EQ(all, (vector<pair<string, string>>{{"a", "1"}, {"b", "2"}, {"a", "3"}}));
+}
+
+TEST(QueryArgs, Copy) {
+    QueryArgs args{"a=x%20y"};
+    auto copy = args;
+    args.assign("a=other");
+    EXPECT_EQ(copy.get("a"), "x y");
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,142 @@
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+
+#include "gtest/gtest.h"
+
+#include "yahat/RateLimiter.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace std::chrono_literals;
+using namespace yahat;
+
+namespace {
+
+RateLimiter::Config makeConfig(double rate, unsigned burst) {
+    RateLimiter::Config config;
+    config.name = "test";
+    config.rate = rate;
+    config.burst = burst;
+    return config;
+}
+
+} // anon ns
+
+TEST(RateLimiter, AllowsBurst) {
+    RateLimiter rl{makeConfig(1, 5)};
+    const auto now = RateLimiter::clock_t::now();
+
+    for(auto i = 0; i < 5; ++i) {
+        EXPECT_TRUE(rl.check("alice", now).allowed);
+    }
+
+    const auto result = rl.check("alice", now);
+    EXPECT_FALSE(result.allowed);
+    EXPECT_EQ(result.retry_after, 1s);
+}
+
+TEST(RateLimiter, Refills) {
+    RateLimiter rl{makeConfig(2, 2)};
+    const auto now = RateLimiter::clock_t::now();
+
+    EXPECT_TRUE(rl.check("alice", now).allowed);
+    EXPECT_TRUE(rl.check("alice", now).allowed);
+    EXPECT_FALSE(rl.check("alice", now).allowed);
+
+    // One new token every 500 ms
+    EXPECT_TRUE(rl.check("alice", now + 500ms).allowed);
+    EXPECT_FALSE(rl.check("alice", now + 500ms).allowed);
+
+    EXPECT_TRUE(rl.check("alice", now + 2s).allowed);
+    EXPECT_TRUE(rl.check("alice", now + 2s).allowed);
+    EXPECT_FALSE(rl.check("alice", now + 2s).allowed);
+}
+
+TEST(RateLimiter, RetryAfter) {
+    RateLimiter rl{makeConfig(0.1, 1)};
+    const auto now = RateLimiter::clock_t::now();
+
+    EXPECT_TRUE(rl.check("alice", now).allowed);
+    const auto result = rl.check("alice", now);
+    EXPECT_FALSE(result.allowed);
+    EXPECT_EQ(result.retry_after, 10s);
+}
+
+TEST(RateLimiter, KeysAreIndependent) {
+    RateLimiter rl{makeConfig(1, 1)};
+    const auto now = RateLimiter::clock_t::now();
+
+    EXPECT_TRUE(rl.check("alice", now).allowed);
+    EXPECT_FALSE(rl.check("alice", now).allowed);
+    EXPECT_TRUE(rl.check("bob", now).allowed);
+    EXPECT_EQ(rl.size(), 2);
+}
+
+TEST(RateLimiter, RemoteIp) {
+    RateLimiter rl{makeConfig(1, 1)};
+
+    Request a, b;
+    a.remote = {boost::asio::ip::make_address("10.0.0.1"), 1234};
+    b.remote = {boost::asio::ip::make_address("10.0.0.2"), 1234};
+
+    EXPECT_TRUE(rl.check(a).allowed);
+    EXPECT_FALSE(rl.check(a).allowed);
+    EXPECT_TRUE(rl.check(b).allowed);
+}
+
+TEST(RateLimiter, KeySourcesAreIndependent) {
+    auto config = makeConfig(1, 1);
+    config.key = RateLimiter::KeyType::ACCOUNT;
+    RateLimiter rl{config};
+
+    // An account named like the raw bytes of an IP address
+    Request anonymous, user;
+    anonymous.remote = {boost::asio::ip::make_address("65.66.67.68"), 1234};
+    user.remote = anonymous.remote;
+    user.auth.account = "ABCD";
+
+    EXPECT_TRUE(rl.check(anonymous).allowed);
+    EXPECT_FALSE(rl.check(anonymous).allowed);
+    EXPECT_TRUE(rl.check(user).allowed);
+    EXPECT_TRUE(rl.check("ABCD").allowed);
+    EXPECT_EQ(rl.size(), 3);
+}
+
+TEST(RateLimiter, EvictsWhenFull) {
+    auto config = makeConfig(1, 1);
+    config.shards = 1;
+    config.max_keys_per_shard = 10;
+    RateLimiter rl{config};
+    const auto now = RateLimiter::clock_t::now();
+
+    for(auto i = 0; i < 100; ++i) {
+        EXPECT_TRUE(rl.check("user" + to_string(i), now + chrono::milliseconds{i}).allowed);
+        EXPECT_LE(rl.size(), 10);
+    }
+
+    // The most recently used keys are still limited
+    EXPECT_FALSE(rl.check("user99", now + 100ms).allowed);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "yahat/RequestArena.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace yahat;
+
+TEST(RequestArena, ReusedAfterRelease) {
+    RequestArena arena;
+
+    auto *first = arena.allocate(100, 8);
+    auto *second = arena.allocate(100, 8);
+    EXPECT_NE(first, second);
+    EXPECT_EQ(arena.release(), 2);
+
+    // The next request gets the same memory
+    EXPECT_EQ(arena.allocate(100, 8), first);
+    EXPECT_EQ(arena.release(), 1);
+    EXPECT_EQ(arena.overflows(), 0);
+}
+
+TEST(RequestArena, DeallocateDoesNothing) {
+    RequestArena arena;
+
+    auto *first = arena.allocate(100, 8);
+    arena.deallocate(first, 100, 8);
+
+    // Monotonic. The memory is only re-used after a release.
+    EXPECT_NE(arena.allocate(100, 8), first);
+    EXPECT_EQ(arena.release(), 2);
+}
+
+TEST(RequestArena, Overflow) {
+    RequestArena arena;
+
+    // Fits in the initial buffer
+    arena.allocate(RequestArena::initial_size / 2, 8);
+    EXPECT_EQ(arena.overflows(), 0);
+
+    // Needs a block from the heap
+    arena.allocate(RequestArena::initial_size, 8);
+    EXPECT_EQ(arena.overflows(), 1);
+
+    // The counter is reset when it's read
+    EXPECT_EQ(arena.overflows(), 0);
+    EXPECT_EQ(arena.release(), 2);
+
+    // The heap blocks are freed, and the initial buffer is used again
+    arena.allocate(RequestArena::initial_size / 2, 8);
+    EXPECT_EQ(arena.overflows(), 0);
+    EXPECT_EQ(arena.release(), 1);
+}
+
+TEST(RequestArena, PmrString) {
+    RequestArena arena;
+    {
+        std::pmr::string text{&arena};
+        text.assign(1000, 'a');
+        EXPECT_EQ(text.size(), 1000);
+    }
+    EXPECT_GE(arena.release(), 1);
+    EXPECT_EQ(arena.overflows(), 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
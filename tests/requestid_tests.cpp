@@ -0,0 +1,126 @@
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <set>
+#include <sstream>
+
+#include "gtest/gtest.h"
+
+#include <boost/uuid/uuid_io.hpp>
+
+#include "yahat/RequestId.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace yahat;
+
+TEST(RequestId, GenerateV7) {
+    const auto before = chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    const auto uuid = RequestId::generate();
+
+    EXPECT_EQ(uuid.data[6] >> 4, 7); // version
+    EXPECT_EQ(uuid.data[8] >> 6, 2); // variant
+
+    uint64_t ms = 0;
+    for(auto i = 0; i < 6; ++i) {
+        ms = (ms << 8) | uuid.data[i];
+    }
+    EXPECT_GE(ms, static_cast<uint64_t>(before));
+    EXPECT_LE(ms, static_cast<uint64_t>(before) + 1000);
+}
+
+TEST(RequestId, UniqueAcrossThreads) {
+    constexpr auto num_threads = 4;
+    constexpr auto num_ids = 10000;
+    vector<vector<boost::uuids::uuid>> ids(num_threads);
+    vector<thread> threads;
+    for(auto t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&ids, t] {
+            for(auto i = 0; i < num_ids; ++i) {
+                ids[t].emplace_back(RequestId::generate());
+            }
+        });
+    }
+    for(auto& t : threads) {
+        t.join();
+    }
+
+    set<boost::uuids::uuid> all;
+    for(const auto& v : ids) {
+        all.insert(v.begin(), v.end());
+    }
+    EXPECT_EQ(all.size(), num_threads * num_ids);
+}
+
+TEST(RequestId, LazyAndCopiesAreEqual) {
+    RequestId id;
+    EXPECT_FALSE(id.known());
+    RequestId copy = id;
+    EXPECT_TRUE(id.known());
+    EXPECT_EQ(id.uuid(), copy.uuid());
+    EXPECT_FALSE(id.uuid().is_nil());
+    EXPECT_FALSE(id.adopted());
+}
+
+TEST(RequestId, AdoptUuid) {
+    RequestId id;
+    EXPECT_TRUE(id.adopt("0190a5b2-8f3e-7c1d-9a2b-3c4d5e6f7a8b"));
+    EXPECT_TRUE(id.adopted());
+    EXPECT_TRUE(id.known());
+    EXPECT_EQ(id.str(), "0190a5b2-8f3e-7c1d-9a2b-3c4d5e6f7a8b");
+    EXPECT_EQ(boost::uuids::to_string(id.uuid()), "0190a5b2-8f3e-7c1d-9a2b-3c4d5e6f7a8b");
+}
+
+TEST(RequestId, AdoptString) {
+    RequestId id;
+    EXPECT_TRUE(id.adopt("req-42.abc"));
+    EXPECT_EQ(id.str(), "req-42.abc");
+    EXPECT_TRUE(id.uuid().is_nil());
+
+    ostringstream out;
+    out << id;
+    EXPECT_EQ(out.str(), "req-42.abc");
+}
+
+TEST(RequestId, RejectInvalid) {
+    RequestId id;
+    EXPECT_FALSE(id.adopt(""));
+    EXPECT_FALSE(id.adopt("bad id"));
+    EXPECT_FALSE(id.adopt("evil\nlog line"));
+    EXPECT_FALSE(id.adopt(string(129, 'a')));
+    EXPECT_FALSE(id.adopted());
+}
+
+TEST(RequestId, AdoptTraceparent) {
+    RequestId id;
+    EXPECT_TRUE(id.adoptTraceparent("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01"));
+    EXPECT_EQ(id.str(), "4bf92f35-77b3-4da6-a3ce-929d0e0e4736");
+
+    RequestId invalid;
+    EXPECT_FALSE(invalid.adoptTraceparent("00-00000000000000000000000000000000-00f067aa0ba902b7-01"));
+    EXPECT_FALSE(invalid.adoptTraceparent("00-4bf92f35"));
+    EXPECT_FALSE(invalid.adoptTraceparent("00-4bf92f3577b34da6a3ce929d0e0e47zz-00f067aa0ba902b7-01"));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,100 @@
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+
+#include "gtest/gtest.h"
+
+#include "yahat/RequestQueue.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace std::chrono_literals;
+using namespace yahat;
+
+namespace {
+
+RequestQueue::Config makeConfig(size_t maxDepth) {
+    RequestQueue::Config config;
+    config.name = "test";
+    config.max_depth = maxDepth;
+    config.target = 5ms;
+    config.interval = 100ms;
+    return config;
+}
+
+} // anon ns
+
+TEST(RequestQueue, RejectsWhenFull) {
+    RequestQueue queue{makeConfig(2)};
+
+    auto a = queue.tryEnqueue();
+    auto b = queue.tryEnqueue();
+    EXPECT_TRUE(a);
+    EXPECT_TRUE(b);
+    EXPECT_FALSE(queue.tryEnqueue());
+    EXPECT_EQ(queue.depth(), 2);
+
+    EXPECT_TRUE(queue.dequeue(*a, a->enqueued()));
+    EXPECT_EQ(queue.depth(), 1);
+    EXPECT_TRUE(queue.tryEnqueue());
+}
+
+TEST(RequestQueue, TicketLeavesQueueWhenDestroyed) {
+    RequestQueue queue{makeConfig(2)};
+    {
+        auto a = queue.tryEnqueue();
+        EXPECT_EQ(queue.depth(), 1);
+    }
+    EXPECT_EQ(queue.depth(), 0);
+}
+
+TEST(RequestQueue, MaxWaitWithoutStandingQueue) {
+    RequestQueue queue{makeConfig(10)};
+    const auto now = RequestQueue::clock_t::now() + 10s;
+
+    auto a = queue.tryEnqueue(now);
+    EXPECT_TRUE(queue.dequeue(*a, now + 50ms));
+
+    auto b = queue.tryEnqueue(now + 100ms);
+    EXPECT_FALSE(queue.dequeue(*b, now + 300ms));
+}
+
+TEST(RequestQueue, TargetWithStandingQueue) {
+    RequestQueue queue{makeConfig(10)};
+    const auto now = RequestQueue::clock_t::now();
+
+    // Keep the queue non-empty for longer than the interval
+    auto first = queue.tryEnqueue(now);
+    auto second = queue.tryEnqueue(now + 10ms);
+    EXPECT_TRUE(queue.dequeue(*first, now + 15ms));
+
+    auto third = queue.tryEnqueue(now + 150ms);
+    EXPECT_FALSE(queue.dequeue(*second, now + 200ms));
+    EXPECT_FALSE(queue.dequeue(*third, now + 300ms));
+
+    // The queue was empty after `third`, so the standing queue is gone
+    auto fourth = queue.tryEnqueue(now + 1000ms);
+    EXPECT_TRUE(queue.dequeue(*fourth, now + 1050ms));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,115 @@
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+
+#include "gtest/gtest.h"
+
+#include "yahat/ResponseCache.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace std::chrono_literals;
+using namespace yahat;
+
+namespace {
+
+ResponseCache::entry_t makeEntry(string body, ResponseCache::clock_t::time_point expires) {
+    auto e = make_shared<ResponseCache::Entry>();
+    e->reason = "OK";
+    e->body = std::move(body);
+    e->expires = expires;
+    return e;
+}
+
+} // anon ns
+
+TEST(ResponseCache, Key) {
+    ResponseCache::Config config;
+    config.scope = ResponseCache::Scope::ACCOUNT;
+    ResponseCache account_cache{config};
+    config.scope = ResponseCache::Scope::SHARED;
+    ResponseCache shared_cache{config};
+
+    Request a, b;
+    a.target = b.target = "/api/v1/config";
+    a.query = b.query = "a=1";
+    a.auth.account = "alice";
+    b.auth.account = "bob";
+
+    EXPECT_NE(account_cache.makeKey(a), account_cache.makeKey(b));
+    EXPECT_EQ(shared_cache.makeKey(a), shared_cache.makeKey(b));
+
+    b.query = "a=2";
+    EXPECT_NE(shared_cache.makeKey(a), shared_cache.makeKey(b));
+}
+
+TEST(ResponseCache, Expires) {
+    ResponseCache cache{{}};
+    const auto now = ResponseCache::clock_t::now();
+
+    cache.put("a", makeEntry("data", now + 1s));
+    auto e = cache.get("a", now);
+    EXPECT_TRUE(e);
+    EXPECT_EQ(e->body, "data");
+
+    EXPECT_FALSE(cache.get("a", now + 1s));
+    EXPECT_EQ(cache.size(), 0);
+    EXPECT_EQ(cache.bytes(), 0);
+}
+
+TEST(ResponseCache, EvictsLeastRecentlyUsed) {
+    const auto now = ResponseCache::clock_t::now();
+    const auto entry_size = makeEntry(string(1000, 'x'), now)->size() + 1;
+
+    ResponseCache::Config config;
+    config.max_bytes = entry_size * 3;
+    ResponseCache cache{config};
+
+    cache.put("a", makeEntry(string(1000, 'x'), now + 1s));
+    cache.put("b", makeEntry(string(1000, 'x'), now + 1s));
+    cache.put("c", makeEntry(string(1000, 'x'), now + 1s));
+    EXPECT_EQ(cache.size(), 3);
+
+    // Make "a" the most recently used
+    EXPECT_TRUE(cache.get("a", now));
+
+    cache.put("d", makeEntry(string(1000, 'x'), now + 1s));
+    EXPECT_EQ(cache.size(), 3);
+    EXPECT_LE(cache.bytes(), config.max_bytes);
+    EXPECT_TRUE(cache.get("a", now));
+    EXPECT_FALSE(cache.get("b", now));
+    EXPECT_TRUE(cache.get("c", now));
+    EXPECT_TRUE(cache.get("d", now));
+}
+
+TEST(ResponseCache, Replace) {
+    ResponseCache cache{{}};
+    const auto now = ResponseCache::clock_t::now();
+
+    cache.put("a", makeEntry("first", now + 1s));
+    cache.put("a", makeEntry("second", now + 1s));
+    EXPECT_EQ(cache.size(), 1);
+    EXPECT_EQ(cache.get("a", now)->body, "second");
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
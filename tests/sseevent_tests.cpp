@@ -0,0 +1,114 @@
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+
+#include "gtest/gtest.h"
+
+#include "yahat/SseEvent.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace yahat;
+
+TEST(SseEvent, Fields) {
+    SseEvent ev;
+    ev.event("update").id(42).retry(3000ms).data("hello");
+    EXPECT_EQ(ev.str(), "event: update\nid: 42\nretry: 3000\ndata: hello\n\n");
+}
+
+TEST(SseEvent, MultiLineData) {
+    SseEvent ev;
+    ev.data("a\nb\r\nc\rd");
+    EXPECT_EQ(ev.str(), "data: a\ndata: b\ndata: c\ndata: d\n\n");
+
+    ev.clear();
+    ev.data("");
+    EXPECT_EQ(ev.str(), "data: \n\n");
+
+    ev.clear();
+    ev.comment("keep\nalive");
+    EXPECT_EQ(ev.str(), ": keep\n: alive\n\n");
+}
+
+TEST(SseEvent, TrailingLineBreak) {
+    SseEvent ev;
+    ev.data("a\n");
+    EXPECT_EQ(ev.str(), "data: a\ndata: \n\n");
+
+    ev.clear();
+    ev.data("a\r");
+    EXPECT_EQ(ev.str(), "data: a\ndata: \n\n");
+
+    ev.clear();
+    ev.data("a\r\n");
+    EXPECT_EQ(ev.str(), "data: a\ndata: \n\n");
+
+    ev.clear();
+    ev.data("\n");
+    EXPECT_EQ(ev.str(), "data: \ndata: \n\n");
+}
+
+TEST(SseEvent, TakeChunk) {
+    SseEvent ev;
+    ev.data("hello");
+    const auto *data = ev.chunk().data();
+
+    const auto chunk = ev.takeChunk();
+    EXPECT_EQ(chunk, "0000000d\r\ndata: hello\n\n\r\n");
+    EXPECT_EQ(chunk.data(), data);
+    EXPECT_TRUE(ev.empty());
+
+    ev.data("world");
+    EXPECT_EQ(ev.chunk(), "0000000d\r\ndata: world\n\n\r\n");
+}
+
+TEST(SseEvent, Chunk) {
+    SseEvent ev;
+    ev.data("hello");
+    EXPECT_EQ(ev.chunk(), "0000000d\r\ndata: hello\n\n\r\n");
+
+    // Can be changed after it's framed
+    ev.data("world");
+    EXPECT_EQ(ev.chunk(), "00000019\r\ndata: hello\ndata: world\n\n\r\n");
+}
+
+TEST(SseEvent, ReuseDoesNotAllocate) {
+    SseEvent ev;
+    ev.event("tick").data(string(100, 'x'));
+    const auto *data = ev.chunk().data();
+
+    for(auto i = 0; i < 10; ++i) {
+        ev.clear();
+        EXPECT_TRUE(ev.empty());
+        ev.event("tick").data(string_view{"y"});
+        EXPECT_EQ(ev.chunk().data(), data);
+    }
+}
+
+TEST(SseEvent, InvalidFields) {
+    SseEvent ev;
+    EXPECT_THROW(ev.event("a\nb"), std::runtime_error);
+    EXPECT_THROW(ev.id(string_view{"a\rb"}), std::runtime_error);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,397 @@
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+
+#include "gtest/gtest.h"
+
+#include "yahat/SseHub.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace std::chrono_literals;
+using namespace yahat;
+
+TEST(SseHub, Encode) {
+    const auto chunk = SseHub::encode("data: hello\n\n");
+    EXPECT_EQ(*chunk, "d\r\ndata: hello\n\n\r\n");
+}
+
+TEST(SseHub, TopicFromTarget) {
+    boost::asio::io_context ctx;
+    SseHub hub{ctx, {}};
+
+    Request req;
+    req.route = "/events";
+    req.target = "/events/news";
+    EXPECT_EQ(hub.topicFor(req), "news");
+
+    req.target = "/events";
+    EXPECT_EQ(hub.topicFor(req), "");
+}
+
+TEST(SseHub, FanOut) {
+    boost::asio::io_context ctx;
+    SseHub::Config config;
+    config.fanout_batch_size = 3;
+    SseHub hub{ctx, config};
+
+    vector<shared_ptr<SseHub::Subscriber>> news, sports;
+    for(auto i = 0; i < 10; ++i) {
+        news.emplace_back(hub.subscribe("news"));
+    }
+    sports.emplace_back(hub.subscribe("sports"));
+    EXPECT_EQ(hub.subscribers("news"), 10);
+    EXPECT_EQ(hub.subscribers("sports"), 1);
+
+    hub.publish("news", "data: 1\n\n");
+    hub.publish("news", "data: 2\n\n");
+    ctx.poll();
+
+    vector<SseHub::buffer_t> events;
+    const string *first = {};
+    for(auto& s : news) {
+        EXPECT_TRUE(s->signal().signaled());
+        s->take(events);
+        ASSERT_EQ(events.size(), 2);
+        EXPECT_EQ(*events[0], "9\r\ndata: 1\n\n\r\n");
+        EXPECT_EQ(*events[1], "9\r\ndata: 2\n\n\r\n");
+
+        // All the subscribers share the same buffer
+        if (!first) {
+            first = events[0].get();
+        }
+        EXPECT_EQ(events[0].get(), first);
+    }
+
+    sports.front()->take(events);
+    EXPECT_TRUE(events.empty());
+}
+
+TEST(SseHub, FanOutInOrder) {
+    boost::asio::io_context ctx;
+    SseHub::Config config;
+    config.fanout_batch_size = 2;
+    config.fanout_lanes = 3;
+    config.replay_size = 16;
+    config.max_queue = 0;
+    config.heartbeat_interval = {};
+    SseHub hub{ctx, config};
+
+    vector<shared_ptr<SseHub::Subscriber>> subscribers;
+    for(auto i = 0; i < 10; ++i) {
+        subscribers.emplace_back(hub.subscribe("news"));
+    }
+
+    auto work = boost::asio::make_work_guard(ctx);
+    vector<thread> workers;
+    for(auto i = 0; i < 4; ++i) {
+        workers.emplace_back([&ctx] {
+            ctx.run();
+        });
+    }
+
+    constexpr uint64_t num_events = 1000;
+    for(uint64_t i = 0; i < num_events; ++i) {
+        if (i == num_events / 2) {
+            // Moves other subscribers within their lanes
+            hub.unsubscribe(subscribers[0]);
+            hub.unsubscribe(subscribers[3]);
+            subscribers.erase(subscribers.begin() + 3);
+            subscribers.erase(subscribers.begin());
+        }
+        hub.publish("news", "data: x\n\n");
+    }
+
+    work.reset();
+    for(auto& w : workers) {
+        w.join();
+    }
+
+    vector<SseHub::buffer_t> events;
+    for(auto& s : subscribers) {
+        s->take(events);
+        ASSERT_EQ(events.size(), num_events);
+        for(uint64_t i = 0; i < num_events; ++i) {
+            EXPECT_EQ(*events[i], *SseHub::encode("data: x\n\n", i + 1));
+        }
+    }
+}
+
+TEST(SseHub, Unsubscribe) {
+    boost::asio::io_context ctx;
+    SseHub hub{ctx, {}};
+
+    auto a = hub.subscribe("news");
+    auto b = hub.subscribe("news");
+    hub.unsubscribe(a);
+    EXPECT_EQ(hub.subscribers("news"), 1);
+    hub.unsubscribe(b);
+    EXPECT_EQ(hub.subscribers("news"), 0);
+
+    hub.publish("news", "data: 1\n\n");
+    ctx.poll();
+
+    vector<SseHub::buffer_t> events;
+    a->take(events);
+    EXPECT_TRUE(events.empty());
+}
+
+TEST(SseHub, EncodeWithId) {
+    const auto chunk = SseHub::encode("data: hello\n\n", 42);
+    EXPECT_EQ(*chunk, "14\r\nid: 42\ndata: hello\n\n\r\n");
+}
+
+TEST(SseHub, Replay) {
+    boost::asio::io_context ctx;
+    SseHub::Config config;
+    config.replay_size = 4;
+    SseHub hub{ctx, config};
+
+    for(auto i = 1; i <= 6; ++i) {
+        hub.publish("news", "data: " + to_string(i) + "\n\n");
+    }
+    ctx.poll();
+
+    // Ids 5 and 6 were missed
+    auto s = hub.subscribe("news", 4);
+    vector<SseHub::buffer_t> events;
+    s->take(events);
+    ASSERT_EQ(events.size(), 2);
+    EXPECT_EQ(*events[0], *SseHub::encode("data: 5\n\n", 5));
+    EXPECT_EQ(*events[1], *SseHub::encode("data: 6\n\n", 6));
+
+    // Up to date
+    s = hub.subscribe("news", 6);
+    s->take(events);
+    EXPECT_TRUE(events.empty());
+
+    // The oldest event in the ring
+    s = hub.subscribe("news", 2);
+    s->take(events);
+    EXPECT_EQ(events.size(), 4);
+}
+
+TEST(SseHub, IdleTopicsAreRemoved) {
+    boost::asio::io_context ctx;
+    SseHub::Config config;
+    config.replay_size = 4;
+    config.topic_ttl = 50ms;
+    config.heartbeat_interval = {};
+    SseHub hub{ctx, config};
+
+    // A topic without events is removed with its last subscriber
+    hub.unsubscribe(hub.subscribe("nothing"));
+    EXPECT_EQ(hub.topics(), 0);
+
+    hub.publish("idle", "data: 1\n\n");
+    auto s = hub.subscribe("active");
+    hub.publish("active", "data: 1\n\n");
+    EXPECT_EQ(hub.topics(), 2);
+
+    // Within the ttl, a reconnecting client can still get the events it missed
+    hub.unsubscribe(hub.subscribe("idle"));
+    EXPECT_EQ(hub.topics(), 2);
+
+    this_thread::sleep_for(60ms);
+    hub.publish("active", "data: 2\n\n");
+    EXPECT_EQ(hub.topics(), 1);
+    EXPECT_EQ(hub.subscribers("active"), 1);
+}
+
+TEST(SseHub, ReplayGapTooLarge) {
+    boost::asio::io_context ctx;
+    SseHub::Config config;
+    config.replay_size = 4;
+    SseHub hub{ctx, config};
+
+    for(auto i = 1; i <= 10; ++i) {
+        hub.publish("news", "data: " + to_string(i) + "\n\n");
+    }
+    ctx.poll();
+
+    auto s = hub.subscribe("news", 2);
+    vector<SseHub::buffer_t> events;
+    s->take(events);
+    ASSERT_EQ(events.size(), 1);
+    EXPECT_EQ(*events[0], *SseHub::encode(config.reset_event, 10));
+}
+
+TEST(SseHub, Heartbeat) {
+    boost::asio::io_context ctx;
+    SseHub::Config config;
+    config.heartbeat_interval = 50ms;
+    config.heartbeat_shards = 2;
+    SseHub hub{ctx, config};
+
+    auto alive = hub.subscribe("news");
+    auto dead = hub.subscribe("news");
+
+    // The sessions IO is aborted for dead streams only
+    size_t alive_cancelled = 0, dead_cancelled = 0;
+    alive->setCancel([&] { ++alive_cancelled; });
+    dead->setCancel([&] { ++dead_cancelled; });
+
+    vector<SseHub::buffer_t> events;
+    size_t heartbeats = 0;
+    const auto until = chrono::steady_clock::now() + 300ms;
+    while(chrono::steady_clock::now() < until) {
+        ctx.run_for(10ms);
+        alive->take(events);
+        for(const auto& event : events) {
+            EXPECT_EQ(event, SseHub::heartbeat());
+            ++heartbeats;
+        }
+        if (!events.empty()) {
+            alive->written();
+        }
+    }
+
+    EXPECT_GE(heartbeats, 3);
+    EXPECT_FALSE(alive->closed());
+
+    // Has not written anything in 3 intervals
+    EXPECT_TRUE(dead->closed());
+    EXPECT_EQ(dead_cancelled, 1);
+    EXPECT_EQ(alive_cancelled, 0);
+}
+
+TEST(SseHub, StreamHeartbeat) {
+    boost::asio::io_context ctx;
+    SseHub::Config config;
+    config.heartbeat_interval = 50ms;
+    SseHub hub{ctx, config};
+
+    // Let the timer wheels idle for a while before the streams are added
+    this_thread::sleep_for(100ms);
+    auto alive = hub.createStream();
+    auto dead = hub.createStream();
+    EXPECT_EQ(hub.topics(), 0);
+
+    vector<SseHub::buffer_t> events;
+    size_t heartbeats = 0;
+    const auto until = chrono::steady_clock::now() + 300ms;
+    while(chrono::steady_clock::now() < until) {
+        ctx.run_for(10ms);
+        alive->take(events);
+        heartbeats += events.size();
+        if (!events.empty()) {
+            alive->written();
+        }
+    }
+
+    EXPECT_GE(heartbeats, 3);
+    EXPECT_FALSE(alive->closed());
+    EXPECT_TRUE(dead->closed());
+}
+
+TEST(SseHub, Overflow) {
+    const auto a = SseHub::encode("data: a\n\n");
+    const auto b = SseHub::encode("data: b\n\n");
+    const auto c = SseHub::encode("data: c\n\n");
+    vector<SseHub::buffer_t> events;
+
+    {
+        SseHub::Subscriber s{"", {2, SseHub::Overflow::DROP_OLDEST}};
+        s.push(a);
+        s.push(b);
+        s.push(c);
+        s.take(events);
+        EXPECT_EQ(events, (vector<SseHub::buffer_t>{b, c}));
+    }
+
+    {
+        SseHub::Subscriber s{"", {2, SseHub::Overflow::COALESCE}};
+        s.push(a);
+        s.push(b);
+        s.push(c);
+        s.take(events);
+        EXPECT_EQ(events, (vector<SseHub::buffer_t>{c}));
+    }
+
+    {
+        SseHub::Subscriber s{"", {2, SseHub::Overflow::DISCONNECT}};
+        s.push(a);
+        s.push(b);
+        EXPECT_FALSE(s.closed());
+        s.push(c);
+        EXPECT_TRUE(s.closed());
+        EXPECT_TRUE(s.signal().signaled());
+        s.take(events);
+        EXPECT_TRUE(events.empty());
+    }
+}
+
+TEST(SseHub, ReplayLargerThanQueue) {
+    boost::asio::io_context ctx;
+    SseHub::Config config;
+    config.replay_size = 10;
+    config.max_queue = 2;
+    SseHub hub{ctx, config};
+
+    for(auto i = 0; i < 5; ++i) {
+        hub.publish("news", "data: x\n\n");
+    }
+
+    auto s = hub.subscribe("news", 2);
+    vector<SseHub::buffer_t> events;
+    s->take(events);
+    ASSERT_EQ(events.size(), 1);
+    EXPECT_EQ(*events[0], *SseHub::encode(config.reset_event, 5));
+}
+
+TEST(SseHub, SseStreamHandle) {
+    auto subscriber = make_shared<SseHub::Subscriber>("");
+    vector<SseHub::buffer_t> events;
+
+    {
+        SseStream stream{make_shared<SseStream::Impl>(subscriber)};
+        auto copy = stream;
+        EXPECT_TRUE(copy.isOpen());
+
+        thread sender{[copy] {
+            EXPECT_TRUE(copy.send("data: 1\n\n"));
+        }};
+        sender.join();
+        EXPECT_TRUE(stream.send("data: 2\n\n"));
+        EXPECT_FALSE(subscriber->ended());
+    }
+
+    // The last handle is gone. The stream ends after the queued events.
+    EXPECT_TRUE(subscriber->ended());
+    EXPECT_FALSE(subscriber->closed());
+    subscriber->take(events);
+    ASSERT_EQ(events.size(), 2);
+    EXPECT_EQ(*events[0], "9\r\ndata: 1\n\n\r\n");
+    EXPECT_EQ(*events[1], "9\r\ndata: 2\n\n\r\n");
+}
+
+TEST(SseHub, SseStreamClosedByClient) {
+    auto subscriber = make_shared<SseHub::Subscriber>("");
+    SseStream stream{make_shared<SseStream::Impl>(subscriber)};
+
+    subscriber->close();
+    EXPECT_FALSE(stream.isOpen());
+    EXPECT_FALSE(stream.send("data: 1\n\n"));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,143 @@
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+
+#include "gtest/gtest.h"
+
+#include "yahat/TimerWheel.h"
+#include "yahat/logging.h"
+
+using namespace std;
+using namespace yahat;
+
+namespace {
+
+size_t runExpired(vector<TimerWheel::callback_t>& expired) {
+    const auto count = expired.size();
+    for(auto& cb : expired) {
+        cb();
+    }
+    expired.clear();
+    return count;
+}
+
+} // anon ns
+
+TEST(TimerWheel, FiresAtTheRightTick) {
+    const auto start = TimerWheel::clock_t::now();
+    TimerWheel wheel{10ms, start};
+    vector<TimerWheel::callback_t> expired;
+
+    int fired = 0;
+    wheel.add(50ms, [&] { ++fired; });
+    EXPECT_EQ(wheel.size(), 1);
+
+    wheel.advance(start + 40ms, expired);
+    EXPECT_EQ(runExpired(expired), 0);
+    EXPECT_EQ(fired, 0);
+
+    wheel.advance(start + 50ms, expired);
+    EXPECT_EQ(runExpired(expired), 1);
+    EXPECT_EQ(fired, 1);
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimerWheel, AddAfterIdle) {
+    const auto start = TimerWheel::clock_t::now();
+    TimerWheel wheel{10ms, start};
+    vector<TimerWheel::callback_t> expired;
+
+    // The wheel has not been advanced for a second
+    const auto now = start + 1s;
+    int fired = 0;
+    wheel.add(50ms, [&] { ++fired; }, now);
+
+    wheel.advance(now + 40ms, expired);
+    EXPECT_EQ(runExpired(expired), 0);
+
+    wheel.advance(now + 50ms, expired);
+    EXPECT_EQ(runExpired(expired), 1);
+    EXPECT_EQ(fired, 1);
+}
+
+TEST(TimerWheel, Cancel) {
+    const auto start = TimerWheel::clock_t::now();
+    TimerWheel wheel{10ms, start};
+    vector<TimerWheel::callback_t> expired;
+
+    int fired = 0;
+    const auto id = wheel.add(50ms, [&] { ++fired; });
+    wheel.add(50ms, [&] { fired += 10; });
+    EXPECT_TRUE(wheel.cancel(id));
+    EXPECT_FALSE(wheel.cancel(id));
+
+    wheel.advance(start + 100ms, expired);
+    runExpired(expired);
+    EXPECT_EQ(fired, 10);
+}
+
+TEST(TimerWheel, HigherLevels) {
+    const auto start = TimerWheel::clock_t::now();
+    TimerWheel wheel{1ms, start};
+    vector<TimerWheel::callback_t> expired;
+
+    // Level 1, 2 and 3, and beyond what the wheel can hold
+    const vector<chrono::milliseconds> delays = {70ms, 4097ms, 300000ms, 20000000ms};
+    vector<int> fired(delays.size());
+    for(size_t i = 0; i < delays.size(); ++i) {
+        wheel.add(delays[i], [&fired, i] { ++fired[i]; });
+    }
+
+    for(size_t i = 0; i < delays.size(); ++i) {
+        wheel.advance(start + delays[i] - 1ms, expired);
+        runExpired(expired);
+        EXPECT_EQ(fired[i], 0) << "delay=" << delays[i].count();
+
+        wheel.advance(start + delays[i], expired);
+        EXPECT_EQ(runExpired(expired), 1);
+        EXPECT_EQ(fired[i], 1) << "delay=" << delays[i].count();
+    }
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimerWheel, Reschedule) {
+    const auto start = TimerWheel::clock_t::now();
+    TimerWheel wheel{10ms, start};
+    vector<TimerWheel::callback_t> expired;
+
+    int fired = 0;
+    function<void()> heartbeat = [&] {
+        ++fired;
+        wheel.add(100ms, heartbeat);
+    };
+    wheel.add(100ms, heartbeat);
+
+    for(auto t = 10ms; t <= 1000ms; t += 10ms) {
+        wheel.advance(start + t, expired);
+        runExpired(expired);
+    }
+    EXPECT_EQ(fired, 10);
+    EXPECT_EQ(wheel.size(), 1);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+#ifndef USE_LOGFAULT
+    Logger::Instance().SetLogLevel(LogLevel::INFO);
+    Logger::Instance().SetHandler([](LogLevel level, const std::string& msg) {
+        static const std::array<std::string, 6> levels = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        std::clog << std::put_time(std::localtime(&now), "%c") << ' '
+                  << levels.at(static_cast<size_t>(level))
+                  << ' ' << std::this_thread::get_id() << ' '
+                  << msg << std::endl;
+    });
+#endif
+
+    return RUN_ALL_TESTS();
+}